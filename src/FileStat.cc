@@ -0,0 +1,250 @@
+#include "FileStat.h"
+#include "ParallelFor.h"
+#include <string.h>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+
+static void statFile(const char *path, FileStat &result) {
+  int wideLength = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+  if (wideLength <= 0)
+    return;
+
+  WCHAR *widePath = new WCHAR[wideLength];
+  MultiByteToWideChar(CP_UTF8, 0, path, -1, widePath, wideLength);
+  HANDLE file = CreateFileW(widePath, FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                            NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+  delete[] widePath;
+  if (file == INVALID_HANDLE_VALUE)
+    return;
+
+  BY_HANDLE_FILE_INFORMATION info;
+  if (GetFileInformationByHandle(file, &info)) {
+    // File times count 100 ns intervals since 1601
+    uint64_t written = ((uint64_t) info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    result.found = true;
+    result.size = ((uint64_t) info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    result.mtime = (int64_t) (written / 10000000) - 11644473600LL;
+    result.inode = ((uint64_t) info.nFileIndexHigh << 32) | info.nFileIndexLow;
+  }
+  CloseHandle(file);
+}
+
+#else
+
+static void statFile(const char *path, FileStat &result) {
+  struct stat st;
+  if (stat(path, &st) != 0)
+    return;
+
+  result.found = true;
+  result.size = (uint64_t) st.st_size;
+  result.mtime = (int64_t) st.st_mtime;
+  result.inode = (uint64_t) st.st_ino;
+}
+
+#endif
+
+#ifdef HAVE_IO_URING
+
+// Requests in flight at once. The completion queue is twice as large, so it
+// can not overflow.
+static const unsigned STAT_RING_ENTRIES = 256;
+
+// A minimal io_uring submitting statx requests, used through the raw system
+// calls so no library is needed
+class StatRing {
+public:
+  StatRing() : fd(-1), sqRing(MAP_FAILED), cqRing(MAP_FAILED), sqes(MAP_FAILED) {}
+
+  ~StatRing() {
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqesSize);
+    if (cqRing != MAP_FAILED)
+      munmap(cqRing, cqRingSize);
+    if (sqRing != MAP_FAILED)
+      munmap(sqRing, sqRingSize);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  // Returns false if the kernel does not provide io_uring or it is not
+  // allowed, as in some containers
+  bool init() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd = (int) syscall(__NR_io_uring_setup, STAT_RING_ENTRIES, &params);
+    if (fd < 0)
+      return false;
+
+    entries = params.sq_entries;
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+    sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    sqes = mmap(NULL, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED)
+      return false;
+
+    sqTail = (unsigned *) ((char *) sqRing + params.sq_off.tail);
+    sqHead = (unsigned *) ((char *) sqRing + params.sq_off.head);
+    sqMask = *(unsigned *) ((char *) sqRing + params.sq_off.ring_mask);
+    sqArray = (unsigned *) ((char *) sqRing + params.sq_off.array);
+    cqHead = (unsigned *) ((char *) cqRing + params.cq_off.head);
+    cqTail = (unsigned *) ((char *) cqRing + params.cq_off.tail);
+    cqMask = *(unsigned *) ((char *) cqRing + params.cq_off.ring_mask);
+    cqes = (io_uring_cqe *) ((char *) cqRing + params.cq_off.cqes);
+    return true;
+  }
+
+  // Stat all `paths` into `stats`. Paths whose request the kernel rejects,
+  // such as kernels before 5.6 which lack statx requests, are added to
+  // `retry`. Returns false if the ring fails.
+  bool run(const std::vector<const char *> &paths, std::vector<FileStat> &stats, std::vector<size_t> &retry) {
+    std::vector<struct statx> buffers(entries);
+    std::vector<size_t> owners(entries);
+    std::vector<unsigned> freeBuffers;
+    for (unsigned i = 0; i < entries; i++)
+      freeBuffers.push_back(i);
+
+    size_t next = 0;
+    size_t completed = 0;
+    while (completed < paths.size()) {
+      // Queue a request for every free buffer
+      unsigned tail = *sqTail;
+      for (; next < paths.size() && !freeBuffers.empty(); next++) {
+        unsigned buffer = freeBuffers.back();
+        freeBuffers.pop_back();
+        owners[buffer] = next;
+
+        unsigned slot = tail++ & sqMask;
+        io_uring_sqe *sqe = (io_uring_sqe *) sqes + slot;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uint64_t) (uintptr_t) paths[next];
+        sqe->len = STATX_SIZE | STATX_MTIME | STATX_INO;
+        sqe->off = (uint64_t) (uintptr_t) &buffers[buffer];
+        sqe->user_data = buffer;
+        sqArray[slot] = slot;
+      }
+      __atomic_store_n(sqTail, tail, __ATOMIC_RELEASE);
+
+      // Submit what the kernel has not taken yet, and wait for a completion
+      unsigned submit = tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+      if (syscall(__NR_io_uring_enter, fd, submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+          errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        return false;
+
+      unsigned head = *cqHead;
+      unsigned end = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+      for (; head != end; head++, completed++) {
+        const io_uring_cqe &cqe = cqes[head & cqMask];
+        unsigned buffer = (unsigned) cqe.user_data;
+        size_t i = owners[buffer];
+        if (cqe.res == 0) {
+          const struct statx &st = buffers[buffer];
+          stats[i].found = true;
+          stats[i].size = st.stx_size;
+          stats[i].mtime = st.stx_mtime.tv_sec;
+          stats[i].inode = st.stx_ino;
+        }
+        else if (cqe.res == -EINVAL || cqe.res == -EOPNOTSUPP) {
+          retry.push_back(i);
+        }
+        freeBuffers.push_back(buffer);
+      }
+      __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+    return true;
+  }
+
+private:
+  int fd;
+  unsigned entries;
+  void *sqRing;
+  void *cqRing;
+  void *sqes;
+  size_t sqRingSize;
+  size_t cqRingSize;
+  size_t sqesSize;
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned sqMask;
+  unsigned *sqArray;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned cqMask;
+  io_uring_cqe *cqes;
+};
+
+#endif
+
+// Hashing and comparing the paths in place saves copying each of them
+struct PathHash {
+  size_t operator()(const char *path) const {
+    size_t hash = 2166136261u;
+    for (const char *p = path; *p; p++)
+      hash = (hash ^ (unsigned char) *p) * 16777619u;
+    return hash;
+  }
+};
+
+struct PathEqual {
+  bool operator()(const char *a, const char *b) const { return strcmp(a, b) == 0; }
+};
+
+void statFiles(const std::vector<const char *> &paths, std::vector<FileStat> &stats, size_t threads) {
+  // The faces of a collection share their path
+  std::vector<const char *> distinct;
+  std::vector<size_t> slots(paths.size());
+  std::unordered_map<const char *, size_t, PathHash, PathEqual> seen;
+  seen.reserve(paths.size());
+  for (size_t i = 0; i < paths.size(); i++) {
+    const char *path = paths[i] ? paths[i] : "";
+    std::pair<std::unordered_map<const char *, size_t, PathHash, PathEqual>::iterator, bool> entry =
+      seen.insert(std::make_pair(path, distinct.size()));
+    if (entry.second)
+      distinct.push_back(path);
+    slots[i] = entry.first->second;
+  }
+
+  std::vector<FileStat> found(distinct.size());
+  std::vector<size_t> pending;
+#ifdef HAVE_IO_URING
+  StatRing ring;
+  if (!ring.init() || !ring.run(distinct, found, pending)) {
+    found.assign(distinct.size(), FileStat());
+    pending.clear();
+    for (size_t i = 0; i < distinct.size(); i++)
+      pending.push_back(i);
+  }
+#else
+  for (size_t i = 0; i < distinct.size(); i++)
+    pending.push_back(i);
+#endif
+
+  parallelFor(pending.size(), threads, [&](size_t i) {
+    statFile(distinct[pending[i]], found[pending[i]]);
+  });
+
+  stats.resize(paths.size());
+  for (size_t i = 0; i < paths.size(); i++)
+    stats[i] = found[slots[i]];
+}
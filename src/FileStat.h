@@ -0,0 +1,32 @@
+#ifndef FILE_STAT_H
+#define FILE_STAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Metadata of a file as the file system reports it
+struct FileStat {
+  bool found;      // False if the file could not be stat'ed
+  uint64_t size;   // In bytes
+  int64_t mtime;   // Last modification, in seconds since the epoch
+  uint64_t inode;  // The file index on Windows
+
+  FileStat() : found(false), size(0), mtime(0), inode(0) {}
+};
+
+// Fields of a FileStat which FontDescriptor::printJson() includes
+enum FileField {
+  FileFieldSize  = 1 << 0,
+  FileFieldMtime = 1 << 1,
+  FileFieldInode = 1 << 2
+};
+
+// Set `stats[i]` to the metadata of the file at `paths[i]`. Each distinct
+// path is stat'ed once, so the faces of a collection share a call. On Linux
+// the calls are submitted in batches through io_uring where the kernel
+// supports it, elsewhere they are made on `threads` threads (the number of
+// hardware threads if 0).
+void statFiles(const std::vector<const char *> &paths, std::vector<FileStat> &stats, size_t threads = 0);
+
+#endif // FILE_STAT_H
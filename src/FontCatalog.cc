@@ -0,0 +1,1433 @@
+#include "FontCatalog.h"
+#include "FontQuery.h"
+#include "MappedFile.h"
+#include "ParallelFor.h"
+#include "ParallelSort.h"
+#include <algorithm>
+#include <chrono>
+#include <ctype.h>
+#include <queue>
+#include <set>
+#include <thread>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Forward declaration of platform-specific function
+extern ResultSet *getAvailableFonts();
+
+const uint32_t FallbackTable::NO_FACE;
+const uint16_t FallbackTable::NO_ENTRY;
+const uint32_t FallbackTable::PAGE_SIZE;
+const uint32_t FallbackTable::PAGE_COUNT;
+
+void FallbackTable::build(const std::vector<uint16_t> &ranks, const std::vector<uint32_t> &faceIds) {
+  faces = faceIds;
+  index.assign(PAGE_COUNT, 0);
+  pages.clear();
+
+  // Page contents to page number, so identical pages are stored once
+  std::map<std::vector<uint16_t>, uint16_t> distinct;
+
+  for (uint32_t page = 0; page < PAGE_COUNT; page++) {
+    std::vector<uint16_t> entries(ranks.begin() + page * PAGE_SIZE, ranks.begin() + (page + 1) * PAGE_SIZE);
+
+    std::map<std::vector<uint16_t>, uint16_t>::iterator it = distinct.find(entries);
+    if (it != distinct.end()) {
+      index[page] = it->second;
+      continue;
+    }
+
+    uint16_t number = (uint16_t) distinct.size();
+    distinct[entries] = number;
+    index[page] = number;
+    pages.insert(pages.end(), entries.begin(), entries.end());
+  }
+}
+
+static int compareStrings(const char *a, const char *b) {
+  return strcmp(a ? a : "", b ? b : "");
+}
+
+// Catalog order: family, style, path, then PostScript name
+static int compareKeys(const char *familyA, const char *styleA, const char *pathA, const char *psA,
+                       const char *familyB, const char *styleB, const char *pathB, const char *psB) {
+  int cmp = compareStrings(familyA, familyB);
+  if (cmp == 0)
+    cmp = compareStrings(styleA, styleB);
+  if (cmp == 0)
+    cmp = compareStrings(pathA, pathB);
+  if (cmp == 0)
+    cmp = compareStrings(psA, psB);
+  return cmp;
+}
+
+static bool descriptorBefore(FontDescriptor *a, FontDescriptor *b) {
+  return compareKeys(a->family, a->style, a->path, a->postscriptName,
+                     b->family, b->style, b->path, b->postscriptName) < 0;
+}
+
+// Adds `str` to the string pool once and returns its offset
+static uint32_t intern(std::vector<char> &strings, std::unordered_map<std::string, uint32_t> &ids, const char *str) {
+  if (!str)
+    return 0;
+
+  std::unordered_map<std::string, uint32_t>::iterator it = ids.find(str);
+  if (it != ids.end())
+    return it->second;
+
+  uint32_t offset = (uint32_t) strings.size();
+  strings.insert(strings.end(), str, str + strlen(str) + 1);
+  ids[str] = offset;
+  return offset;
+}
+
+FontCatalog::FontCatalog() : file(NULL) {}
+
+FontCatalog::FontCatalog(ResultSet *fonts) : file(NULL) {
+  std::vector<FontDescriptor *> sorted(fonts->begin(), fonts->end());
+  std::stable_sort(sorted.begin(), sorted.end(), descriptorBefore);
+
+  // Offset 0 is the empty string, used for missing strings too
+  std::vector<char> pool(1, '\0');
+  std::unordered_map<std::string, uint32_t> stringIds;
+  stringIds[""] = 0;
+
+  std::vector<CatalogFace> built;
+  std::vector<uint32_t> starts;
+  built.reserve(sorted.size());
+  for (std::vector<FontDescriptor *>::iterator it = sorted.begin(); it != sorted.end(); it++) {
+    FontDescriptor *font = *it;
+    CatalogFace face;
+    face.path = intern(pool, stringIds, font->path);
+    face.postscriptName = intern(pool, stringIds, font->postscriptName);
+    face.family = intern(pool, stringIds, font->family);
+    face.style = intern(pool, stringIds, font->style);
+    face.weight = font->weight;
+    face.width = font->width;
+    face.weightMin = (int16_t) font->weightMin;
+    face.weightMax = (int16_t) font->weightMax;
+    face.widthMin = (int16_t) font->widthMin;
+    face.widthMax = (int16_t) font->widthMax;
+    face.flags = (font->italic ? CatalogFaceItalic : 0) |
+                 (font->oblique ? CatalogFaceOblique : 0) |
+                 (font->monospace ? CatalogFaceMonospace : 0);
+    face.index = (uint32_t) font->index;
+
+    // Faces are sorted, so each family starts where the family id changes
+    if (face.family != 0 && (starts.empty() || built[starts.back()].family != face.family))
+      starts.push_back((uint32_t) built.size());
+
+    built.push_back(face);
+  }
+
+  // Language ids follow the sorted tags, each face gets a bitset of them
+  std::set<std::string> tags;
+  for (size_t i = 0; i < sorted.size(); i++)
+    tags.insert(sorted[i]->languages.begin(), sorted[i]->languages.end());
+
+  std::vector<uint32_t> languageTags;
+  std::unordered_map<std::string, uint32_t> languageIds;
+  for (std::set<std::string>::iterator it = tags.begin(); it != tags.end(); it++) {
+    languageIds[*it] = (uint32_t) languageTags.size();
+    languageTags.push_back(intern(pool, stringIds, it->c_str()));
+  }
+
+  size_t words = (languageTags.size() + 63) / 64;
+  std::vector<uint64_t> sets(sorted.size() * words);
+  for (size_t i = 0; i < sorted.size(); i++) {
+    const std::vector<std::string> &faceLanguages = sorted[i]->languages;
+    for (size_t j = 0; j < faceLanguages.size(); j++) {
+      uint32_t language = languageIds[faceLanguages[j]];
+      sets[i * words + language / 64] |= (uint64_t) 1 << (language % 64);
+    }
+  }
+
+  // Names of each face. Platforms which do not list them get the primary
+  // names, so every face can be found by those.
+  std::vector<CatalogAlias> names;
+  std::vector<uint32_t> aliasOffsets(1, 0);
+  for (size_t i = 0; i < sorted.size(); i++) {
+    std::vector<FontAlias> faceAliases = sorted[i]->aliases;
+    if (faceAliases.empty()) {
+      faceAliases.push_back(FontAlias(FontNameFamily, sorted[i]->family, NULL));
+      faceAliases.push_back(FontAlias(FontNameStyle, sorted[i]->style, NULL));
+      faceAliases.push_back(FontAlias(FontNamePostscript, sorted[i]->postscriptName, NULL));
+    }
+
+    for (size_t j = 0; j < faceAliases.size(); j++) {
+      CatalogAlias alias;
+      alias.face = (uint32_t) i;
+      alias.kind = faceAliases[j].kind;
+      alias.name = intern(pool, stringIds, faceAliases[j].name.c_str());
+      alias.language = intern(pool, stringIds, faceAliases[j].language.c_str());
+      if (alias.name != 0)
+        names.push_back(alias);
+    }
+    aliasOffsets.push_back((uint32_t) names.size());
+  }
+
+  strings.assign(pool);
+  faces.assign(built);
+  languages.assign(languageTags);
+  languageSets.assign(sets);
+  aliases.assign(names);
+  aliasStarts.assign(aliasOffsets);
+  buildNameIndex();
+  familyStarts.assign(starts);
+  buildIndexes();
+
+  std::vector<FontMetrics> metrics(faces.size());
+  std::vector<uint8_t> loaded(faces.size());
+  faceMetrics.assign(metrics);
+  metricsLoaded.assign(loaded);
+
+  std::vector<FontFingerprint> fingerprints(faces.size());
+  std::vector<uint8_t> states(faces.size(), FingerprintMissing);
+  faceFingerprints.assign(fingerprints);
+  fingerprintStates.assign(states);
+
+  std::vector<uint8_t> layoutRead(faces.size());
+  layoutLoaded.assign(layoutRead);
+}
+
+// Orders face ids by one of the numeric fields, then by id
+struct NumericOrder {
+  const CatalogFace *faces;
+  int32_t CatalogFace::*field;
+
+  bool operator()(uint32_t a, uint32_t b) const {
+    int32_t va = faces[a].*field;
+    int32_t vb = faces[b].*field;
+    return va != vb ? va < vb : a < b;
+  }
+};
+
+// Orders face ids by path, collection index, PostScript name and id
+struct PathOrder {
+  const FontCatalog *catalog;
+
+  bool operator()(uint32_t a, uint32_t b) const {
+    const CatalogFace &fa = catalog->face(a);
+    const CatalogFace &fb = catalog->face(b);
+    int cmp = fa.path == fb.path ? 0 : strcmp(catalog->string(fa.path), catalog->string(fb.path));
+    if (cmp != 0)
+      return cmp < 0;
+    if (fa.index != fb.index)
+      return fa.index < fb.index;
+    cmp = fa.postscriptName == fb.postscriptName ? 0 : strcmp(catalog->string(fa.postscriptName), catalog->string(fb.postscriptName));
+    return cmp != 0 ? cmp < 0 : a < b;
+  }
+};
+
+// Orders face ids by PostScript name, then by id
+struct PostscriptOrder {
+  const FontCatalog *catalog;
+
+  bool operator()(uint32_t a, uint32_t b) const {
+    uint32_t pa = catalog->face(a).postscriptName;
+    uint32_t pb = catalog->face(b).postscriptName;
+    int cmp = pa == pb ? 0 : strcmp(catalog->string(pa), catalog->string(pb));
+    return cmp != 0 ? cmp < 0 : a < b;
+  }
+};
+
+// FNV-1a of `name` folded to lower case, as caseInsensitiveMatch() compares
+static uint32_t hashName(const char *name) {
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *) name; *p; p++) {
+    hash ^= (uint32_t) tolower(*p);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static const uint32_t NO_ALIAS = 0xFFFFFFFF;
+
+void FontCatalog::buildNameIndex() {
+  // At most half of the buckets are used
+  size_t bucketCount = 1;
+  while (bucketCount < aliases.size() * 2)
+    bucketCount *= 2;
+
+  std::vector<uint32_t> buckets(bucketCount, NO_ALIAS);
+  std::vector<uint32_t> next(aliases.size(), NO_ALIAS);
+
+  // Insert backwards so chains are in alias order, and so in catalog order
+  for (size_t i = aliases.size(); i-- > 0;) {
+    uint32_t bucket = hashName(string(aliases[i].name)) & (uint32_t) (bucketCount - 1);
+    next[i] = buckets[bucket];
+    buckets[bucket] = (uint32_t) i;
+  }
+
+  nameBuckets.assign(buckets);
+  nameNext.assign(next);
+}
+
+void FontCatalog::facesNamed(const char *name, FontNameKind kind, std::vector<uint32_t> &ids) const {
+  ids.clear();
+  if (!name || nameBuckets.empty())
+    return;
+
+  // The length of a chain is bounded in case the catalog file is damaged
+  uint32_t alias = nameBuckets[hashName(name) & (uint32_t) (nameBuckets.size() - 1)];
+  for (size_t steps = 0; alias != NO_ALIAS && steps < aliases.size(); alias = nameNext[alias], steps++) {
+    const CatalogAlias &entry = aliases[alias];
+    if (entry.kind != (uint32_t) kind || !caseInsensitiveMatch(string(entry.name), name))
+      continue;
+
+    // A face can have the same name in several languages
+    if (ids.empty() || ids.back() != entry.face)
+      ids.push_back(entry.face);
+  }
+}
+
+std::vector<uint32_t> FontCatalog::faceIds(size_t start) const {
+  std::vector<uint32_t> ids;
+  ids.reserve(start < faces.size() ? faces.size() - start : 0);
+  for (size_t id = start; id < faces.size(); id++)
+    ids.push_back((uint32_t) id);
+  return ids;
+}
+
+void FontCatalog::buildIndexes() {
+  std::vector<uint32_t> ids = faceIds();
+  std::vector<uint32_t> byWeight = ids;
+  std::vector<uint32_t> byWidth = ids;
+  std::vector<uint32_t> byPath = ids;
+  std::vector<uint32_t> byPostscriptName = ids;
+
+  NumericOrder weightOrdering = { faces.data(), &CatalogFace::weight };
+  NumericOrder widthOrdering = { faces.data(), &CatalogFace::width };
+  PathOrder pathOrdering = { this };
+  PostscriptOrder postscriptOrdering = { this };
+  parallelSort(byWeight.begin(), byWeight.end(), weightOrdering);
+  parallelSort(byWidth.begin(), byWidth.end(), widthOrdering);
+  parallelSort(byPath.begin(), byPath.end(), pathOrdering);
+  parallelSort(byPostscriptName.begin(), byPostscriptName.end(), postscriptOrdering);
+
+  std::vector<uint32_t> variable;
+  for (size_t i = 0; i < faces.size(); i++) {
+    if (faces[i].weightMin != faces[i].weightMax || faces[i].widthMin != faces[i].widthMax)
+      variable.push_back((uint32_t) i);
+  }
+
+  weightOrder.assign(byWeight);
+  widthOrder.assign(byWidth);
+  variableFaces.assign(variable);
+  pathOrder.assign(byPath);
+  postscriptOrder.assign(byPostscriptName);
+}
+
+// Appends the ids of `index` whose `field` lies in [min, max], then those of
+// `variable` whose range [rangeMin, rangeMax] overlaps it but whose `field` does not
+// lie in it
+static void facesInRange(const CatalogArray<CatalogFace> &faces, const CatalogArray<uint32_t> &index,
+                         const CatalogArray<uint32_t> &variable, int32_t CatalogFace::*field,
+                         int16_t CatalogFace::*rangeMin, int16_t CatalogFace::*rangeMax, int min, int max,
+                         std::vector<uint32_t> &ids) {
+  size_t low = 0;
+  size_t high = index.size();
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (faces[index[mid]].*field < min)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+
+  for (size_t i = low; i < index.size() && faces[index[i]].*field <= max; i++)
+    ids.push_back(index[i]);
+
+  for (size_t i = 0; i < variable.size(); i++) {
+    const CatalogFace &face = faces[variable[i]];
+    if ((face.*field < min || face.*field > max) && face.*rangeMin <= max && face.*rangeMax >= min)
+      ids.push_back(variable[i]);
+  }
+}
+
+void FontCatalog::facesByWeight(int min, int max, std::vector<uint32_t> &ids) const {
+  facesInRange(faces, weightOrder, variableFaces, &CatalogFace::weight, &CatalogFace::weightMin,
+               &CatalogFace::weightMax, min, max, ids);
+}
+
+void FontCatalog::facesByWidth(int min, int max, std::vector<uint32_t> &ids) const {
+  facesInRange(faces, widthOrder, variableFaces, &CatalogFace::width, &CatalogFace::widthMin,
+               &CatalogFace::widthMax, min, max, ids);
+}
+
+FontCatalog::~FontCatalog() {
+  for (std::map<std::string, FallbackTable *>::iterator it = fallbackTables.begin(); it != fallbackTables.end(); it++)
+    delete it->second;
+  for (std::map<std::string, std::vector<uint32_t> *>::iterator it = fallbackChains.begin(); it != fallbackChains.end(); it++)
+    delete it->second;
+  delete file;
+}
+
+// Catalog files start with a header locating each array. Arrays are stored
+// in the byte order and layout of the writer, aligned to 8 bytes, so they can
+// be used in place once mapped.
+static const char CATALOG_MAGIC[8] = { 'L', 'F', 'J', 'C', 'A', 'T', 'L', 'G' };
+static const uint32_t CATALOG_VERSION = 8;
+static const uint32_t CATALOG_BYTE_ORDER = 0x01020304;
+
+// The stamp comes first, so it can be read without reading the rest
+enum CatalogSection {
+  CatalogSectionStamp,
+  CatalogSectionStrings,
+  CatalogSectionFaces,
+  CatalogSectionFamilyStarts,
+  CatalogSectionWeightOrder,
+  CatalogSectionWidthOrder,
+  CatalogSectionVariableFaces,
+  CatalogSectionPathOrder,
+  CatalogSectionPostscriptOrder,
+  CatalogSectionMetrics,
+  CatalogSectionMetricsLoaded,
+  CatalogSectionLanguages,
+  CatalogSectionLanguageSets,
+  CatalogSectionAliases,
+  CatalogSectionAliasStarts,
+  CatalogSectionNameBuckets,
+  CatalogSectionNameNext,
+  CatalogSectionFingerprints,
+  CatalogSectionFingerprintStates,
+  CatalogSectionScriptTags,
+  CatalogSectionScriptSets,
+  CatalogSectionFeatureTags,
+  CatalogSectionFeatureSets,
+  CatalogSectionLayoutLoaded,
+  CatalogSectionCount
+};
+
+struct CatalogFileSection {
+  uint64_t offset;
+  uint64_t size;    // In bytes
+};
+
+struct CatalogFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  CatalogFileSection sections[CatalogSectionCount];
+};
+
+static_assert(sizeof(CatalogFace) == 40, "CatalogFace is stored in catalog files");
+static_assert(sizeof(FontMetrics) == 48, "FontMetrics is stored in catalog files");
+static_assert(sizeof(CatalogAlias) == 16, "CatalogAlias is stored in catalog files");
+static_assert(sizeof(FontFingerprint) == 32, "FontFingerprint is stored in catalog files");
+
+// Creates the directories leading up to the file at `path`
+static void makeParentDirectories(const std::string &path) {
+  for (size_t end = path.find_first_of("/\\", 1); end != std::string::npos; end = path.find_first_of("/\\", end + 1)) {
+    std::string directory = path.substr(0, end);
+#ifdef _WIN32
+    CreateDirectoryA(directory.c_str(), NULL);
+#else
+    mkdir(directory.c_str(), 0755);
+#endif
+  }
+}
+
+bool FontCatalog::save(const char *path, std::string &error) const {
+  const void *data[CatalogSectionCount] = {
+    sourceStamp.data(), strings.data(), faces.data(), familyStarts.data(), weightOrder.data(), widthOrder.data(),
+    variableFaces.data(), pathOrder.data(), postscriptOrder.data(), faceMetrics.data(), metricsLoaded.data(),
+    languages.data(), languageSets.data(), aliases.data(), aliasStarts.data(),
+    nameBuckets.data(), nameNext.data(), faceFingerprints.data(), fingerprintStates.data(),
+    scriptTags.data(), scriptSets.data(), featureTags.data(), featureSets.data(), layoutLoaded.data()
+  };
+  uint64_t sizes[CatalogSectionCount] = {
+    sourceStamp.size(), strings.size(), faces.size() * sizeof(CatalogFace), familyStarts.size() * sizeof(uint32_t),
+    weightOrder.size() * sizeof(uint32_t), widthOrder.size() * sizeof(uint32_t),
+    variableFaces.size() * sizeof(uint32_t), pathOrder.size() * sizeof(uint32_t), postscriptOrder.size() * sizeof(uint32_t),
+    faceMetrics.size() * sizeof(FontMetrics), metricsLoaded.size(),
+    languages.size() * sizeof(uint32_t), languageSets.size() * sizeof(uint64_t),
+    aliases.size() * sizeof(CatalogAlias), aliasStarts.size() * sizeof(uint32_t),
+    nameBuckets.size() * sizeof(uint32_t), nameNext.size() * sizeof(uint32_t),
+    faceFingerprints.size() * sizeof(FontFingerprint), fingerprintStates.size(),
+    scriptTags.size() * sizeof(uint32_t), scriptSets.size() * sizeof(uint64_t),
+    featureTags.size() * sizeof(uint32_t), featureSets.size() * sizeof(uint64_t), layoutLoaded.size()
+  };
+
+  CatalogFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+  header.version = CATALOG_VERSION;
+  header.byteOrder = CATALOG_BYTE_ORDER;
+
+  uint64_t offset = sizeof(header);
+  for (int i = 0; i < CatalogSectionCount; i++) {
+    offset = (offset + 7) & ~(uint64_t) 7;
+    header.sections[i].offset = offset;
+    header.sections[i].size = sizes[i];
+    offset += sizes[i];
+  }
+
+  makeParentDirectories(path);
+  std::string temporary = std::string(path) + ".tmp" + std::to_string((unsigned long) getpid());
+  FILE *out = fopen(temporary.c_str(), "wb");
+  if (!out) {
+    error = std::string("can not create ") + temporary;
+    return false;
+  }
+
+  static const char padding[8] = { 0 };
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+  uint64_t written = sizeof(header);
+  for (int i = 0; ok && i < CatalogSectionCount; i++) {
+    ok = fwrite(padding, 1, header.sections[i].offset - written, out) == header.sections[i].offset - written &&
+         (sizes[i] == 0 || fwrite(data[i], sizes[i], 1, out) == 1);
+    written = header.sections[i].offset + sizes[i];
+  }
+
+  if (fclose(out) != 0)
+    ok = false;
+  if (!ok) {
+    remove(temporary.c_str());
+    error = std::string("can not write ") + temporary;
+    return false;
+  }
+
+#ifdef _WIN32
+  ok = MoveFileExA(temporary.c_str(), path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+  ok = rename(temporary.c_str(), path) == 0;
+#endif
+  if (!ok) {
+    remove(temporary.c_str());
+    error = std::string("can not replace ") + path;
+  }
+  return ok;
+}
+
+std::string FontCatalog::defaultPath() {
+  std::string directory;
+#ifdef _WIN32
+  const char *local = getenv("LOCALAPPDATA");
+  if (local && local[0])
+    directory = local;
+#elif defined(__APPLE__)
+  const char *home = getenv("HOME");
+  if (home && home[0])
+    directory = std::string(home) + "/Library/Caches";
+#else
+  const char *cache = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  if (cache && cache[0] == '/')
+    directory = cache;
+  else if (home && home[0])
+    directory = std::string(home) + "/.cache";
+#endif
+  if (directory.empty())
+    return directory;
+
+  return directory + "/list-fonts-json/catalog";
+}
+
+// Point `array` at a section of a mapped catalog file. Returns false if the
+// section does not hold a whole number of items.
+template <typename T>
+static bool referSection(CatalogArray<T> &array, const MappedFile &file, const CatalogFileSection &section) {
+  if (section.size % sizeof(T) != 0)
+    return false;
+  array.refer((const T *) (file.data() + section.offset), (size_t) (section.size / sizeof(T)));
+  return true;
+}
+
+// True if all ids or offsets in `index` are below `count`
+static bool validIds(const CatalogArray<uint32_t> &index, size_t count) {
+  for (size_t i = 0; i < index.size(); i++) {
+    if (index[i] >= count)
+      return false;
+  }
+  return true;
+}
+
+// True if all entries of a hash chain array are alias ids or NO_ALIAS
+static bool validAliases(const CatalogArray<uint32_t> &links, size_t count) {
+  for (size_t i = 0; i < links.size(); i++) {
+    if (links[i] != NO_ALIAS && links[i] >= count)
+      return false;
+  }
+  return true;
+}
+
+FontCatalog *FontCatalog::open(const char *path, std::string &error) {
+  MappedFile *mapped = new MappedFile();
+  if (!mapped->open(path, MappedFile::AccessRandom)) {
+    delete mapped;
+    error = std::string("can not open ") + path;
+    return NULL;
+  }
+
+  CatalogFileHeader header;
+  if (mapped->size() < sizeof(header)) {
+    delete mapped;
+    error = std::string(path) + " is not a font catalog";
+    return NULL;
+  }
+
+  memcpy(&header, mapped->data(), sizeof(header));
+  if (memcmp(header.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0 ||
+      header.version != CATALOG_VERSION || header.byteOrder != CATALOG_BYTE_ORDER) {
+    delete mapped;
+    error = std::string(path) + " is not a font catalog of this version";
+    return NULL;
+  }
+
+  FontCatalog *catalog = new FontCatalog();
+  catalog->file = mapped;
+
+  bool ok = true;
+  for (int i = 0; i < CatalogSectionCount; i++) {
+    const CatalogFileSection &section = header.sections[i];
+    if (section.offset % 8 != 0 || section.offset > mapped->size() || section.size > mapped->size() - section.offset)
+      ok = false;
+  }
+
+  const CatalogFileSection *sections = header.sections;
+  ok = ok &&
+       referSection(catalog->sourceStamp, *mapped, sections[CatalogSectionStamp]) &&
+       referSection(catalog->strings, *mapped, sections[CatalogSectionStrings]) &&
+       referSection(catalog->faces, *mapped, sections[CatalogSectionFaces]) &&
+       referSection(catalog->familyStarts, *mapped, sections[CatalogSectionFamilyStarts]) &&
+       referSection(catalog->weightOrder, *mapped, sections[CatalogSectionWeightOrder]) &&
+       referSection(catalog->widthOrder, *mapped, sections[CatalogSectionWidthOrder]) &&
+       referSection(catalog->variableFaces, *mapped, sections[CatalogSectionVariableFaces]) &&
+       referSection(catalog->pathOrder, *mapped, sections[CatalogSectionPathOrder]) &&
+       referSection(catalog->postscriptOrder, *mapped, sections[CatalogSectionPostscriptOrder]) &&
+       referSection(catalog->faceMetrics, *mapped, sections[CatalogSectionMetrics]) &&
+       referSection(catalog->metricsLoaded, *mapped, sections[CatalogSectionMetricsLoaded]) &&
+       referSection(catalog->languages, *mapped, sections[CatalogSectionLanguages]) &&
+       referSection(catalog->languageSets, *mapped, sections[CatalogSectionLanguageSets]) &&
+       referSection(catalog->aliases, *mapped, sections[CatalogSectionAliases]) &&
+       referSection(catalog->aliasStarts, *mapped, sections[CatalogSectionAliasStarts]) &&
+       referSection(catalog->nameBuckets, *mapped, sections[CatalogSectionNameBuckets]) &&
+       referSection(catalog->nameNext, *mapped, sections[CatalogSectionNameNext]) &&
+       referSection(catalog->faceFingerprints, *mapped, sections[CatalogSectionFingerprints]) &&
+       referSection(catalog->fingerprintStates, *mapped, sections[CatalogSectionFingerprintStates]) &&
+       referSection(catalog->scriptTags, *mapped, sections[CatalogSectionScriptTags]) &&
+       referSection(catalog->scriptSets, *mapped, sections[CatalogSectionScriptSets]) &&
+       referSection(catalog->featureTags, *mapped, sections[CatalogSectionFeatureTags]) &&
+       referSection(catalog->featureSets, *mapped, sections[CatalogSectionFeatureSets]) &&
+       referSection(catalog->layoutLoaded, *mapped, sections[CatalogSectionLayoutLoaded]);
+
+  // Check everything used as an offset or id, so a damaged file can not
+  // lead to reads outside of it
+  size_t count = catalog->faces.size();
+  ok = ok && !catalog->strings.empty() && catalog->strings.back() == '\0' &&
+       catalog->weightOrder.size() == count && catalog->widthOrder.size() == count &&
+       catalog->pathOrder.size() == count && catalog->postscriptOrder.size() == count &&
+       catalog->faceMetrics.size() == count && catalog->metricsLoaded.size() == count &&
+       catalog->faceFingerprints.size() == count && catalog->fingerprintStates.size() == count &&
+       validIds(catalog->familyStarts, count) && validIds(catalog->weightOrder, count) &&
+       validIds(catalog->widthOrder, count) && validIds(catalog->variableFaces, count) &&
+       validIds(catalog->pathOrder, count) &&
+       validIds(catalog->postscriptOrder, count) &&
+       catalog->languageSets.size() == count * catalog->languageWords() &&
+       catalog->scriptSets.size() == count * catalog->scriptWords() &&
+       catalog->featureSets.size() == count * catalog->featureWords() &&
+       catalog->layoutLoaded.size() == count &&
+       validIds(catalog->languages, catalog->strings.size()) &&
+       catalog->aliasStarts.size() == count + 1 && catalog->aliasStarts[count] == catalog->aliases.size() &&
+       catalog->nameNext.size() == catalog->aliases.size() &&
+       (catalog->nameBuckets.size() & (catalog->nameBuckets.size() - 1)) == 0 &&
+       validAliases(catalog->nameBuckets, catalog->aliases.size()) &&
+       validAliases(catalog->nameNext, catalog->aliases.size());
+
+  for (size_t i = 0; ok && i < count; i++)
+    ok = catalog->aliasStarts[i] <= catalog->aliasStarts[i + 1];
+
+  for (size_t i = 0; ok && i < catalog->aliases.size(); i++) {
+    const CatalogAlias &alias = catalog->aliases[i];
+    ok = alias.face < count && alias.kind <= FontNamePostscript &&
+         alias.name < catalog->strings.size() && alias.language < catalog->strings.size();
+  }
+
+  for (size_t i = 0; ok && i < count; i++) {
+    const CatalogFace &face = catalog->faces[i];
+    size_t limit = catalog->strings.size();
+    ok = face.path < limit && face.postscriptName < limit && face.family < limit && face.style < limit;
+  }
+
+  if (!ok) {
+    delete catalog;
+    error = std::string(path) + " is damaged";
+    return NULL;
+  }
+
+  return catalog;
+}
+
+static FontCatalog *sharedCatalog = NULL;
+
+// How long shared() waits for another process to build the catalog before
+// building its own, and how often it looks for the result meanwhile
+static const int CATALOG_LOCK_TIMEOUT_MS = 120000;
+static const int CATALOG_POLL_INTERVAL_MS = 20;
+static const uint64_t MAX_STAMP_SIZE = 1024;
+
+// Exclusive advisory lock on a file. The system releases it when the lock is
+// destroyed or the process exits, so a crashed holder does not block others.
+class CatalogLock {
+public:
+  CatalogLock(const std::string &path) {
+#ifdef _WIN32
+    handle = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+    fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+#endif
+  }
+
+  ~CatalogLock() {
+#ifdef _WIN32
+    if (handle != INVALID_HANDLE_VALUE)
+      CloseHandle(handle);
+#else
+    if (fd >= 0)
+      close(fd);
+#endif
+  }
+
+  // Whether the lock file could be opened
+  bool valid() const {
+#ifdef _WIN32
+    return handle != INVALID_HANDLE_VALUE;
+#else
+    return fd >= 0;
+#endif
+  }
+
+  // Take the lock unless another process holds it
+  bool tryAcquire() {
+#ifdef _WIN32
+    OVERLAPPED overlapped;
+    memset(&overlapped, 0, sizeof(overlapped));
+    return LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped) != 0;
+#else
+    return flock(fd, LOCK_EX | LOCK_NB) == 0;
+#endif
+  }
+
+private:
+#ifdef _WIN32
+  HANDLE handle;
+#else
+  int fd;
+#endif
+};
+
+// Stamp of the catalog file at `path`, read without mapping the rest of it.
+// Empty if the file is missing or not a catalog of this version.
+static std::string readCatalogStamp(const std::string &path) {
+  FILE *in = fopen(path.c_str(), "rb");
+  if (!in)
+    return "";
+
+  std::string stamp;
+  CatalogFileHeader header;
+  const CatalogFileSection &section = header.sections[CatalogSectionStamp];
+  if (fread(&header, sizeof(header), 1, in) == 1 &&
+      memcmp(header.magic, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) == 0 &&
+      header.version == CATALOG_VERSION && header.byteOrder == CATALOG_BYTE_ORDER &&
+      section.size <= MAX_STAMP_SIZE && fseek(in, (long) section.offset, SEEK_SET) == 0) {
+    stamp.resize((size_t) section.size);
+    if (!stamp.empty() && fread(&stamp[0], stamp.size(), 1, in) != 1)
+      stamp.clear();
+  }
+  fclose(in);
+  return stamp;
+}
+
+// The catalog at `path` if it was built from the fonts of `stamp`
+static FontCatalog *openIfCurrent(const std::string &path, const std::string &stamp) {
+  if (readCatalogStamp(path) != stamp)
+    return NULL;
+
+  // The file may have been replaced since the stamp was read
+  std::string error;
+  FontCatalog *catalog = FontCatalog::open(path.c_str(), error);
+  if (catalog && catalog->stamp() != stamp) {
+    delete catalog;
+    catalog = NULL;
+  }
+  return catalog;
+}
+
+FontCatalog *FontCatalog::shared() {
+  if (!sharedCatalog) {
+    std::string stamp = fontSourceStamp();
+    std::string path = defaultPath();
+    if (!stamp.empty() && !path.empty())
+      sharedCatalog = openShared(path, stamp);
+    if (!sharedCatalog)
+      sharedCatalog = build(stamp);
+  }
+  return sharedCatalog;
+}
+
+void FontCatalog::setShared(FontCatalog *catalog) {
+  delete sharedCatalog;
+  sharedCatalog = catalog;
+}
+
+FontCatalog *FontCatalog::build() {
+  return build(fontSourceStamp());
+}
+
+FontCatalog *FontCatalog::build(const std::string &stamp) {
+  ResultSet *fonts = getAvailableFonts();
+  FontCatalog *catalog = new FontCatalog(fonts);
+  delete fonts;
+
+  std::vector<char> chars(stamp.begin(), stamp.end());
+  catalog->sourceStamp.assign(chars);
+  return catalog;
+}
+
+// Many processes starting at once on a cold host would each enumerate the
+// fonts. Instead, the first to take the lock builds the catalog and renames
+// it into place, and the others map it as soon as it appears. Returns NULL
+// if the lock can not be used or the catalog is not there in time, and the
+// caller builds its own.
+FontCatalog *FontCatalog::openShared(const std::string &path, const std::string &stamp) {
+  FontCatalog *catalog = openIfCurrent(path, stamp);
+  if (catalog)
+    return catalog;
+
+  makeParentDirectories(path);
+  CatalogLock lock(path + ".lock");
+  if (!lock.valid())
+    return NULL;
+
+  std::chrono::steady_clock::time_point deadline =
+    std::chrono::steady_clock::now() + std::chrono::milliseconds(CATALOG_LOCK_TIMEOUT_MS);
+  while (!lock.tryAcquire()) {
+    if (std::chrono::steady_clock::now() >= deadline)
+      return NULL;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(CATALOG_POLL_INTERVAL_MS));
+    if ((catalog = openIfCurrent(path, stamp)))
+      return catalog;
+  }
+
+  // The previous holder may have saved it just before releasing the lock
+  if ((catalog = openIfCurrent(path, stamp)))
+    return catalog;
+
+  // Save while still holding the lock. If the cache can not be written, each
+  // process keeps the catalog it built, as without a cache. Layout tags are
+  // not read here, that would hold the others behind reading every font
+  // file. They are saved only for the faces warm or snapshot read them for.
+  catalog = build(stamp);
+  std::string error;
+  catalog->save(path.c_str(), error);
+  return catalog;
+}
+
+size_t FontCatalog::faceAfter(const char *family, const char *style, const char *path, const char *postscriptName) const {
+  size_t low = 0;
+  size_t high = faces.size();
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    const CatalogFace &f = faces[mid];
+    int cmp = compareKeys(string(f.family), string(f.style), string(f.path), string(f.postscriptName),
+                          family, style, path, postscriptName);
+    if (cmp <= 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+size_t FontCatalog::familyAfter(const char *family) const {
+  size_t low = 0;
+  size_t high = familyStarts.size();
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (compareStrings(familyName(mid), family) <= 0)
+      low = mid + 1;
+    else
+      high = mid;
+  }
+  return low;
+}
+
+FontDescriptor *FontCatalog::descriptor(size_t id) const {
+  const CatalogFace &f = faces[id];
+  FontDescriptor *font = new FontDescriptor(
+    string(f.path),
+    string(f.postscriptName),
+    string(f.family),
+    string(f.style),
+    (FontWeight) f.weight,
+    (FontWidth) f.width,
+    (f.flags & CatalogFaceItalic) != 0,
+    (f.flags & CatalogFaceOblique) != 0,
+    (f.flags & CatalogFaceMonospace) != 0,
+    (int) f.index
+  );
+  font->weightMin = f.weightMin;
+  font->weightMax = f.weightMax;
+  font->widthMin = f.widthMin;
+  font->widthMax = f.widthMax;
+  return font;
+}
+
+// Lower case with '-' between language and territory, as fontconfig has it
+static std::string normalizeLanguage(const std::string &tag) {
+  std::string normalized;
+  for (size_t i = 0; i < tag.size(); i++)
+    normalized += tag[i] == '_' ? '-' : (char) tolower((unsigned char) tag[i]);
+  return normalized;
+}
+
+// Whether `a` and `b` are equal, or one is the other with a territory
+static bool languagesMatch(const std::string &a, const char *b) {
+  size_t length = strlen(b);
+  size_t common = std::min(a.size(), length);
+  if (a.compare(0, common, b, common) != 0)
+    return false;
+  return a.size() == length || (a.size() > length ? a[length] : b[common]) == '-';
+}
+
+std::vector<uint64_t> FontCatalog::languageMask(const char *tags) const {
+  std::vector<uint64_t> mask(languageWords());
+  std::string list(tags ? tags : "");
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+
+    std::string tag = normalizeLanguage(list.substr(start, end - start));
+    for (size_t language = 0; !tag.empty() && language < languages.size(); language++) {
+      if (languagesMatch(tag, languageName(language)))
+        mask[language / 64] |= (uint64_t) 1 << (language % 64);
+    }
+    start = end + 1;
+  }
+  return mask;
+}
+
+// Bitset over the sorted `tags` of those matching any tag of a comma
+// separated list. Script tags also match the other tag of Indic scripts.
+static std::vector<uint64_t> tagMask(const CatalogArray<uint32_t> &tags, const char *list, bool scripts) {
+  std::vector<uint64_t> mask((tags.size() + 63) / 64);
+  std::string names(list ? list : "");
+  size_t start = 0;
+  while (start <= names.size()) {
+    size_t end = names.find(',', start);
+    if (end == std::string::npos)
+      end = names.size();
+
+    uint32_t wanted[2] = { 0, 0 };
+    if (parseLayoutTag(names.c_str() + start, end - start, wanted[0]) && scripts)
+      wanted[1] = alternateScriptTag(wanted[0]);
+    for (int i = 0; i < 2 && wanted[i]; i++) {
+      const uint32_t *found = std::lower_bound(tags.begin(), tags.end(), wanted[i]);
+      if (found != tags.end() && *found == wanted[i]) {
+        size_t bit = found - tags.begin();
+        mask[bit / 64] |= (uint64_t) 1 << (bit % 64);
+      }
+    }
+    start = end + 1;
+  }
+  return mask;
+}
+
+std::vector<uint64_t> FontCatalog::scriptMask(const char *tags) const {
+  return tagMask(scriptTags, tags, true);
+}
+
+std::vector<uint64_t> FontCatalog::featureMask(const char *tags) const {
+  return tagMask(featureTags, tags, false);
+}
+
+// Calls read(file, id) for each face in `ids` whose entry in `done` is not
+// set, with the face's file mapped, on `threads` threads. Each file is mapped
+// once for all its faces. `file` is NULL if the file can not be mapped.
+template <typename Reader>
+void FontCatalog::readFaceFiles(const std::vector<uint32_t> &ids, const CatalogArray<uint8_t> &done, size_t threads,
+                                Reader read) {
+  // Group the faces still missing by file
+  std::unordered_map<uint32_t, std::vector<uint32_t> > byPath;
+  std::vector<uint32_t> paths;
+  for (size_t i = 0; i < ids.size(); i++) {
+    uint32_t id = ids[i];
+    if (done[id])
+      continue;
+
+    std::vector<uint32_t> &group = byPath[faces[id].path];
+    if (group.empty())
+      paths.push_back(faces[id].path);
+    group.push_back(id);
+  }
+
+  parallelFor(paths.size(), threads, [&](size_t i) {
+    const std::vector<uint32_t> &group = byPath.find(paths[i])->second;
+
+    MappedFile file;
+    bool mapped = file.open(string(paths[i]), MappedFile::AccessRandom);
+    for (size_t j = 0; j < group.size(); j++)
+      read(mapped ? &file : NULL, group[j]);
+  });
+}
+
+void FontCatalog::loadMetrics(const std::vector<uint32_t> &ids) {
+  size_t missing = 0;
+  for (size_t i = 0; i < ids.size(); i++)
+    missing += metricsLoaded[ids[i]] ? 0 : 1;
+  if (missing == 0)
+    return;
+
+  FontMetrics *metrics = faceMetrics.modify();
+  uint8_t *loaded = metricsLoaded.modify();
+
+  // Reading is bound by the disk, so more threads than cores help. A few
+  // faces are not worth starting threads for.
+  size_t threads = missing < 16 ? 1 : 2 * std::max(1u, std::thread::hardware_concurrency());
+  readFaceFiles(ids, metricsLoaded, threads, [&](const MappedFile *file, uint32_t id) {
+    if (file)
+      readFontMetrics(file->data(), file->size(), faces[id].index & 0xFFFF, metrics[id]);
+    loaded[id] = 1;
+  });
+}
+
+// Position in the sorted `merged` list of each item of `list`
+template <typename T>
+static std::vector<uint32_t> positionsIn(const CatalogArray<T> &list, const std::vector<T> &merged) {
+  std::vector<uint32_t> positions(list.size());
+  for (size_t i = 0; i < list.size(); i++)
+    positions[i] = (uint32_t) (std::lower_bound(merged.begin(), merged.end(), list[i]) - merged.begin());
+  return positions;
+}
+
+// Sets bit moved[i] of `to` for each bit i set in `from`
+static void moveBits(const uint64_t *from, const std::vector<uint32_t> &moved, uint64_t *to) {
+  for (size_t i = 0; i < moved.size(); i++) {
+    if (from[i / 64] & ((uint64_t) 1 << (i % 64)))
+      to[moved[i] / 64] |= (uint64_t) 1 << (moved[i] % 64);
+  }
+}
+
+// Adds the tags read for the faces in `ids` to a sorted tag list and the
+// bitsets over it. Tags seen for the first time are merged into the list,
+// which moves the bits of the faces read before.
+static void addTagSets(CatalogArray<uint32_t> &tags, CatalogArray<uint64_t> &sets, size_t faceCount,
+                       const std::vector<uint32_t> &ids, const std::vector<FontLayoutTags> &found,
+                       std::vector<uint32_t> FontLayoutTags::*list) {
+  std::vector<uint32_t> merged(tags.begin(), tags.end());
+  for (size_t i = 0; i < ids.size(); i++)
+    merged.insert(merged.end(), (found[ids[i]].*list).begin(), (found[ids[i]].*list).end());
+  std::sort(merged.begin(), merged.end());
+  merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+
+  size_t oldWords = (tags.size() + 63) / 64;
+  size_t words = (merged.size() + 63) / 64;
+  std::vector<uint64_t> updated(faceCount * words);
+  if (merged.size() == tags.size()) {
+    updated.assign(sets.begin(), sets.end());
+  } else {
+    std::vector<uint32_t> moved = positionsIn(tags, merged);
+    for (size_t face = 0; face < faceCount; face++)
+      moveBits(sets.data() + face * oldWords, moved, updated.data() + face * words);
+  }
+
+  for (size_t i = 0; i < ids.size(); i++) {
+    const std::vector<uint32_t> &faceTags = found[ids[i]].*list;
+    for (size_t j = 0; j < faceTags.size(); j++) {
+      size_t bit = std::lower_bound(merged.begin(), merged.end(), faceTags[j]) - merged.begin();
+      updated[ids[i] * words + bit / 64] |= (uint64_t) 1 << (bit % 64);
+    }
+  }
+
+  tags.assign(merged);
+  sets.assign(updated);
+}
+
+void FontCatalog::loadLayout(const std::vector<uint32_t> &ids) {
+  std::vector<uint32_t> missing;
+  for (size_t i = 0; i < ids.size(); i++) {
+    if (!layoutLoaded[ids[i]])
+      missing.push_back(ids[i]);
+  }
+  if (missing.empty())
+    return;
+
+  // Only the script and feature lists are read, the rest of the layout
+  // tables is never touched. Reading is bound by the disk like metrics.
+  std::vector<FontLayoutTags> found(faces.size());
+  uint8_t *loaded = layoutLoaded.modify();
+  size_t threads = missing.size() < 16 ? 1 : 2 * std::max(1u, std::thread::hardware_concurrency());
+  readFaceFiles(missing, layoutLoaded, threads, [&](const MappedFile *file, uint32_t id) {
+    if (file)
+      readLayoutTags(file->data(), file->size(), faces[id].index & 0xFFFF, found[id]);
+    loaded[id] = 1;
+  });
+
+  addTagSets(scriptTags, scriptSets, faces.size(), missing, found, &FontLayoutTags::scripts);
+  addTagSets(featureTags, featureSets, faces.size(), missing, found, &FontLayoutTags::features);
+}
+
+void FontCatalog::layoutTags(size_t id, FontLayoutTags &tags) const {
+  tags = FontLayoutTags();
+  for (size_t i = 0; i < scriptTags.size(); i++) {
+    if (scriptSet(id)[i / 64] & ((uint64_t) 1 << (i % 64)))
+      tags.scripts.push_back(scriptTags[i]);
+  }
+  for (size_t i = 0; i < featureTags.size(); i++) {
+    if (featureSet(id)[i / 64] & ((uint64_t) 1 << (i % 64)))
+      tags.features.push_back(featureTags[i]);
+  }
+}
+
+void FontCatalog::loadFingerprints(const std::vector<uint32_t> &ids, size_t threads) {
+  size_t missing = 0;
+  for (size_t i = 0; i < ids.size(); i++)
+    missing += fingerprintStates[ids[i]] == FingerprintMissing ? 1 : 0;
+  if (missing == 0)
+    return;
+
+  FontFingerprint *fingerprints = faceFingerprints.modify();
+  uint8_t *states = fingerprintStates.modify();
+
+  // Rendering is bound by the processor, one thread per core is enough.
+  // FreeType takes the named instance of a variable font in the upper bits
+  // of the index, as the index is stored.
+  readFaceFiles(ids, fingerprintStates, threads, [&](const MappedFile *file, uint32_t id) {
+    bool rendered = file && renderFingerprint(file->data(), file->size(), faces[id].index, fingerprints[id]);
+    states[id] = rendered ? FingerprintRendered : FingerprintFailed;
+  });
+}
+
+int FontCatalog::findFace(const char *path, const char *postscriptName) const {
+  path = path ? path : "";
+  postscriptName = postscriptName ? postscriptName : "";
+
+  // The faces of a file are adjacent in the path index
+  const uint32_t *first = std::lower_bound(pathOrder.begin(), pathOrder.end(), path,
+    [this](uint32_t id, const char *key) { return strcmp(string(faces[id].path), key) < 0; });
+
+  int found = -1;
+  for (const uint32_t *it = first; it != pathOrder.end() && strcmp(string(faces[*it].path), path) == 0; it++) {
+    if (strcmp(string(faces[*it].postscriptName), postscriptName) == 0 && (found < 0 || (int) *it < found))
+      found = (int) *it;
+  }
+  return found;
+}
+
+int FontCatalog::findPostscriptName(const char *postscriptName) const {
+  if (!postscriptName)
+    return -1;
+
+  // Ties are ordered by id, so this is the first face with the name
+  const uint32_t *it = std::lower_bound(postscriptOrder.begin(), postscriptOrder.end(), postscriptName,
+    [this](uint32_t id, const char *key) { return strcmp(string(faces[id].postscriptName), key) < 0; });
+
+  if (it == postscriptOrder.end() || strcmp(string(faces[*it].postscriptName), postscriptName) != 0)
+    return -1;
+  return (int) *it;
+}
+
+const FallbackTable *FontCatalog::fallbackTable(const char *base) {
+  std::string key = base ? base : "";
+
+  std::map<std::string, FallbackTable *>::iterator it = fallbackTables.find(key);
+  if (it != fallbackTables.end())
+    return it->second;
+
+  FallbackTable *table = new FallbackTable();
+  if (!buildFallbackTable(*this, key.c_str(), *table)) {
+    delete table;
+    table = NULL;
+  }
+
+  fallbackTables[key] = table;
+  return table;
+}
+
+const std::vector<uint32_t> *FontCatalog::fallbackChain(const char *family, const char *language, const char *style) {
+  // Names are compared ignoring case, and language tags are written with
+  // either separator, so equivalent requests share a chain
+  std::string key;
+  const char *parts[] = { family, language, style };
+  for (size_t i = 0; i < 3; i++) {
+    for (const char *p = parts[i]; p && *p; p++)
+      key += (i == 1 && *p == '_') ? '-' : (char) tolower((unsigned char) *p);
+    key += '\0';
+  }
+
+  std::map<std::string, std::vector<uint32_t> *>::iterator it = fallbackChains.find(key);
+  if (it != fallbackChains.end())
+    return it->second;
+
+  std::vector<uint32_t> *chain = new std::vector<uint32_t>();
+  if (!buildFallbackChain(*this, family, language, style, *chain)) {
+    delete chain;
+    chain = NULL;
+  }
+
+  fallbackChains[key] = chain;
+  return chain;
+}
+
+uint32_t FontCatalog::pathShard(const char *path, uint32_t count) {
+  // FNV-1a, the same on every machine
+  uint64_t hash = 14695981039346656037ull;
+  for (const unsigned char *p = (const unsigned char *) path; *p; p++) {
+    hash ^= *p;
+    hash *= 1099511628211ull;
+  }
+  return (uint32_t) (hash % count);
+}
+
+FontCatalog *FontCatalog::shard(uint32_t index, uint32_t count) const {
+  std::vector<FaceSource> sources;
+  for (size_t id = 0; id < faces.size(); id++) {
+    if (pathShard(string(faces[id].path), count) == index) {
+      FaceSource source = { this, (uint32_t) id };
+      sources.push_back(source);
+    }
+  }
+  return combine(sources);
+}
+
+// Orders the next faces of the parts of a merge, the smallest on top
+struct MergeHead {
+  const FontCatalog *catalog;
+  uint32_t id;
+  size_t part;
+
+  bool operator<(const MergeHead &other) const {
+    const CatalogFace &a = catalog->face(id);
+    const CatalogFace &b = other.catalog->face(other.id);
+    int cmp = compareKeys(catalog->string(a.family), catalog->string(a.style), catalog->string(a.path),
+                          catalog->string(a.postscriptName), other.catalog->string(b.family),
+                          other.catalog->string(b.style), other.catalog->string(b.path),
+                          other.catalog->string(b.postscriptName));
+    if (cmp != 0)
+      return cmp > 0;
+    return a.index != b.index ? a.index > b.index : part > other.part;
+  }
+};
+
+FontCatalog *FontCatalog::merge(const std::vector<const FontCatalog *> &parts) {
+  std::priority_queue<MergeHead> heads;
+  for (size_t i = 0; i < parts.size(); i++) {
+    if (parts[i]->size() > 0) {
+      MergeHead head = { parts[i], 0, i };
+      heads.push(head);
+    }
+  }
+
+  std::vector<FaceSource> sources;
+  size_t lastPart = 0;
+  while (!heads.empty()) {
+    MergeHead head = heads.top();
+    heads.pop();
+
+    // Parts which overlap hold the same face, the first part's is kept
+    bool duplicate = false;
+    if (!sources.empty() && lastPart != head.part) {
+      const FaceSource &last = sources.back();
+      const CatalogFace &a = last.catalog->face(last.id);
+      const CatalogFace &b = head.catalog->face(head.id);
+      duplicate = a.index == b.index &&
+                  compareKeys(last.catalog->string(a.family), last.catalog->string(a.style),
+                              last.catalog->string(a.path), last.catalog->string(a.postscriptName),
+                              head.catalog->string(b.family), head.catalog->string(b.style),
+                              head.catalog->string(b.path), head.catalog->string(b.postscriptName)) == 0;
+    }
+    if (!duplicate) {
+      FaceSource source = { head.catalog, head.id };
+      sources.push_back(source);
+      lastPart = head.part;
+    }
+
+    if (++head.id < head.catalog->size())
+      heads.push(head);
+  }
+
+  return combine(sources);
+}
+
+FontCatalog *FontCatalog::combine(const std::vector<FaceSource> &sources) {
+  std::vector<char> pool(1, '\0');
+  std::unordered_map<std::string, uint32_t> stringIds;
+  stringIds[""] = 0;
+
+  // The languages and layout tags of all parts, sorted
+  std::vector<const FontCatalog *> parts;
+  for (size_t i = 0; i < sources.size(); i++) {
+    if (std::find(parts.begin(), parts.end(), sources[i].catalog) == parts.end())
+      parts.push_back(sources[i].catalog);
+  }
+
+  std::set<std::string> languageNames;
+  std::vector<uint32_t> scripts;
+  std::vector<uint32_t> features;
+  for (size_t p = 0; p < parts.size(); p++) {
+    for (size_t i = 0; i < parts[p]->languageCount(); i++)
+      languageNames.insert(parts[p]->languageName(i));
+    scripts.insert(scripts.end(), parts[p]->scriptTags.begin(), parts[p]->scriptTags.end());
+    features.insert(features.end(), parts[p]->featureTags.begin(), parts[p]->featureTags.end());
+  }
+  std::sort(scripts.begin(), scripts.end());
+  scripts.erase(std::unique(scripts.begin(), scripts.end()), scripts.end());
+  std::sort(features.begin(), features.end());
+  features.erase(std::unique(features.begin(), features.end()), features.end());
+
+  std::vector<std::string> sortedNames(languageNames.begin(), languageNames.end());
+  std::vector<uint32_t> languageTags;
+  for (size_t i = 0; i < sortedNames.size(); i++)
+    languageTags.push_back(intern(pool, stringIds, sortedNames[i].c_str()));
+
+  // Where the bits of each part's sets go in the combined sets
+  std::map<const FontCatalog *, std::vector<uint32_t> > languageMoves, scriptMoves, featureMoves;
+  for (size_t p = 0; p < parts.size(); p++) {
+    std::vector<uint32_t> &moved = languageMoves[parts[p]];
+    for (size_t i = 0; i < parts[p]->languageCount(); i++) {
+      moved.push_back((uint32_t) (std::lower_bound(sortedNames.begin(), sortedNames.end(),
+                                                    std::string(parts[p]->languageName(i))) - sortedNames.begin()));
+    }
+    scriptMoves[parts[p]] = positionsIn(parts[p]->scriptTags, scripts);
+    featureMoves[parts[p]] = positionsIn(parts[p]->featureTags, features);
+  }
+
+  size_t count = sources.size();
+  size_t languageWords = (languageTags.size() + 63) / 64;
+  size_t scriptWords = (scripts.size() + 63) / 64;
+  size_t featureWords = (features.size() + 63) / 64;
+
+  std::vector<CatalogFace> built;
+  std::vector<uint32_t> starts;
+  std::vector<uint64_t> languageSets(count * languageWords);
+  std::vector<uint64_t> scriptSets(count * scriptWords);
+  std::vector<uint64_t> featureSets(count * featureWords);
+  std::vector<CatalogAlias> names;
+  std::vector<uint32_t> aliasOffsets(1, 0);
+  std::vector<FontMetrics> metrics;
+  std::vector<uint8_t> metricsLoaded;
+  std::vector<FontFingerprint> fingerprints;
+  std::vector<uint8_t> fingerprintStates;
+  std::vector<uint8_t> layoutLoaded;
+  built.reserve(count);
+
+  for (size_t i = 0; i < count; i++) {
+    const FontCatalog &part = *sources[i].catalog;
+    uint32_t id = sources[i].id;
+
+    CatalogFace face = part.faces[id];
+    face.path = intern(pool, stringIds, part.string(face.path));
+    face.postscriptName = intern(pool, stringIds, part.string(face.postscriptName));
+    face.family = intern(pool, stringIds, part.string(face.family));
+    face.style = intern(pool, stringIds, part.string(face.style));
+    if (face.family != 0 && (starts.empty() || built[starts.back()].family != face.family))
+      starts.push_back((uint32_t) built.size());
+    built.push_back(face);
+
+    for (const CatalogAlias *alias = part.aliasesBegin(id); alias != part.aliasesEnd(id); alias++) {
+      CatalogAlias copy = *alias;
+      copy.face = (uint32_t) i;
+      copy.name = intern(pool, stringIds, part.string(alias->name));
+      copy.language = intern(pool, stringIds, part.string(alias->language));
+      names.push_back(copy);
+    }
+    aliasOffsets.push_back((uint32_t) names.size());
+
+    moveBits(part.languageSet(id), languageMoves[&part], languageSets.data() + i * languageWords);
+    moveBits(part.scriptSet(id), scriptMoves[&part], scriptSets.data() + i * scriptWords);
+    moveBits(part.featureSet(id), featureMoves[&part], featureSets.data() + i * featureWords);
+
+    metrics.push_back(part.faceMetrics[id]);
+    metricsLoaded.push_back(part.metricsLoaded[id]);
+    fingerprints.push_back(part.faceFingerprints[id]);
+    fingerprintStates.push_back(part.fingerprintStates[id]);
+    layoutLoaded.push_back(part.layoutLoaded[id]);
+  }
+
+  FontCatalog *catalog = new FontCatalog();
+  catalog->strings.assign(pool);
+  catalog->faces.assign(built);
+  catalog->familyStarts.assign(starts);
+  catalog->languages.assign(languageTags);
+  catalog->languageSets.assign(languageSets);
+  catalog->aliases.assign(names);
+  catalog->aliasStarts.assign(aliasOffsets);
+  catalog->faceMetrics.assign(metrics);
+  catalog->metricsLoaded.assign(metricsLoaded);
+  catalog->faceFingerprints.assign(fingerprints);
+  catalog->fingerprintStates.assign(fingerprintStates);
+  catalog->scriptTags.assign(scripts);
+  catalog->scriptSets.assign(scriptSets);
+  catalog->featureTags.assign(features);
+  catalog->featureSets.assign(featureSets);
+  catalog->layoutLoaded.assign(layoutLoaded);
+  catalog->buildNameIndex();
+  catalog->buildIndexes();
+  return catalog;
+}
+
+// Compares the (path, collection index) keys of faces in two catalogs
+static int compareFileKeys(const FontCatalog &a, uint32_t idA, const FontCatalog &b, uint32_t idB) {
+  const CatalogFace &fa = a.face(idA);
+  const CatalogFace &fb = b.face(idB);
+  int cmp = strcmp(a.string(fa.path), b.string(fb.path));
+  if (cmp != 0)
+    return cmp;
+  return fa.index < fb.index ? -1 : (fa.index > fb.index ? 1 : 0);
+}
+
+static bool sameFace(const FontCatalog &a, uint32_t idA, const FontCatalog &b, uint32_t idB) {
+  const CatalogFace &fa = a.face(idA);
+  const CatalogFace &fb = b.face(idB);
+  return fa.weight == fb.weight && fa.width == fb.width && fa.flags == fb.flags &&
+         fa.weightMin == fb.weightMin && fa.weightMax == fb.weightMax &&
+         fa.widthMin == fb.widthMin && fa.widthMax == fb.widthMax &&
+         strcmp(a.string(fa.postscriptName), b.string(fb.postscriptName)) == 0 &&
+         strcmp(a.string(fa.family), b.string(fb.family)) == 0 &&
+         strcmp(a.string(fa.style), b.string(fb.style)) == 0;
+}
+
+void diffCatalogs(const FontCatalog &before, const FontCatalog &after, std::vector<CatalogDelta> &deltas) {
+  const CatalogArray<uint32_t> &a = before.pathIndex();
+  const CatalogArray<uint32_t> &b = after.pathIndex();
+
+  size_t i = 0;
+  size_t j = 0;
+  while (i < a.size() || j < b.size()) {
+    int cmp = i == a.size() ? 1 : (j == b.size() ? -1 : compareFileKeys(before, a[i], after, b[j]));
+    CatalogDelta delta;
+    if (cmp < 0) {
+      delta.change = CatalogFaceRemoved;
+      delta.before = (int) a[i++];
+      delta.after = -1;
+    } else if (cmp > 0) {
+      delta.change = CatalogFaceAdded;
+      delta.before = -1;
+      delta.after = (int) b[j++];
+    } else {
+      uint32_t idA = a[i++];
+      uint32_t idB = b[j++];
+      if (sameFace(before, idA, after, idB))
+        continue;
+      delta.change = CatalogFaceChanged;
+      delta.before = (int) idA;
+      delta.after = (int) idB;
+    }
+    deltas.push_back(delta);
+  }
+}
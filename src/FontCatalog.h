@@ -0,0 +1,408 @@
+#ifndef FONT_CATALOG_H
+#define FONT_CATALOG_H
+
+#include "FontDescriptor.h"
+#include "FontFingerprint.h"
+#include "FontLayout.h"
+#include "FontMetrics.h"
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+enum CatalogFaceFlags {
+  CatalogFaceItalic    = 1 << 0,
+  CatalogFaceOblique   = 1 << 1,
+  CatalogFaceMonospace = 1 << 2
+};
+
+// A single face in the catalog. Strings are stored as offsets into the
+// catalog's string pool so that equal strings are only stored once.
+struct CatalogFace {
+  uint32_t path;
+  uint32_t postscriptName;
+  uint32_t family;
+  uint32_t style;
+  int32_t weight;
+  int32_t width;
+  uint32_t flags;
+  uint32_t index;  // Index of the face in a font collection, with the named
+                   // instance of a variable font in the upper 16 bits
+  int16_t weightMin;  // Axis ranges of a variable font, see FontDescriptor
+  int16_t weightMax;
+  int16_t widthMin;
+  int16_t widthMax;
+};
+
+// One name of a face, see FontAlias. The aliases of a face are stored
+// together, in the order the platform lists them.
+struct CatalogAlias {
+  uint32_t face;
+  uint32_t kind;      // FontNameKind
+  uint32_t name;      // String pool offsets
+  uint32_t language;
+};
+
+// Maps every Unicode codepoint to the face which should be used to display
+// it for a given base font, in the preference order of the platform.
+//
+// The codepoint space is split into pages of 256 codepoints. The first level
+// maps a page number to a page, the second level holds the entries of each
+// distinct page. Most pages are identical (often entirely unassigned), so
+// they are shared.
+class FallbackTable {
+public:
+  static const uint32_t NO_FACE = 0xFFFFFFFF;
+  static const uint16_t NO_ENTRY = 0xFFFF;
+  static const uint32_t PAGE_SIZE = 256;
+  static const uint32_t PAGE_COUNT = 0x110000 / PAGE_SIZE;
+
+  // Face id to use for `codepoint`, or NO_FACE if no face covers it
+  uint32_t lookup(uint32_t codepoint) const {
+    if (codepoint >= 0x110000)
+      return NO_FACE;
+
+    uint16_t entry = pages[(size_t) index[codepoint / PAGE_SIZE] * PAGE_SIZE + codepoint % PAGE_SIZE];
+    return entry == NO_ENTRY ? NO_FACE : faces[entry];
+  }
+
+  // Preference rank of `codepoint`'s face, lower is better
+  uint32_t rank(uint32_t codepoint) const {
+    if (codepoint >= 0x110000)
+      return NO_FACE;
+    uint16_t entry = pages[(size_t) index[codepoint / PAGE_SIZE] * PAGE_SIZE + codepoint % PAGE_SIZE];
+    return entry == NO_ENTRY ? NO_FACE : entry;
+  }
+
+  // Build the table from a dense array holding a rank for every codepoint
+  // and the face ids ordered by rank.
+  void build(const std::vector<uint16_t> &ranks, const std::vector<uint32_t> &faceIds);
+
+  // Face ids in order of preference, entries in the pages index into this
+  std::vector<uint32_t> faces;
+  std::vector<uint16_t> index;
+  std::vector<uint16_t> pages;
+};
+
+// A read-only array which either owns its items or refers to memory owned
+// elsewhere, such as a mapped catalog file
+template <typename T>
+class CatalogArray {
+public:
+  CatalogArray() : items(NULL), count(0) {}
+
+  // Take over the contents of `values`
+  void assign(std::vector<T> &values) {
+    owned.swap(values);
+    items = owned.data();
+    count = owned.size();
+  }
+
+  // Refer to `size` items at `data`, which must outlive the array
+  void refer(const T *data, size_t size) {
+    owned.clear();
+    items = data;
+    count = size;
+  }
+
+  // Writable items, copied first if the array refers to foreign memory
+  T *modify() {
+    if (items != owned.data()) {
+      owned.assign(items, items + count);
+      items = owned.data();
+    }
+    return owned.data();
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+  const T *data() const { return items; }
+  const T *begin() const { return items; }
+  const T *end() const { return items + count; }
+  const T &back() const { return items[count - 1]; }
+  const T &operator[](size_t i) const { return items[i]; }
+
+private:
+  std::vector<T> owned;
+  const T *items;
+  size_t count;
+};
+
+class MappedFile;
+
+// Faces are kept sorted by family, style, path and PostScript name. This
+// order is stable across runs and is the order of all query results.
+//
+// A catalog can be saved to a file and opened again. The file holds the
+// arrays of the catalog as they are in memory, so opening it only maps it.
+class FontCatalog {
+public:
+  FontCatalog(ResultSet *fonts);
+  ~FontCatalog();
+
+  // The catalog of the fonts installed on this system, found on first use,
+  // unless another catalog was set with setShared(). Where the platform
+  // provides fontSourceStamp(), the catalog at defaultPath() is mapped if it
+  // was built from the same fonts. Otherwise one process at a time builds
+  // and saves it there, holding a lock next to it, while the others wait
+  // for the file instead of enumerating the fonts too.
+  static FontCatalog *shared();
+
+  // A new catalog of the fonts installed on this system, enumerated now
+  static FontCatalog *build();
+
+  // Answer all queries from `catalog`, e.g. one opened from a file, instead
+  // of the fonts installed on this system. Takes ownership of `catalog`.
+  static void setShared(FontCatalog *catalog);
+
+  // Open a catalog saved with save(). Returns NULL and sets `error` if the
+  // file can not be read or is not a catalog of this version.
+  static FontCatalog *open(const char *path, std::string &error);
+
+  // Write the catalog, including the metrics loaded so far, to `path`. The
+  // file is written next to `path` first and then renamed, so readers never
+  // see a partial catalog. Missing parent directories are created.
+  bool save(const char *path, std::string &error) const;
+
+  // A new catalog of the faces whose file falls into shard `index` of
+  // `count`, with all that was loaded for them. Files are split by a hash of
+  // their path, so all faces of a file go to one shard and every machine
+  // splits the same fonts the same way.
+  FontCatalog *shard(uint32_t index, uint32_t count) const;
+
+  // Shard of `count` which the file at `path` belongs to
+  static uint32_t pathShard(const char *path, uint32_t count);
+
+  // A new catalog of the faces of all `parts`, such as the shards of a
+  // catalog, with all that was loaded for them. Each part is in catalog
+  // order, so the faces are merged in a single pass. A face found in several
+  // parts is taken from the first of them.
+  static FontCatalog *merge(const std::vector<const FontCatalog *> &parts);
+
+  // Where the warm command stores the catalog of this system: the user's
+  // cache directory, or an empty string if it can not be determined
+  static std::string defaultPath();
+
+  // fontSourceStamp() of the fonts the catalog was built from, empty for
+  // catalogs not built from this system's fonts
+  std::string stamp() const { return std::string(sourceStamp.data(), sourceStamp.size()); }
+
+  size_t size() const { return faces.size(); }
+  const CatalogFace &face(size_t id) const { return faces[id]; }
+  const CatalogFace *faceRecords() const { return faces.data(); }
+  const char *string(uint32_t offset) const { return &strings[offset]; }
+
+  // Ids of the faces from `start` to the last, in order
+  std::vector<uint32_t> faceIds(size_t start = 0) const;
+
+  // Distinct non-empty families in sorted order, as the id of the first face
+  // of each family
+  size_t familyCount() const { return familyStarts.size(); }
+  const char *familyName(size_t family) const { return string(faces[familyStarts[family]].family); }
+  size_t familyStart(size_t family) const { return familyStarts[family]; }
+
+  // Face ids sorted by weight and by width, ties in catalog order
+  const CatalogArray<uint32_t> &weightIndex() const { return weightOrder; }
+  const CatalogArray<uint32_t> &widthIndex() const { return widthOrder; }
+
+  // Face ids sorted by path, collection index, PostScript name and id
+  const CatalogArray<uint32_t> &pathIndex() const { return pathOrder; }
+
+  // Ids of the faces whose weight or width axis overlaps [min, max]. Faces
+  // with a single value are found by binary search of the sorted indexes,
+  // and come first in index order. Variable faces whose range overlaps but
+  // whose default value does not lie in [min, max] follow in catalog order.
+  void facesByWeight(int min, int max, std::vector<uint32_t> &ids) const;
+  void facesByWidth(int min, int max, std::vector<uint32_t> &ids) const;
+
+  // Position of the first face which sorts after the given key
+  size_t faceAfter(const char *family, const char *style, const char *path, const char *postscriptName) const;
+
+  // Position of the first family which sorts after `family`
+  size_t familyAfter(const char *family) const;
+
+  // All names of a face, including its primary family, style and
+  // PostScript name
+  const CatalogAlias *aliasesBegin(size_t id) const { return aliases.begin() + aliasStarts[id]; }
+  const CatalogAlias *aliasesEnd(size_t id) const { return aliases.begin() + aliasStarts[id + 1]; }
+
+  // Ids of the faces having a name of `kind` equal to `name` ignoring case,
+  // in catalog order. Names are found through a hash index, so this does not
+  // depend on the size of the catalog.
+  void facesNamed(const char *name, FontNameKind kind, std::vector<uint32_t> &ids) const;
+
+  // Language tags of all faces, sorted, and the languages of each face as a
+  // bitset over them of languageWords() words
+  size_t languageCount() const { return languages.size(); }
+  const char *languageName(size_t language) const { return string(languages[language]); }
+  size_t languageWords() const { return (languages.size() + 63) / 64; }
+  const uint64_t *languageSet(size_t id) const { return &languageSets[id * languageWords()]; }
+
+  // Bitset of the languages matching any tag of a comma separated list. A
+  // tag matches its own language in any territory, so "zh" matches "zh-tw",
+  // and "en-us" matches "en". Tags are case-insensitive.
+  std::vector<uint64_t> languageMask(const char *tags) const;
+
+  // Read the OpenType script and feature tags of those faces in `ids` whose
+  // tags were not read before, mapping each file once
+  void loadLayout(const std::vector<uint32_t> &ids);
+
+  // Script and feature tags of all faces read so far, sorted, and the tags
+  // of each face as bitsets over them of scriptWords() and featureWords()
+  // words. Faces not read yet have no tags.
+  size_t scriptWords() const { return (scriptTags.size() + 63) / 64; }
+  size_t featureWords() const { return (featureTags.size() + 63) / 64; }
+  const uint64_t *scriptSet(size_t id) const { return scriptSets.data() + id * scriptWords(); }
+  const uint64_t *featureSet(size_t id) const { return featureSets.data() + id * featureWords(); }
+
+  // Tags of a face, set once loadLayout was called for it
+  void layoutTags(size_t id, FontLayoutTags &tags) const;
+
+  // Bitset of the scripts or features matching any tag of a comma separated
+  // list. A script tag also matches the other tag of an Indic script, so
+  // "deva" matches "dev2". Tags are case-sensitive, as in fonts.
+  std::vector<uint64_t> scriptMask(const char *tags) const;
+  std::vector<uint64_t> featureMask(const char *tags) const;
+
+  // Read the metrics of those faces in `ids` whose metrics were not read
+  // before. Each file is mapped once, and many files are read in parallel.
+  void loadMetrics(const std::vector<uint32_t> &ids);
+
+  // Metrics of a face, set once loadMetrics was called for it
+  const FontMetrics &metrics(size_t id) const { return faceMetrics[id]; }
+
+  // Render the fingerprints of those faces in `ids` which were not
+  // fingerprinted before, mapping each file once, on `threads` threads (the
+  // number of hardware threads if 0)
+  void loadFingerprints(const std::vector<uint32_t> &ids, size_t threads);
+
+  // Fingerprint of a face, or NULL if it was not loaded or the face could
+  // not be rendered
+  const FontFingerprint *fingerprint(size_t id) const {
+    return fingerprintStates[id] == FingerprintRendered ? &faceFingerprints[id] : NULL;
+  }
+
+  // Returns a new descriptor for a face, owned by the caller
+  FontDescriptor *descriptor(size_t id) const;
+
+  // Id of the face at `path` with `postscriptName`, or -1
+  int findFace(const char *path, const char *postscriptName) const;
+
+  // Id of the first face with `postscriptName`, or -1
+  int findPostscriptName(const char *postscriptName) const;
+
+  // Codepoint fallback table for a PostScript name or family name, built on
+  // first use. Building one sorts all fonts and fills a table of every
+  // codepoint, which pays off only for processes resolving many codepoints,
+  // such as itemize. Tables are not saved with the catalog.
+  // Returns NULL when the platform can not provide one.
+  const FallbackTable *fallbackTable(const char *base);
+
+  // Faces to try in order when `family`, a family name or a generic family
+  // such as "sans-serif", is requested for text in `language` with `style`.
+  // Faces which cover no codepoint the faces before them miss are left out.
+  // Each chain is resolved once per family, language and style, `language`
+  // and `style` may be NULL. Returns NULL when the platform can not provide
+  // one.
+  const std::vector<uint32_t> *fallbackChain(const char *family, const char *language, const char *style);
+
+private:
+  FontCatalog();
+  FontCatalog(const FontCatalog &);
+  FontCatalog &operator=(const FontCatalog &);
+
+  // States of faceFingerprints
+  enum FingerprintState {
+    FingerprintMissing,   // Not rendered yet
+    FingerprintRendered,
+    FingerprintFailed     // The face can not be rendered
+  };
+
+  // A face of another catalog
+  struct FaceSource {
+    const FontCatalog *catalog;
+    uint32_t id;
+  };
+
+  void buildIndexes();
+  void buildNameIndex();
+
+  // build() and shared() for the fonts of `stamp`
+  static FontCatalog *build(const std::string &stamp);
+  static FontCatalog *openShared(const std::string &path, const std::string &stamp);
+
+  // A new catalog of the faces in `sources`, which are in catalog order
+  static FontCatalog *combine(const std::vector<FaceSource> &sources);
+
+  template <typename Reader>
+  void readFaceFiles(const std::vector<uint32_t> &ids, const CatalogArray<uint8_t> &done, size_t threads, Reader read);
+
+  CatalogArray<CatalogFace> faces;
+  CatalogArray<uint32_t> familyStarts;
+  CatalogArray<uint32_t> weightOrder;
+  CatalogArray<uint32_t> widthOrder;
+  CatalogArray<uint32_t> variableFaces;  // Faces with a range on an axis
+  CatalogArray<uint32_t> pathOrder;
+  CatalogArray<uint32_t> postscriptOrder;
+  CatalogArray<FontMetrics> faceMetrics;
+  CatalogArray<uint8_t> metricsLoaded;
+  CatalogArray<FontFingerprint> faceFingerprints;
+  CatalogArray<uint8_t> fingerprintStates;
+  CatalogArray<uint32_t> scriptTags;
+  CatalogArray<uint64_t> scriptSets;
+  CatalogArray<uint32_t> featureTags;
+  CatalogArray<uint64_t> featureSets;
+  CatalogArray<uint8_t> layoutLoaded;
+  CatalogArray<uint32_t> languages;
+  CatalogArray<uint64_t> languageSets;
+  CatalogArray<CatalogAlias> aliases;
+  CatalogArray<uint32_t> aliasStarts;
+  CatalogArray<uint32_t> nameBuckets;  // First alias of each hash bucket
+  CatalogArray<uint32_t> nameNext;     // Next alias in the same bucket
+  CatalogArray<char> strings;
+  CatalogArray<char> sourceStamp;
+  MappedFile *file;
+  std::map<std::string, FallbackTable *> fallbackTables;
+  std::map<std::string, std::vector<uint32_t> *> fallbackChains;
+};
+
+// How a face differs between two catalogs
+enum CatalogChange {
+  CatalogFaceAdded,
+  CatalogFaceRemoved,
+  CatalogFaceChanged
+};
+
+struct CatalogDelta {
+  CatalogChange change;
+  int before;  // Face id in the old catalog, -1 if added
+  int after;   // Face id in the new catalog, -1 if removed
+};
+
+// Differences between two catalogs, matching faces by path and collection
+// index. Both path indexes are walked once in a sorted merge, so this is
+// linear in the size of the catalogs. Deltas are in path order.
+void diffCatalogs(const FontCatalog &before, const FontCatalog &after, std::vector<CatalogDelta> &deltas);
+
+// Platform implementation filling `table` for `base` from the platform's
+// fallback order. Returns false if this is not supported.
+bool buildFallbackTable(const FontCatalog &catalog, const char *base, FallbackTable &table);
+
+// Platform implementation filling `faces` with the platform's fallback order
+// for `family`, trimmed to the faces which add coverage. `language` and
+// `style` may be NULL. Returns false if this is not supported.
+bool buildFallbackChain(const FontCatalog &catalog, const char *family, const char *language, const char *style,
+                        std::vector<uint32_t> &faces);
+
+// Platform implementation building the platform's own font caches for every
+// configured font directory, `jobs` directories at a time. Directories whose
+// cache could not be built are added to `failed`. Returns the number of
+// directories visited.
+size_t warmFontCaches(size_t jobs, std::vector<std::string> &failed);
+
+// Platform implementation of a stamp of the installed fonts: a string which
+// changes whenever fonts or the font configuration change, found without
+// enumerating the fonts. Returns an empty string if this is not supported.
+std::string fontSourceStamp();
+
+#endif // FONT_CATALOG_H
@@ -3,7 +3,10 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <string>
 #include <vector>
+#include "FileStat.h"
+#include "FontMetrics.h"
 
 enum FontWeight {
   FontWeightUndefined   = 0,
@@ -18,17 +21,80 @@ enum FontWeight {
   FontWeightHeavy       = 900
 };
 
+// Widths are a percentage of the normal width, as in fontconfig and CSS
+// font-stretch, so widths between the named ones are kept
 enum FontWidth {
   FontWidthUndefined      = 0,
-  FontWidthUltraCondensed = 1,
-  FontWidthExtraCondensed = 2,
-  FontWidthCondensed      = 3,
-  FontWidthSemiCondensed  = 4,
-  FontWidthNormal         = 5,
-  FontWidthSemiExpanded   = 6,
-  FontWidthExpanded       = 7,
-  FontWidthExtraExpanded  = 8,
-  FontWidthUltraExpanded  = 9
+  FontWidthUltraCondensed = 50,
+  FontWidthExtraCondensed = 63,
+  FontWidthCondensed      = 75,
+  FontWidthSemiCondensed  = 87,
+  FontWidthNormal         = 100,
+  FontWidthSemiExpanded   = 113,
+  FontWidthExpanded       = 125,
+  FontWidthExtraExpanded  = 150,
+  FontWidthUltraExpanded  = 200
+};
+
+// Width of a width class from 1 for ultra condensed to 9 for ultra expanded,
+// as OpenType and DirectWrite number them, or FontWidthUndefined for others
+inline FontWidth widthOfClass(int widthClass) {
+  static const FontWidth widths[] = {
+    FontWidthUltraCondensed, FontWidthExtraCondensed, FontWidthCondensed,
+    FontWidthSemiCondensed, FontWidthNormal, FontWidthSemiExpanded,
+    FontWidthExpanded, FontWidthExtraExpanded, FontWidthUltraExpanded
+  };
+  return widthClass >= 1 && widthClass <= 9 ? widths[widthClass - 1] : FontWidthUndefined;
+}
+
+enum FontNameKind {
+  FontNameFamily,
+  FontNameStyle,
+  FontNamePostscript
+};
+
+// Write `str` as a JSON string literal, quoted and escaped, one character at
+// a time through put(c). Control characters are written as \u00XX. NULL is
+// written as an empty string.
+template <typename Put>
+void writeJsonString(const char *str, Put put) {
+  static const char hex[] = "0123456789abcdef";
+  put('"');
+  for (const char *p = str; p && *p; p++) {
+    unsigned char c = (unsigned char) *p;
+    if (c < 0x20) {
+      put('\\');
+      put('u');
+      put('0');
+      put('0');
+      put(hex[c >> 4]);
+      put(hex[c & 0xF]);
+      continue;
+    }
+    if (c == '\\' || c == '"')
+      put('\\');
+    put(*p);
+  }
+  put('"');
+}
+
+inline void printJsonString(const char *str) {
+  writeJsonString(str, [](char c) { putc(c, stdout); });
+}
+
+inline void appendJsonString(std::string &out, const char *str) {
+  writeJsonString(str, [&out](char c) { out += c; });
+}
+
+// One of the names of a font. Fonts can list several family and style
+// names, often localized, each with the language it is in.
+struct FontAlias {
+  FontNameKind kind;
+  std::string name;
+  std::string language;  // Empty if unknown
+
+  FontAlias(FontNameKind kind, const char *name, const char *language)
+    : kind(kind), name(name ? name : ""), language(language ? language : "") {}
 };
 
 struct FontDescriptor {
@@ -39,21 +105,43 @@ public:
   const char *style;
   FontWeight weight;
   FontWidth width;
+  int weightMin;          // Ranges of the weight and width axes of a variable
+  int weightMax;          // font, of which weight and width are the default.
+  int widthMin;           // Equal to weight and width for other fonts.
+  int widthMax;
   bool italic;
   bool oblique;
   bool monospace;
+  int index;              // Index of the face in a font collection
+  FontMetrics *metrics;   // Only set when metrics were requested
+  std::vector<std::string> languages;  // Tags of the languages the font supports
+  std::vector<FontAlias> aliases;      // All names, including the ones above
+  bool printAliases;                   // Whether printJson() includes the aliases
+  std::vector<std::string> scripts;    // OpenType layout tags, only set when
+  std::vector<std::string> features;   // printLayout is
+  bool printLayout;
+  FileStat fileStat;                   // Metadata of the file at `path`, only
+  unsigned fileFields;                 // printed for these FileField bits
 
   FontDescriptor(const char *path, const char *postscriptName, const char *family, const char *style, 
-                 FontWeight weight, FontWidth width, bool italic, bool oblique, bool monospace) {
+                 FontWeight weight, FontWidth width, bool italic, bool oblique, bool monospace,
+                 int index = 0) {
     this->path = copyString(path);
     this->postscriptName = copyString(postscriptName);
     this->family = copyString(family);
     this->style = copyString(style);
     this->weight = weight;
     this->width = width;
+    this->weightMin = this->weightMax = weight;
+    this->widthMin = this->widthMax = width;
     this->italic = italic;
     this->oblique = oblique;
     this->monospace = monospace;
+    this->index = index;
+    this->metrics = NULL;
+    this->printAliases = false;
+    this->printLayout = false;
+    this->fileFields = 0;
   }
 
   FontDescriptor(FontDescriptor *desc) {
@@ -63,9 +151,23 @@ public:
     style = copyString(desc->style);
     weight = desc->weight;
     width = desc->width;
+    weightMin = desc->weightMin;
+    weightMax = desc->weightMax;
+    widthMin = desc->widthMin;
+    widthMax = desc->widthMax;
     italic = desc->italic;
     oblique = desc->oblique;
     monospace = desc->monospace;
+    index = desc->index;
+    metrics = desc->metrics ? new FontMetrics(*desc->metrics) : NULL;
+    languages = desc->languages;
+    aliases = desc->aliases;
+    printAliases = desc->printAliases;
+    scripts = desc->scripts;
+    features = desc->features;
+    printLayout = desc->printLayout;
+    fileStat = desc->fileStat;
+    fileFields = desc->fileFields;
   }
   
   ~FontDescriptor() {
@@ -80,6 +182,8 @@ public:
     
     if (style)
       delete style;
+
+    delete metrics;
     
     postscriptName = NULL;
     family = NULL;
@@ -89,24 +193,28 @@ public:
   void printJson() {
     printf("{\n");
 
-    printf("  \"path\": \"");
+    printf("  \"path\": ");
     printJsonString(path);
-    printf("\",\n");
+    printf(",\n");
 
-    printf("  \"postscriptName\": \"");
+    printf("  \"postscriptName\": ");
     printJsonString(postscriptName);
-    printf("\",\n");
+    printf(",\n");
 
-    printf("  \"family\": \"");
+    printf("  \"family\": ");
     printJsonString(family);
-    printf("\",\n");
+    printf(",\n");
 
-    printf("  \"style\": \"");
+    printf("  \"style\": ");
     printJsonString(style);
-    printf("\",\n");
+    printf(",\n");
 
     printf("  \"weight\": %i,\n", weight);
     printf("  \"width\": %i,\n", width);
+    if (weightMin != weightMax)
+      printf("  \"weightRange\": [%i, %i],\n", weightMin, weightMax);
+    if (widthMin != widthMax)
+      printf("  \"widthRange\": [%i, %i],\n", widthMin, widthMax);
 
     printf("  \"italic\": ");
     printBoolean(italic);
@@ -118,32 +226,124 @@ public:
 
     printf("  \"monospace\": ");
     printBoolean(monospace);
+
+    if (metrics) {
+      printf(",\n  \"metrics\": ");
+      printMetrics();
+    }
+
+    if (printAliases) {
+      static const char *kinds[] = { "family", "style", "postscriptName" };
+      printf(",\n  \"aliases\": [");
+      for (size_t i = 0; i < aliases.size(); i++) {
+        printf("%s\n    {\"kind\": \"%s\", \"name\": ", i > 0 ? "," : "", kinds[aliases[i].kind]);
+        printJsonString(aliases[i].name.c_str());
+        printf(", \"lang\": ");
+        if (aliases[i].language.empty()) {
+          printf("null}");
+        } else {
+          printJsonString(aliases[i].language.c_str());
+          printf("}");
+        }
+      }
+      printf(aliases.empty() ? "]" : "\n  ]");
+    }
+
+    if (printLayout) {
+      printf(",\n  \"layout\": {\"scripts\": ");
+      printJsonStringList(scripts);
+      printf(", \"features\": ");
+      printJsonStringList(features);
+      printf("}");
+    }
+
+    if (fileFields & FileFieldSize) {
+      printf(",\n  \"size\": ");
+      printFileNumber((unsigned long long) fileStat.size);
+    }
+    if (fileFields & FileFieldMtime) {
+      printf(",\n  \"mtime\": ");
+      printFileNumber((long long) fileStat.mtime);
+    }
+    if (fileFields & FileFieldInode) {
+      printf(",\n  \"inode\": ");
+      printFileNumber((unsigned long long) fileStat.inode);
+    }
     printf("\n}\n");
   }
   
+  // Append the fields of printJson() as a JSON object on a single line
+  void appendJson(std::string &out) const {
+    char numbers[64];
+    out += "{\"path\": ";
+    appendJsonString(out, path);
+    out += ", \"postscriptName\": ";
+    appendJsonString(out, postscriptName);
+    out += ", \"family\": ";
+    appendJsonString(out, family);
+    out += ", \"style\": ";
+    appendJsonString(out, style);
+    snprintf(numbers, sizeof(numbers), ", \"weight\": %i, \"width\": %i", weight, width);
+    out += numbers;
+    if (weightMin != weightMax) {
+      snprintf(numbers, sizeof(numbers), ", \"weightRange\": [%i, %i]", weightMin, weightMax);
+      out += numbers;
+    }
+    if (widthMin != widthMax) {
+      snprintf(numbers, sizeof(numbers), ", \"widthRange\": [%i, %i]", widthMin, widthMax);
+      out += numbers;
+    }
+    out += italic ? ", \"italic\": true" : ", \"italic\": false";
+    out += oblique ? ", \"oblique\": true" : ", \"oblique\": false";
+    out += monospace ? ", \"monospace\": true}" : ", \"monospace\": false}";
+  }
+
+  // Print the metrics as a JSON object, or null if they could not be read
+  void printMetrics() {
+    if (!metrics || !(metrics->flags & FontMetricsValid)) {
+      printf("null");
+      return;
+    }
+
+    printf("{\"unitsPerEm\": %i, \"ascender\": %i, \"descender\": %i, \"lineGap\": %i, ",
+           metrics->unitsPerEm, metrics->ascender, metrics->descender, metrics->lineGap);
+    if (metrics->flags & FontMetricsXHeight)
+      printf("\"xHeight\": %i, ", metrics->xHeight);
+    else
+      printf("\"xHeight\": null, ");
+    if (metrics->flags & FontMetricsCapHeight)
+      printf("\"capHeight\": %i}", metrics->capHeight);
+    else
+      printf("\"capHeight\": null}");
+  }
+  
 private:
   void printBoolean(bool flag) {
     printf(flag ? "true" : "false");
   }
 
-  void printJsonString(const char *str) {
-    if (!str) {
-      return;
-    }
-    const char *p = str;
-    while (*p) {
-      char c = *p;
-      if (c == '\\') {
-        putc('\\', stdout);
-        putc('\\', stdout);
-      } else if (c == '"') {
-        putc('\\', stdout);
-        putc('"', stdout);
-      } else {
-        putc(c, stdout);
-      }
-      p++;
+  // Print a field of fileStat, or null if the file could not be stat'ed
+  void printFileNumber(unsigned long long value) {
+    if (fileStat.found)
+      printf("%llu", value);
+    else
+      printf("null");
+  }
+
+  void printFileNumber(long long value) {
+    if (fileStat.found)
+      printf("%lld", value);
+    else
+      printf("null");
+  }
+
+  void printJsonStringList(const std::vector<std::string> &list) {
+    printf("[");
+    for (size_t i = 0; i < list.size(); i++) {
+      printf(i > 0 ? ", " : "");
+      printJsonString(list[i].c_str());
     }
+    printf("]");
   }
 
   char *copyString(const char *input) {
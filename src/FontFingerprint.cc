@@ -0,0 +1,232 @@
+#include "FontFingerprint.h"
+#include <algorithm>
+#include <string.h>
+
+#ifdef HAVE_FREETYPE
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#endif
+
+// Each glyph is rendered at 64 pixels per em, and its bitmap is averaged
+// over a grid of 9 x 8 cells. Each bit of a glyph's hash tells whether a cell
+// is darker than its left neighbour.
+static const char PROBE[FINGERPRINT_GLYPHS] = { 'a', 'e', 'g', 'R' };
+static const int EM_PIXELS = 64;
+static const int GRID_COLUMNS = 9;
+static const int GRID_ROWS = 8;
+
+#ifdef HAVE_FREETYPE
+
+bool canRenderFingerprints() {
+  return true;
+}
+
+static bool hashGlyph(FT_Face face, FT_ULong codepoint, uint64_t &hash) {
+  // Hinting differs between versions of a font, the outlines rarely do
+  FT_UInt glyph = FT_Get_Char_Index(face, codepoint);
+  if (glyph == 0 || FT_Load_Glyph(face, glyph, FT_LOAD_RENDER | FT_LOAD_NO_HINTING) != 0)
+    return false;
+
+  const FT_GlyphSlot slot = face->glyph;
+  const FT_Bitmap &bitmap = slot->bitmap;
+  if (bitmap.pixel_mode != FT_PIXEL_MODE_GRAY || bitmap.rows == 0 || bitmap.width == 0)
+    return false;
+
+  // The grid spans the glyph's own bounds, so all bits describe its shape
+  uint32_t cells[GRID_ROWS][GRID_COLUMNS];
+  memset(cells, 0, sizeof(cells));
+  for (unsigned int y = 0; y < bitmap.rows; y++) {
+    const unsigned char *row = bitmap.buffer + (ptrdiff_t) y * bitmap.pitch;
+    uint32_t *cellRow = cells[y * GRID_ROWS / bitmap.rows];
+    for (unsigned int x = 0; x < bitmap.width; x++)
+      cellRow[x * GRID_COLUMNS / bitmap.width] += row[x];
+  }
+
+  hash = 0;
+  for (int r = 0; r < GRID_ROWS; r++) {
+    for (int c = 0; c + 1 < GRID_COLUMNS; c++)
+      hash = (hash << 1) | (cells[r][c] < cells[r][c + 1] ? 1 : 0);
+  }
+  return true;
+}
+
+bool renderFingerprint(const uint8_t *data, size_t size, uint32_t index, FontFingerprint &fingerprint) {
+  memset(&fingerprint, 0, sizeof(fingerprint));
+
+  // A library per call, as FreeType libraries must not be shared between
+  // threads
+  FT_Library library;
+  if (FT_Init_FreeType(&library) != 0)
+    return false;
+
+  FT_Face face;
+  bool ok = FT_New_Memory_Face(library, data, (FT_Long) size, (FT_Long) index, &face) == 0;
+  if (ok) {
+    ok = FT_IS_SCALABLE(face) && FT_Set_Pixel_Sizes(face, 0, EM_PIXELS) == 0;
+    for (size_t i = 0; ok && i < FINGERPRINT_GLYPHS; i++)
+      ok = hashGlyph(face, (FT_ULong) PROBE[i], fingerprint.bits[i]);
+    FT_Done_Face(face);
+  }
+
+  FT_Done_FreeType(library);
+  return ok;
+}
+
+#else
+
+bool canRenderFingerprints() {
+  return false;
+}
+
+bool renderFingerprint(const uint8_t *data, size_t size, uint32_t index, FontFingerprint &fingerprint) {
+  memset(&fingerprint, 0, sizeof(fingerprint));
+  return false;
+}
+
+#endif
+
+static inline unsigned popcount64(uint64_t x) {
+#if defined(__GNUC__)
+  return (unsigned) __builtin_popcountll(x);
+#else
+  x = x - ((x >> 1) & 0x5555555555555555ULL);
+  x = (x & 0x3333333333333333ULL) + ((x >> 2) & 0x3333333333333333ULL);
+  x = (x + (x >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+  return (unsigned) ((x * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+unsigned fingerprintDistance(const FontFingerprint &a, const FontFingerprint &b) {
+  unsigned distance = 0;
+  for (size_t i = 0; i < FINGERPRINT_GLYPHS; i++)
+    distance += popcount64(a.bits[i] ^ b.bits[i]);
+  return distance;
+}
+
+static bool fingerprintLess(const FontFingerprint &a, const FontFingerprint &b) {
+  return memcmp(a.bits, b.bits, sizeof(a.bits)) < 0;
+}
+
+static const size_t FINGERPRINT_BITS = FINGERPRINT_GLYPHS * 64;
+
+// Positions of the bits of the bands: a fixed shuffle of all bits, so that
+// every band mixes all glyphs and rows. Some bits are the same in most
+// fingerprints, such as those of a glyph's blank corners, and a band made of
+// those alone would put most faces in the same bucket.
+static std::vector<uint8_t> bandPositions() {
+  std::vector<uint8_t> positions(FINGERPRINT_BITS);
+  for (size_t i = 0; i < FINGERPRINT_BITS; i++)
+    positions[i] = (uint8_t) i;
+
+  uint32_t state = 1;
+  for (size_t i = FINGERPRINT_BITS - 1; i > 0; i--) {
+    state = state * 1103515245 + 12345;
+    std::swap(positions[i], positions[(state >> 16) % (i + 1)]);
+  }
+  return positions;
+}
+
+// A fingerprint with the value of its bits in the current band
+struct BandEntry {
+  uint64_t key;
+  uint32_t index;
+  FontFingerprint print;
+
+  bool operator<(const BandEntry &other) const {
+    return key < other.key || (key == other.key && index < other.index);
+  }
+};
+
+static uint32_t findRoot(std::vector<uint32_t> &parents, uint32_t i) {
+  while (parents[i] != i) {
+    parents[i] = parents[parents[i]];
+    i = parents[i];
+  }
+  return i;
+}
+
+static void unite(std::vector<uint32_t> &parents, uint32_t a, uint32_t b) {
+  a = findRoot(parents, a);
+  b = findRoot(parents, b);
+  if (a != b)
+    parents[std::max(a, b)] = std::min(a, b);
+}
+
+bool clusterFingerprints(const std::vector<FontFingerprint> &prints, unsigned threshold,
+                         std::vector<std::vector<uint32_t> > &clusters) {
+  clusters.clear();
+  if (threshold > FINGERPRINT_MAX_THRESHOLD)
+    return false;
+
+  std::vector<uint32_t> parents(prints.size());
+  for (size_t i = 0; i < prints.size(); i++)
+    parents[i] = (uint32_t) i;
+
+  // Copies of the same font have equal fingerprints. Join those first, so
+  // only one of each needs to take part in the band search.
+  std::vector<uint32_t> order(parents);
+  std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return fingerprintLess(prints[a], prints[b]) || (!fingerprintLess(prints[b], prints[a]) && a < b);
+  });
+
+  std::vector<uint32_t> distinct;
+  for (size_t i = 0; i < order.size(); i++) {
+    if (i > 0 && memcmp(prints[order[i]].bits, prints[order[i - 1]].bits, sizeof(FontFingerprint)) == 0)
+      unite(parents, order[i - 1], order[i]);
+    else
+      distinct.push_back(order[i]);
+  }
+
+  // Fingerprints at most `threshold` bits apart agree on at least one of
+  // `threshold + 1` bands, so comparing the fingerprints which share a band
+  // finds them all. Fewer, longer bands put fewer unrelated fingerprints
+  // together. Keys are limited to 64 bits, hence at least four bands.
+  size_t bands = std::max<size_t>(threshold + 1, FINGERPRINT_BITS / 64);
+  std::vector<uint8_t> positions = bandPositions();
+  std::vector<BandEntry> entries(distinct.size());
+  for (size_t band = 0; band < bands; band++) {
+    size_t first = band * FINGERPRINT_BITS / bands;
+    size_t last = (band + 1) * FINGERPRINT_BITS / bands;
+    for (size_t i = 0; i < distinct.size(); i++) {
+      BandEntry &entry = entries[i];
+      entry.index = distinct[i];
+      entry.print = prints[distinct[i]];
+      entry.key = 0;
+      for (size_t b = first; b < last; b++)
+        entry.key |= ((entry.print.bits[positions[b] / 64] >> (positions[b] % 64)) & 1) << (b - first);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    for (size_t start = 0, end = 0; start < entries.size(); start = end) {
+      while (end < entries.size() && entries[end].key == entries[start].key)
+        end++;
+      for (size_t i = start; i < end; i++) {
+        for (size_t j = i + 1; j < end; j++) {
+          if (fingerprintDistance(entries[i].print, entries[j].print) <= threshold)
+            unite(parents, entries[i].index, entries[j].index);
+        }
+      }
+    }
+  }
+
+  // Roots are the smallest index of their cluster, so clusters come out
+  // ordered by their first index
+  std::vector<int> clusterOf(prints.size(), -1);
+  std::vector<std::vector<uint32_t> > all;
+  for (size_t i = 0; i < prints.size(); i++) {
+    uint32_t root = findRoot(parents, (uint32_t) i);
+    if (clusterOf[root] < 0) {
+      clusterOf[root] = (int) all.size();
+      all.push_back(std::vector<uint32_t>());
+    }
+    all[clusterOf[root]].push_back((uint32_t) i);
+  }
+
+  for (size_t i = 0; i < all.size(); i++) {
+    if (all[i].size() > 1) {
+      clusters.push_back(std::vector<uint32_t>());
+      clusters.back().swap(all[i]);
+    }
+  }
+  return true;
+}
@@ -0,0 +1,42 @@
+#ifndef FONT_FINGERPRINT_H
+#define FONT_FINGERPRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Perceptual hash of how a face draws a fixed probe string. Each probe glyph
+// is rendered unhinted at a fixed size and reduced to a 64-bit difference
+// hash, so renamed or re-versioned copies of the same design get the same
+// or nearly the same fingerprint while the bytes of their files differ.
+static const size_t FINGERPRINT_GLYPHS = 4;
+
+struct FontFingerprint {
+  uint64_t bits[FINGERPRINT_GLYPHS];  // One word per probe glyph
+};
+
+// The largest Hamming distance clusterFingerprints() accepts
+static const unsigned FINGERPRINT_MAX_THRESHOLD = 15;
+
+// Whether this build can render fingerprints, which needs FreeType
+bool canRenderFingerprints();
+
+// Render the fingerprint of font `index` of a font file or collection, with
+// the named instance of a variable font in the upper 16 bits. Returns false
+// if the font can not be rendered or lacks a glyph of the probe string.
+bool renderFingerprint(const uint8_t *data, size_t size, uint32_t index, FontFingerprint &fingerprint);
+
+// Number of bits in which two fingerprints differ
+unsigned fingerprintDistance(const FontFingerprint &a, const FontFingerprint &b);
+
+// Groups fingerprints which are at most `threshold` bits apart, directly or
+// through other fingerprints. Clusters are lists of indices into `prints`,
+// ascending and ordered by their first index; fingerprints without a near
+// neighbour are left out. Candidate pairs are found by locality-sensitive
+// hashing on bands of bits, which finds every pair within the threshold
+// without comparing all pairs. Returns false, with no clusters, if
+// `threshold` is above FINGERPRINT_MAX_THRESHOLD.
+bool clusterFingerprints(const std::vector<FontFingerprint> &prints, unsigned threshold,
+                         std::vector<std::vector<uint32_t> > &clusters);
+
+#endif // FONT_FINGERPRINT_H
@@ -0,0 +1,87 @@
+#include "FontLayout.h"
+#include "Sfnt.h"
+#include <algorithm>
+
+// Appends the tags of a ScriptList or FeatureList at `offset` in a layout
+// table. Both are a count followed by records of a tag and a 16-bit offset.
+static void readTagList(const uint8_t *table, uint32_t length, uint32_t offset, std::vector<uint32_t> &tags) {
+  if (offset == 0 || offset + 2 > length)
+    return;
+
+  uint32_t count = readU16(table + offset);
+  for (uint32_t i = 0; i < count && offset + 2 + (i + 1) * 6 <= length; i++)
+    tags.push_back(readU32(table + offset + 2 + i * 6));
+}
+
+static void sortTags(std::vector<uint32_t> &tags) {
+  std::sort(tags.begin(), tags.end());
+  tags.erase(std::unique(tags.begin(), tags.end()), tags.end());
+}
+
+bool readLayoutTags(const uint8_t *data, size_t size, uint32_t index, FontLayoutTags &tags) {
+  tags = FontLayoutTags();
+
+  std::vector<uint32_t> offsets;
+  std::string error;
+  if (!sfntFontOffsets(data, size, offsets, error) || index >= offsets.size())
+    return false;
+
+  SfntFont font;
+  if (!font.parse(data, size, offsets[index], error))
+    return false;
+
+  static const uint32_t TABLES[2] = { SFNT_TAG('G', 'S', 'U', 'B'), SFNT_TAG('G', 'P', 'O', 'S') };
+  for (int i = 0; i < 2; i++) {
+    // Both tables start with the version and the offsets of the script and
+    // feature lists
+    uint32_t length = 0;
+    const uint8_t *table = font.tableData(data, size, TABLES[i], &length);
+    if (!table || length < 10 || readU16(table) != 1)
+      continue;
+
+    readTagList(table, length, readU16(table + 4), tags.scripts);
+    readTagList(table, length, readU16(table + 6), tags.features);
+  }
+
+  sortTags(tags.scripts);
+  sortTags(tags.features);
+  return true;
+}
+
+bool parseLayoutTag(const char *str, size_t length, uint32_t &tag) {
+  if (length == 0 || length > 4)
+    return false;
+
+  tag = 0;
+  for (size_t i = 0; i < 4; i++) {
+    char c = i < length ? str[i] : ' ';
+    if (c < 0x20 || c >= 0x7F)
+      return false;
+    tag = (tag << 8) | (uint8_t) c;
+  }
+  return true;
+}
+
+// Indic scripts shaped by the old and the new OpenType model
+static const uint32_t INDIC_SCRIPTS[][2] = {
+  { SFNT_TAG('b', 'e', 'n', 'g'), SFNT_TAG('b', 'n', 'g', '2') },
+  { SFNT_TAG('d', 'e', 'v', 'a'), SFNT_TAG('d', 'e', 'v', '2') },
+  { SFNT_TAG('g', 'j', 'r', '2'), SFNT_TAG('g', 'u', 'j', 'r') },
+  { SFNT_TAG('g', 'u', 'r', '2'), SFNT_TAG('g', 'u', 'r', 'u') },
+  { SFNT_TAG('k', 'n', 'd', '2'), SFNT_TAG('k', 'n', 'd', 'a') },
+  { SFNT_TAG('m', 'l', 'm', '2'), SFNT_TAG('m', 'l', 'y', 'm') },
+  { SFNT_TAG('m', 'y', 'm', '2'), SFNT_TAG('m', 'y', 'm', 'r') },
+  { SFNT_TAG('o', 'r', 'y', '2'), SFNT_TAG('o', 'r', 'y', 'a') },
+  { SFNT_TAG('t', 'a', 'm', 'l'), SFNT_TAG('t', 'm', 'l', '2') },
+  { SFNT_TAG('t', 'e', 'l', '2'), SFNT_TAG('t', 'e', 'l', 'u') }
+};
+
+uint32_t alternateScriptTag(uint32_t tag) {
+  for (size_t i = 0; i < sizeof(INDIC_SCRIPTS) / sizeof(INDIC_SCRIPTS[0]); i++) {
+    if (INDIC_SCRIPTS[i][0] == tag)
+      return INDIC_SCRIPTS[i][1];
+    if (INDIC_SCRIPTS[i][1] == tag)
+      return INDIC_SCRIPTS[i][0];
+  }
+  return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef FONT_LAYOUT_H
+#define FONT_LAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// OpenType layout tags of a face: the scripts and features listed in the
+// ScriptList and FeatureList of its 'GSUB' and 'GPOS' tables. A face which
+// lists a script has shaping rules for it, not merely glyphs for its
+// characters.
+struct FontLayoutTags {
+  std::vector<uint32_t> scripts;   // Sorted and distinct
+  std::vector<uint32_t> features;
+};
+
+// Read the layout tags of font `index` of a font file or collection. Returns
+// false if the font can not be read. A font without 'GSUB' and 'GPOS' tables
+// has no tags.
+bool readLayoutTags(const uint8_t *data, size_t size, uint32_t index, FontLayoutTags &tags);
+
+// Parse a tag of one to four printable ASCII characters, such as "liga" or
+// "lao", padding it with spaces as fonts store it. Returns false if `str`
+// is not a tag.
+bool parseLayoutTag(const char *str, size_t length, uint32_t &tag);
+
+// The other tag of an Indic script with an old and a new shaping model,
+// such as "dev2" for "deva" and "deva" for "dev2", or 0 if there is none
+uint32_t alternateScriptTag(uint32_t tag);
+
+#endif // FONT_LAYOUT_H
@@ -1,5 +1,15 @@
 #include <fontconfig/fontconfig.h>
+#include <algorithm>
+#include <dirent.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
 #include "FontDescriptor.h"
+#include "FontCatalog.h"
+#include "ParallelFor.h"
 
 int convertWeight(FontWeight weight) {
   switch (weight) {
@@ -26,29 +36,10 @@ int convertWeight(FontWeight weight) {
   }
 }
 
-FontWeight convertWeight(int weight) {
-  switch (weight) {
-    case FC_WEIGHT_THIN:
-      return FontWeightThin;
-    case FC_WEIGHT_ULTRALIGHT:
-      return FontWeightUltraLight;
-    case FC_WEIGHT_LIGHT:
-      return FontWeightLight;
-    case FC_WEIGHT_REGULAR:
-      return FontWeightNormal;
-    case FC_WEIGHT_MEDIUM:
-      return FontWeightMedium;
-    case FC_WEIGHT_SEMIBOLD:
-      return FontWeightSemiBold;
-    case FC_WEIGHT_BOLD:
-      return FontWeightBold;
-    case FC_WEIGHT_EXTRABOLD:
-      return FontWeightUltraBold;
-    case FC_WEIGHT_ULTRABLACK:
-      return FontWeightHeavy;
-    default:
-      return FontWeightNormal;
-  }
+// Converts a fontconfig weight to the OpenType scale, keeping intermediate
+// weights (e.g. 350) instead of snapping them to a named weight
+FontWeight convertWeight(double weight) {
+  return (FontWeight) (int) (FcWeightToOpenTypeDouble(weight) + 0.5);
 }
 
 int convertWidth(FontWidth width) {
@@ -76,29 +67,28 @@ int convertWidth(FontWidth width) {
   }
 }
 
-FontWidth convertWidth(int width) {
-  switch (width) {
-    case FC_WIDTH_ULTRACONDENSED:
-      return FontWidthUltraCondensed;
-    case FC_WIDTH_EXTRACONDENSED:
-      return FontWidthExtraCondensed;
-    case FC_WIDTH_CONDENSED:
-      return FontWidthCondensed;
-    case FC_WIDTH_SEMICONDENSED:
-      return FontWidthSemiCondensed;
-    case FC_WIDTH_NORMAL:
-      return FontWidthNormal;
-    case FC_WIDTH_SEMIEXPANDED:
-      return FontWidthSemiExpanded;
-    case FC_WIDTH_EXPANDED:
-      return FontWidthExpanded;
-    case FC_WIDTH_EXTRAEXPANDED:
-      return FontWidthExtraExpanded;
-    case FC_WIDTH_ULTRAEXPANDED:
-      return FontWidthUltraExpanded;
-    default:
-      return FontWidthNormal;
+// Fontconfig widths are a percentage of the normal width already, which
+// is kept as is like the weight, not snapped to a named width
+FontWidth convertWidth(double width) {
+  return (FontWidth) (int) (width + 0.5);
+}
+
+// Reads a numeric property into `value` and the range of values the font
+// supports into `begin` and `end`. Variable fonts store the range of an axis
+// instead of a single value, for those `value` is the value closest to
+// `preferred` in the range.
+void getNumber(FcPattern *pattern, const char *object, double preferred, double &value, double &begin, double &end) {
+  FcRange *range = NULL;
+
+  if (FcPatternGetDouble(pattern, object, 0, &value) == FcResultMatch) {
+    begin = end = value;
+    return;
   }
+
+  begin = end = preferred;
+  if (FcPatternGetRange(pattern, object, 0, &range) == FcResultMatch)
+    FcRangeGetDouble(range, &begin, &end);
+  value = preferred < begin ? begin : preferred > end ? end : preferred;
 }
 
 FontDescriptor *createFontDescriptor(FcPattern *pattern) {
@@ -106,22 +96,24 @@ FontDescriptor *createFontDescriptor(FcPattern *pattern) {
   FcChar8 *psName = NULL;
   FcChar8 *family = NULL;
   FcChar8 *style = NULL;
-  int weight = 0;
-  int width = 0;
   int slant = 0;
   int spacing = 0;
+  int index = 0;
 
   FcPatternGetString(pattern, FC_FILE, 0, &path);
   FcPatternGetString(pattern, FC_POSTSCRIPT_NAME, 0, &psName);
   FcPatternGetString(pattern, FC_FAMILY, 0, &family);
   FcPatternGetString(pattern, FC_STYLE, 0, &style);
 
-  FcPatternGetInteger(pattern, FC_WEIGHT, 0, &weight);
-  FcPatternGetInteger(pattern, FC_WIDTH, 0, &width);
+  double weight, weightBegin, weightEnd;
+  double width, widthBegin, widthEnd;
+  getNumber(pattern, FC_WEIGHT, FC_WEIGHT_REGULAR, weight, weightBegin, weightEnd);
+  getNumber(pattern, FC_WIDTH, FC_WIDTH_NORMAL, width, widthBegin, widthEnd);
   FcPatternGetInteger(pattern, FC_SLANT, 0, &slant);
   FcPatternGetInteger(pattern, FC_SPACING, 0, &spacing);
+  FcPatternGetInteger(pattern, FC_INDEX, 0, &index);
 
-  return new FontDescriptor(
+  FontDescriptor *font = new FontDescriptor(
     (char *) path,
     (char *) psName,
     (char *) family,
@@ -130,8 +122,44 @@ FontDescriptor *createFontDescriptor(FcPattern *pattern) {
     convertWidth(width),
     slant == FC_SLANT_ITALIC,
     slant == FC_SLANT_OBLIQUE,
-    spacing == FC_MONO
+    spacing == FC_MONO,
+    index
   );
+  font->weightMin = convertWeight(weightBegin);
+  font->weightMax = convertWeight(weightEnd);
+  font->widthMin = convertWidth(widthBegin);
+  font->widthMax = convertWidth(widthEnd);
+
+  // Every family and style name with its language, the first ones above
+  const char *nameObjects[][2] = {
+    { FC_FAMILY, FC_FAMILYLANG },
+    { FC_STYLE, FC_STYLELANG },
+    { FC_POSTSCRIPT_NAME, NULL }
+  };
+  FontNameKind kinds[] = { FontNameFamily, FontNameStyle, FontNamePostscript };
+  for (int k = 0; k < 3; k++) {
+    FcChar8 *name = NULL;
+    for (int i = 0; FcPatternGetString(pattern, nameObjects[k][0], i, &name) == FcResultMatch; i++) {
+      FcChar8 *lang = NULL;
+      if (nameObjects[k][1]) {
+        FcPatternGetString(pattern, nameObjects[k][1], i, &lang);
+      }
+      font->aliases.push_back(FontAlias(kinds[k], (const char *) name, (const char *) lang));
+    }
+  }
+
+  FcLangSet *langs = NULL;
+  if (FcPatternGetLangSet(pattern, FC_LANG, 0, &langs) == FcResultMatch) {
+    FcStrSet *tags = FcLangSetGetLangs(langs);
+    FcStrList *list = FcStrListCreate(tags);
+    while (FcChar8 *tag = FcStrListNext(list)) {
+      font->languages.push_back((const char *) tag);
+    }
+    FcStrListDone(list);
+    FcStrSetDestroy(tags);
+  }
+
+  return font;
 }
 
 ResultSet *getResultSet(FcFontSet *fs) {
@@ -151,7 +179,7 @@ ResultSet *getAvailableFonts() {
   FcInit();
 
   FcPattern *pattern = FcPatternCreate();
-  FcObjectSet *os = FcObjectSetBuild(FC_FILE, FC_POSTSCRIPT_NAME, FC_FAMILY, FC_STYLE, FC_WEIGHT, FC_WIDTH, FC_SLANT, FC_SPACING, NULL);
+  FcObjectSet *os = FcObjectSetBuild(FC_FILE, FC_POSTSCRIPT_NAME, FC_FAMILY, FC_STYLE, FC_WEIGHT, FC_WIDTH, FC_SLANT, FC_SPACING, FC_INDEX, FC_LANG, FC_FAMILYLANG, FC_STYLELANG, NULL);
   FcFontSet *fs = FcFontList(NULL, pattern, os);
   ResultSet *res = getResultSet(fs);
 
@@ -212,3 +240,332 @@ FontDescriptor *substituteFont(const char *postscriptName, const char *string) {
   
   return result;
 }
+
+// Charsets of the fonts queried by fontHasCodepoint(), keyed by path and
+// PostScript name so that faces of a collection are kept apart.
+static std::unordered_map<std::string, FcCharSet *> charsetCache;
+
+static FcCharSet *getCharSet(const char *path, const char *postscriptName) {
+  std::string key = std::string(path ? path : "") + '\0' +
+                    (postscriptName ? postscriptName : "");
+
+  std::unordered_map<std::string, FcCharSet *>::iterator it = charsetCache.find(key);
+  if (it != charsetCache.end()) {
+    return it->second;
+  }
+
+  FcInit();
+  FcPattern *pattern = FcPatternCreate();
+  if (path) {
+    FcPatternAddString(pattern, FC_FILE, (FcChar8 *) path);
+  }
+  if (postscriptName && *postscriptName) {
+    FcPatternAddString(pattern, FC_POSTSCRIPT_NAME, (FcChar8 *) postscriptName);
+  }
+
+  FcObjectSet *os = FcObjectSetBuild(FC_CHARSET, NULL);
+  FcFontSet *fs = FcFontList(NULL, pattern, os);
+
+  FcCharSet *charset = NULL;
+  if (fs && fs->nfont > 0) {
+    FcCharSet *found = NULL;
+    if (FcPatternGetCharSet(fs->fonts[0], FC_CHARSET, 0, &found) == FcResultMatch) {
+      charset = FcCharSetCopy(found);
+    }
+  }
+
+  if (fs) {
+    FcFontSetDestroy(fs);
+  }
+  FcObjectSetDestroy(os);
+  FcPatternDestroy(pattern);
+
+  charsetCache[key] = charset;
+  return charset;
+}
+
+bool fontHasCodepoint(FontDescriptor *font, unsigned int codepoint) {
+  if (!font) {
+    return false;
+  }
+
+  FcCharSet *charset = getCharSet(font->path, font->postscriptName);
+  return charset && FcCharSetHasChar(charset, codepoint);
+}
+
+bool buildFallbackTable(const FontCatalog &catalog, const char *base, FallbackTable &table) {
+  FcInit();
+
+  FcPattern *pattern = FcPatternCreate();
+  int baseFace = catalog.findPostscriptName(base);
+  if (baseFace >= 0) {
+    // Match the face's family and style too, so older fontconfig versions
+    // which ignore the PostScript name still sort the right family first
+    const CatalogFace &face = catalog.face(baseFace);
+    FcPatternAddString(pattern, FC_POSTSCRIPT_NAME, (FcChar8 *) base);
+    FcPatternAddString(pattern, FC_FAMILY, (FcChar8 *) catalog.string(face.family));
+    FcPatternAddString(pattern, FC_STYLE, (FcChar8 *) catalog.string(face.style));
+  } else if (base && *base) {
+    // Not a known PostScript name, treat it as a family or generic family
+    FcPatternAddString(pattern, FC_FAMILY, (FcChar8 *) base);
+  }
+
+  FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+  FcDefaultSubstitute(pattern);
+
+  FcResult res;
+  FcFontSet *fs = FcFontSort(NULL, pattern, FcFalse, NULL, &res);
+  FcPatternDestroy(pattern);
+  if (!fs) {
+    return false;
+  }
+
+  // The sorted patterns carry the charsets from fontconfig's cache, so no
+  // font files need to be opened here.
+  std::vector<uint32_t> faceIds;
+  std::vector<FcCharSet *> charsets;
+  if (baseFace >= 0) {
+    const CatalogFace &face = catalog.face(baseFace);
+    faceIds.push_back(baseFace);
+    charsets.push_back(getCharSet(catalog.string(face.path), catalog.string(face.postscriptName)));
+  }
+
+  for (int i = 0; i < fs->nfont; i++) {
+    FcChar8 *path = NULL;
+    FcChar8 *psName = NULL;
+    FcCharSet *charset = NULL;
+    FcPatternGetString(fs->fonts[i], FC_FILE, 0, &path);
+    FcPatternGetString(fs->fonts[i], FC_POSTSCRIPT_NAME, 0, &psName);
+
+    int id = catalog.findFace((char *) path, (char *) psName);
+    if (id < 0 || id == baseFace || FcPatternGetCharSet(fs->fonts[i], FC_CHARSET, 0, &charset) != FcResultMatch) {
+      continue;
+    }
+
+    faceIds.push_back(id);
+    charsets.push_back(charset);
+  }
+
+  // Assign each codepoint to the first face in sort order which covers it.
+  // Ranks are 16 bit, faces beyond that are never preferred anyway.
+  std::vector<uint16_t> ranks(FallbackTable::PAGE_COUNT * FallbackTable::PAGE_SIZE, FallbackTable::NO_ENTRY);
+  std::vector<uint32_t> usedFaces;
+
+  for (size_t i = 0; i < faceIds.size() && usedFaces.size() < FallbackTable::NO_ENTRY; i++) {
+    FcCharSet *charset = charsets[i];
+    if (!charset) {
+      continue;
+    }
+
+    uint16_t entry = (uint16_t) usedFaces.size();
+    bool used = false;
+
+    FcChar32 map[FC_CHARSET_MAP_SIZE];
+    FcChar32 next;
+    for (FcChar32 page = FcCharSetFirstPage(charset, map, &next);
+         page != FC_CHARSET_DONE;
+         page = FcCharSetNextPage(charset, map, &next)) {
+      for (int word = 0; word < FC_CHARSET_MAP_SIZE; word++) {
+        FcChar32 bits = map[word];
+        while (bits) {
+          int bit = __builtin_ctz(bits);
+          bits &= bits - 1;
+
+          FcChar32 codepoint = page + word * 32 + bit;
+          if (codepoint < ranks.size() && ranks[codepoint] == FallbackTable::NO_ENTRY) {
+            ranks[codepoint] = entry;
+            used = true;
+          }
+        }
+      }
+    }
+
+    if (used) {
+      usedFaces.push_back(faceIds[i]);
+    }
+  }
+
+  FcFontSetDestroy(fs);
+  table.build(ranks, usedFaces);
+  return true;
+}
+
+bool buildFallbackChain(const FontCatalog &catalog, const char *family, const char *language, const char *style,
+                        std::vector<uint32_t> &faces) {
+  FcInit();
+
+  FcPattern *pattern = FcPatternCreate();
+  if (family && *family) {
+    FcPatternAddString(pattern, FC_FAMILY, (FcChar8 *) family);
+  }
+  if (language && *language) {
+    FcPatternAddString(pattern, FC_LANG, (FcChar8 *) language);
+  }
+  if (style && *style) {
+    FcPatternAddString(pattern, FC_STYLE, (FcChar8 *) style);
+  }
+
+  FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+  FcDefaultSubstitute(pattern);
+
+  // With trimming fontconfig drops each font whose charset adds nothing to
+  // the union of the fonts sorted before it
+  FcResult res;
+  FcFontSet *fs = FcFontSort(NULL, pattern, FcTrue, NULL, &res);
+  FcPatternDestroy(pattern);
+  if (!fs) {
+    return false;
+  }
+
+  std::set<int> seen;
+  for (int i = 0; i < fs->nfont; i++) {
+    FcChar8 *path = NULL;
+    FcChar8 *psName = NULL;
+    FcPatternGetString(fs->fonts[i], FC_FILE, 0, &path);
+    FcPatternGetString(fs->fonts[i], FC_POSTSCRIPT_NAME, 0, &psName);
+
+    int id = catalog.findFace((char *) path, (char *) psName);
+    if (id >= 0 && seen.insert(id).second) {
+      faces.push_back(id);
+    }
+  }
+
+  FcFontSetDestroy(fs);
+  return true;
+}
+
+size_t warmFontCaches(size_t jobs, std::vector<std::string> &failed) {
+  // Load only the configuration. FcInit() would scan every directory
+  // without a valid cache on this thread, one after the other.
+  FcConfig *config = FcInitLoadConfig();
+  if (!config) {
+    failed.push_back("fontconfig configuration");
+    return 0;
+  }
+
+  std::vector<std::string> level;
+  FcStrList *dirs = FcConfigGetFontDirs(config);
+  while (FcChar8 *dir = FcStrListNext(dirs)) {
+    // Configurations commonly list directories which do not exist
+    struct stat st;
+    if (stat((const char *) dir, &st) == 0 && S_ISDIR(st.st_mode))
+      level.push_back((const char *) dir);
+  }
+  FcStrListDone(dirs);
+
+  // Caches are built one directory level at a time, as the subdirectories
+  // of a directory are only known from its cache. FcDirCacheRead() loads a
+  // valid cache, or scans the directory and writes a new one.
+  std::mutex lock;
+  size_t visited = 0;
+  while (!level.empty()) {
+    std::vector<std::string> next;
+    parallelFor(level.size(), jobs, [&](size_t i) {
+      FcCache *cache = FcDirCacheRead((const FcChar8 *) level[i].c_str(), FcFalse, config);
+
+      std::lock_guard<std::mutex> guard(lock);
+      if (!cache) {
+        failed.push_back(level[i]);
+        return;
+      }
+
+      for (int j = 0; j < FcCacheNumSubdir(cache); j++)
+        next.push_back((const char *) FcCacheSubdir(cache, j));
+      FcDirCacheUnload(cache);
+    });
+
+    visited += level.size();
+    level.swap(next);
+  }
+
+  // Make the warmed configuration the one used from here on. Building its
+  // font list now only reads the caches. FcConfigSetCurrent() takes its own
+  // reference only since fontconfig 2.13.91. Before that, ours is the only
+  // reference to the current configuration, so it is kept for the life of
+  // the process.
+  FcConfigSetCurrent(config);
+#if FC_VERSION >= 21391
+  FcConfigDestroy(config);
+#endif
+  return visited;
+}
+
+
+// Adds `text` and its terminating zero to an FNV-1a hash
+static void hashString(uint64_t &hash, const char *text) {
+  const char *p = text;
+  do {
+    hash = (hash ^ (uint8_t) *p) * 1099511628211ULL;
+  } while (*p++);
+}
+
+// Adds the path and modification time of `path` to the hash, if it exists
+static bool hashFileTime(uint64_t &hash, const char *path, struct stat &st) {
+  if (stat(path, &st) != 0)
+    return false;
+
+  char time[64];
+  snprintf(time, sizeof(time), "%lld.%09ld", (long long) st.st_mtim.tv_sec, (long) st.st_mtim.tv_nsec);
+  hashString(hash, path);
+  hashString(hash, time);
+  return true;
+}
+
+// Fontconfig notices new fonts by the modification times of the font
+// directories, and so does the stamp. It covers the configuration files
+// and every directory below the configured font directories, found without
+// reading any font or cache.
+std::string fontSourceStamp() {
+  FcConfig *config = FcInitLoadConfig();
+  if (!config)
+    return "";
+
+  uint64_t hash = 14695981039346656037ULL;
+  struct stat st;
+  FcStrList *files = FcConfigGetConfigFiles(config);
+  while (FcChar8 *file = FcStrListNext(files))
+    hashFileTime(hash, (const char *) file, st);
+  FcStrListDone(files);
+
+  std::vector<std::string> pending;
+  FcStrList *dirs = FcConfigGetFontDirs(config);
+  while (FcChar8 *dir = FcStrListNext(dirs))
+    pending.push_back((const char *) dir);
+  FcStrListDone(dirs);
+  FcConfigDestroy(config);
+
+  // Symbolic links may lead to a directory twice, or in a circle
+  std::set<std::pair<dev_t, ino_t> > visited;
+  size_t directories = 0;
+  while (!pending.empty()) {
+    std::string path = pending.back();
+    pending.pop_back();
+    if (!hashFileTime(hash, path.c_str(), st) || !S_ISDIR(st.st_mode) ||
+        !visited.insert(std::make_pair(st.st_dev, st.st_ino)).second)
+      continue;
+
+    directories++;
+    DIR *dir = opendir(path.c_str());
+    if (!dir)
+      continue;
+
+    // Files need no stat, adding or removing one changes the directory.
+    // Entries are sorted, as the order of readdir() may change.
+    std::vector<std::string> children;
+    while (struct dirent *entry = readdir(dir)) {
+      if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+        continue;
+      if (entry->d_type == DT_DIR || entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN)
+        children.push_back(path + "/" + entry->d_name);
+    }
+    closedir(dir);
+
+    std::sort(children.begin(), children.end());
+    pending.insert(pending.end(), children.rbegin(), children.rend());
+  }
+
+  char stamp[96];
+  snprintf(stamp, sizeof(stamp), "fontconfig %d, %lu directories, %016llx", FcGetVersion(),
+           (unsigned long) directories, (unsigned long long) hash);
+  return stamp;
+}
@@ -1,6 +1,9 @@
 #include <Foundation/Foundation.h>
 #include <CoreText/CoreText.h>
 #include "FontDescriptor.h"
+#include "FontCatalog.h"
+#include <string>
+#include <unordered_map>
 
 // converts a CoreText weight (-1 to +1) to a standard weight (100 to 900)
 static int convertWeight(float weight) {
@@ -24,12 +27,13 @@ static int convertWeight(float weight) {
     return 900;
 }
 
-// converts a CoreText width (-1 to +1) to a standard width (1 to 9)
+// converts a CoreText width (-1 to +1) to a percentage of the normal width
+// (50 to 200)
 static int convertWidth(float unit) {
   if (unit < 0) {
-    return 1 + (1 + unit) * 4;
+    return (int) (100 + unit * 50 + 0.5f);
   } else {
-    return 5 + unit * 4;
+    return (int) (100 + unit * 100 + 0.5f);
   }
 }
 
@@ -253,3 +257,71 @@ FontDescriptor *substituteFont(const char *postscriptName, const char *string) {
   
   return res;
 }
+
+// Character sets of the fonts queried by fontHasCodepoint(), keyed by path and
+// PostScript name so that faces of a collection are kept apart.
+static std::unordered_map<std::string, CFCharacterSetRef> charsetCache;
+
+static CFCharacterSetRef getCharacterSet(const char *path, const char *postscriptName) {
+  std::string key = std::string(path ? path : "") + '\0' +
+                    (postscriptName ? postscriptName : "");
+
+  std::unordered_map<std::string, CFCharacterSetRef>::iterator it = charsetCache.find(key);
+  if (it != charsetCache.end()) {
+    return it->second;
+  }
+
+  // CoreText falls back to another font for an unknown name, whose
+  // characters must not be taken for this one's
+  CFCharacterSetRef charset = NULL;
+  if (postscriptName && *postscriptName) {
+    NSString *ps = [NSString stringWithUTF8String:postscriptName];
+    NSDictionary *attrs = @{(id)kCTFontNameAttribute: ps};
+    CTFontDescriptorRef descriptor = CTFontDescriptorCreateWithAttributes((CFDictionaryRef) attrs);
+    CTFontRef font = CTFontCreateWithFontDescriptor(descriptor, 12.0, NULL);
+    NSString *name = (NSString *) CTFontCopyPostScriptName(font);
+    if ([name isEqualToString:ps]) {
+      charset = CTFontCopyCharacterSet(font);
+    }
+
+    [name release];
+    CFRelease(font);
+    CFRelease(descriptor);
+  }
+
+  charsetCache[key] = charset;
+  return charset;
+}
+
+bool fontHasCodepoint(FontDescriptor *font, unsigned int codepoint) {
+  if (!font) {
+    return false;
+  }
+
+  CFCharacterSetRef charset = getCharacterSet(font->path, font->postscriptName);
+  return charset && CFCharacterSetIsLongCharacterMember(charset, codepoint);
+}
+
+// CoreText does not expose its fallback order, so substitution stays with
+// substituteFont().
+bool buildFallbackTable(const FontCatalog &catalog, const char *base, FallbackTable &table) {
+  return false;
+}
+
+// CoreText's cascade lists are not mapped to catalog faces yet, so there is
+// no fallback chain.
+bool buildFallbackChain(const FontCatalog &catalog, const char *family, const char *language, const char *style,
+                        std::vector<uint32_t> &faces) {
+  return false;
+}
+
+// macOS maintains its font caches itself, so there is nothing to warm.
+size_t warmFontCaches(size_t jobs, std::vector<std::string> &failed) {
+  return 0;
+}
+
+// Fonts can be activated at runtime without touching any directory, so there
+// is no cheap stamp and every process enumerates them itself.
+std::string fontSourceStamp() {
+  return "";
+}
@@ -1,7 +1,11 @@
 #define WINVER 0x0600
 #include "FontDescriptor.h"
+#include "FontCatalog.h"
 #include <dwrite.h>
 #include <dwrite_1.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
 #include <unordered_set>
 
 // throws a JS error when there is some exception in DirectWrite
@@ -113,7 +117,7 @@ FontDescriptor *resultFromFont(IDWriteFont *font) {
         family,
         style,
         (FontWeight) font->GetWeight(),
-        (FontWidth) font->GetStretch(),
+        widthOfClass(font->GetStretch()),
         font->GetStyle() == DWRITE_FONT_STYLE_ITALIC,
         font->GetStyle() == DWRITE_FONT_STYLE_OBLIQUE,
         monospace
@@ -406,3 +410,96 @@ FontDescriptor *substituteFont(const char *postscriptName, const char *string) {
   
   return result;
 }
+
+// Fonts queried by fontHasCodepoint(), keyed by path and PostScript name so
+// that faces of a collection are kept apart, or NULL if not found.
+static std::unordered_map<std::string, IDWriteFont *> coverageFonts;
+
+// Finds the font of the system collection with a PostScript name
+static IDWriteFont *findPostscriptName(const char *postscriptName) {
+  IDWriteFactory *factory = NULL;
+  HRESULT hr = DWriteCreateFactory(
+    DWRITE_FACTORY_TYPE_SHARED,
+    __uuidof(IDWriteFactory),
+    reinterpret_cast<IUnknown**>(&factory)
+  );
+  if (FAILED(hr)) {
+    return NULL;
+  }
+
+  IDWriteFont *found = NULL;
+  IDWriteFontCollection *collection = NULL;
+  if (SUCCEEDED(factory->GetSystemFontCollection(&collection))) {
+    for (UINT32 i = 0; !found && i < collection->GetFontFamilyCount(); i++) {
+      IDWriteFontFamily *family = NULL;
+      if (FAILED(collection->GetFontFamily(i, &family))) {
+        continue;
+      }
+
+      for (UINT32 j = 0; !found && j < family->GetFontCount(); j++) {
+        IDWriteFont *font = NULL;
+        if (FAILED(family->GetFont(j, &font))) {
+          continue;
+        }
+
+        char *name = getString(font, DWRITE_INFORMATIONAL_STRING_POSTSCRIPT_NAME);
+        if (name && strcmp(name, postscriptName) == 0) {
+          found = font;
+        } else {
+          font->Release();
+        }
+        delete[] name;
+      }
+
+      family->Release();
+    }
+
+    collection->Release();
+  }
+
+  factory->Release();
+  return found;
+}
+
+bool fontHasCodepoint(FontDescriptor *font, unsigned int codepoint) {
+  if (!font || !font->postscriptName) {
+    return false;
+  }
+
+  std::string key = std::string(font->path ? font->path : "") + '\0' + font->postscriptName;
+  std::unordered_map<std::string, IDWriteFont *>::iterator it = coverageFonts.find(key);
+  IDWriteFont *dwriteFont = NULL;
+  if (it != coverageFonts.end()) {
+    dwriteFont = it->second;
+  } else {
+    dwriteFont = findPostscriptName(font->postscriptName);
+    coverageFonts[key] = dwriteFont;
+  }
+
+  BOOL exists = FALSE;
+  return dwriteFont && SUCCEEDED(dwriteFont->HasCharacter(codepoint, &exists)) && exists;
+}
+
+// DirectWrite does not expose its fallback order, so substitution stays with
+// substituteFont().
+bool buildFallbackTable(const FontCatalog &catalog, const char *base, FallbackTable &table) {
+  return false;
+}
+
+// DirectWrite's fallback mappings are not mapped to catalog faces yet, so
+// there is no fallback chain.
+bool buildFallbackChain(const FontCatalog &catalog, const char *family, const char *language, const char *style,
+                        std::vector<uint32_t> &faces) {
+  return false;
+}
+
+// Windows maintains its font caches itself, so there is nothing to warm.
+size_t warmFontCaches(size_t jobs, std::vector<std::string> &failed) {
+  return 0;
+}
+
+// Fonts can be installed per user and per session through the registry, so
+// there is no cheap stamp and every process enumerates them itself.
+std::string fontSourceStamp() {
+  return "";
+}
@@ -0,0 +1,70 @@
+#include "FontMetrics.h"
+#include "Sfnt.h"
+
+// fsSelection bit telling to use the typographic metrics of 'OS/2'
+static const uint16_t USE_TYPO_METRICS = 1 << 7;
+
+bool readFontMetrics(const uint8_t *data, size_t size, uint32_t index, FontMetrics &metrics) {
+  metrics = FontMetrics();
+
+  std::vector<uint32_t> offsets;
+  std::string error;
+  if (!sfntFontOffsets(data, size, offsets, error) || index >= offsets.size())
+    return false;
+
+  SfntFont font;
+  if (!font.parse(data, size, offsets[index], error))
+    return false;
+
+  uint32_t headLength = 0;
+  const uint8_t *head = font.tableData(data, size, SFNT_TAG('h', 'e', 'a', 'd'), &headLength);
+  if (!head || headLength < 54)
+    return false;
+
+  metrics.unitsPerEm = readU16(head + 18);
+  metrics.flags = FontMetricsValid;
+
+  uint32_t hheaLength = 0;
+  const uint8_t *hhea = font.tableData(data, size, SFNT_TAG('h', 'h', 'e', 'a'), &hheaLength);
+  bool hasHhea = hhea && hheaLength >= 36;
+
+  uint32_t os2Length = 0;
+  const uint8_t *os2 = font.tableData(data, size, SFNT_TAG('O', 'S', '/', '2'), &os2Length);
+  bool hasTypo = os2 && os2Length >= 78;
+
+  // Like most layout engines, prefer 'hhea' unless the font asks for the
+  // typographic metrics or 'hhea' has none
+  bool useTypo = hasTypo && (!hasHhea || (readU16(os2 + 62) & USE_TYPO_METRICS) ||
+                             (readS16(hhea + 4) == 0 && readS16(hhea + 6) == 0));
+  if (useTypo) {
+    metrics.ascender = readS16(os2 + 68);
+    metrics.descender = readS16(os2 + 70);
+    metrics.lineGap = readS16(os2 + 72);
+  } else if (hasHhea) {
+    metrics.ascender = readS16(hhea + 4);
+    metrics.descender = readS16(hhea + 6);
+    metrics.lineGap = readS16(hhea + 8);
+  }
+
+  if (os2 && os2Length >= 42) {
+    metrics.averageWidth = readS16(os2 + 2);
+    memcpy(metrics.panose, os2 + 32, sizeof(metrics.panose));
+    metrics.flags |= FontMetricsOS2;
+  }
+
+  uint32_t postLength = 0;
+  const uint8_t *post = font.tableData(data, size, SFNT_TAG('p', 'o', 's', 't'), &postLength);
+  if (post && postLength >= 8) {
+    metrics.italicAngle = (int32_t) readU32(post + 4);
+    metrics.flags |= FontMetricsItalicAngle;
+  }
+
+  // sxHeight and sCapHeight were added in version 2
+  if (os2 && os2Length >= 96 && readU16(os2) >= 2) {
+    metrics.xHeight = readS16(os2 + 86);
+    metrics.capHeight = readS16(os2 + 88);
+    metrics.flags |= FontMetricsXHeight | FontMetricsCapHeight;
+  }
+
+  return true;
+}
@@ -0,0 +1,43 @@
+#ifndef FONT_METRICS_H
+#define FONT_METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string.h>
+
+enum FontMetricsFlags {
+  FontMetricsValid       = 1 << 0,  // The font could be read
+  FontMetricsXHeight     = 1 << 1,  // xHeight is set
+  FontMetricsCapHeight   = 1 << 2,  // capHeight is set
+  FontMetricsOS2         = 1 << 3,  // averageWidth and panose are set
+  FontMetricsItalicAngle = 1 << 4   // italicAngle is set
+};
+
+// Metrics of a face in font units, as read from the 'head', 'hhea', 'OS/2'
+// and 'post' tables. Descender is negative below the baseline.
+struct FontMetrics {
+  int32_t unitsPerEm;
+  int32_t ascender;
+  int32_t descender;
+  int32_t lineGap;
+  int32_t xHeight;
+  int32_t capHeight;
+  int32_t averageWidth;  // xAvgCharWidth
+  int32_t italicAngle;   // Degrees counter-clockwise in 16.16 fixed point
+  uint32_t flags;
+  uint8_t panose[10];    // PANOSE classification
+  uint8_t reserved[2];
+
+  FontMetrics() : unitsPerEm(0), ascender(0), descender(0), lineGap(0), xHeight(0), capHeight(0),
+                  averageWidth(0), italicAngle(0), flags(0) {
+    memset(panose, 0, sizeof(panose));
+    memset(reserved, 0, sizeof(reserved));
+  }
+};
+
+// Read the metrics of font `index` of a font file or collection. Returns
+// false if the font or its 'head' table can not be read.
+bool readFontMetrics(const uint8_t *data, size_t size, uint32_t index, FontMetrics &metrics);
+
+#endif // FONT_METRICS_H
@@ -1,4 +1,8 @@
 #include "FontQuery.h"
+#include "FontCatalog.h"
+#include "QueryExpression.h"
+#include "ParallelSort.h"
+#include <unordered_map>
 #include <cstring>
 #include <climits> // For INT_MAX
 
@@ -28,103 +32,262 @@ bool caseInsensitiveMatch(const char *a, const char *b) {
 // Returns a score indicating how well a font matches a query
 // Lower score = better match (0 = perfect match)
 int matchScore(FontDescriptor *font, FontDescriptor *query) {
+  return matchScore(query, font->postscriptName, font->family, font->style,
+                    ValueRange(font->weightMin, font->weightMax), ValueRange(font->widthMin, font->widthMax),
+                    font->italic, font->oblique, font->monospace);
+}
+
+int matchScore(FontDescriptor *query, const char *postscriptName, const char *family, const char *style,
+               const ValueRange &weight, const ValueRange &width, bool italic, bool oblique, bool monospace) {
   int score = 0;
   
   // PostScript name match is most important
-  if (query->postscriptName && !caseInsensitiveMatch(font->postscriptName, query->postscriptName)) {
+  if (query->postscriptName && !caseInsensitiveMatch(postscriptName, query->postscriptName)) {
     score += 1000;
   }
   
   // Family name match
-  if (query->family && !caseInsensitiveMatch(font->family, query->family))
+  if (query->family && !caseInsensitiveMatch(family, query->family))
     score += 100;
   
   // Style match
-  if (query->style && !caseInsensitiveMatch(font->style, query->style))
+  if (query->style && !caseInsensitiveMatch(style, query->style))
     score += 50;
   
-  // Weight match (weighted difference)
+  // Weight match (weighted difference). A variable font is as close as the
+  // nearest value on its axis.
   if (query->weight != FontWeightUndefined)
-    score += squareInt((font->weight - query->weight) / 100) * 10;
+    score += squareInt((weight.clamp(query->weight) - query->weight) / 100) * 10;
   
-  // Width match (weighted difference)
+  // Width match (weighted difference), in steps of 12.5%, the distance of
+  // the named widths around normal
   if (query->width != FontWidthUndefined)
-    score += squareInt(font->width - query->width) * 10;
+    score += squareInt((width.clamp(query->width) - query->width) * 2 / 25) * 10;
   
   // Italic/oblique/monospace properties
-  if (query->italic != font->italic)
+  if (query->italic != italic)
     score += 5;
   
-  if (query->oblique != font->oblique)
+  if (query->oblique != oblique)
     score += 5;
   
-  if (query->monospace != font->monospace)
+  if (query->monospace != monospace)
     score += 5;
   
   return score;
 }
 
+bool parseValueRange(const char *str, ValueRange &range) {
+  const char *dots = strstr(str, "..");
+  char *end = NULL;
+
+  if (!dots) {
+    long value = strtol(str, &end, 10);
+    if (end == str || *end)
+      return false;
+    range = ValueRange((int) value, (int) value);
+    return true;
+  }
+
+  range = ValueRange(INT_MIN, INT_MAX);
+  if (dots != str) {
+    range.min = (int) strtol(str, &end, 10);
+    if (end != dots)
+      return false;
+  }
+  if (dots[2]) {
+    range.max = (int) strtol(dots + 2, &end, 10);
+    if (*end)
+      return false;
+  }
+  return range.min <= range.max;
+}
+
+int widthValue(int value) {
+  FontWidth width = widthOfClass(value);
+  return width != FontWidthUndefined ? (int) width : value;
+}
+
+ValueRange widthTolerance(int width) {
+  static const int named[] = {
+    FontWidthUltraCondensed, FontWidthExtraCondensed, FontWidthCondensed,
+    FontWidthSemiCondensed, FontWidthNormal, FontWidthSemiExpanded,
+    FontWidthExpanded, FontWidthExtraExpanded, FontWidthUltraExpanded
+  };
+
+  ValueRange range(width, width);
+  for (size_t i = 0; i < sizeof(named) / sizeof(named[0]); i++) {
+    if (named[i] < width)
+      range.min = named[i];
+    else if (named[i] > width && range.max == width)
+      range.max = named[i];
+  }
+  return range;
+}
+
+// Value of `arg` if it is `--name=value`, else NULL
+static const char *optionValue(const char *arg, const char *name) {
+  size_t length = strlen(name);
+  return strncmp(arg, name, length) == 0 && arg[length] == '=' ? arg + length + 1 : NULL;
+}
+
+// Whether `list` is a comma separated list of OpenType tags
+static bool validTags(const char *list) {
+  for (const char *start = list;; start++) {
+    const char *end = strchr(start, ',');
+    size_t length = end ? (size_t) (end - start) : strlen(start);
+    uint32_t tag;
+    if (!parseLayoutTag(start, length, tag))
+      return false;
+    if (!end)
+      return true;
+    start = end;
+  }
+}
+
+QueryOptions::QueryOptions()
+    : family(NULL), style(NULL), postscriptName(NULL), monospace(false), italic(false),
+      weight(FontWeightUndefined), width(FontWidthUndefined) {}
+
+QueryOptions::~QueryOptions() {
+  delete filter.where;
+}
+
+bool QueryOptions::parse(const char *arg, bool &matched, std::string &error) {
+  matched = true;
+  if (const char *val = optionValue(arg, "--family")) {
+    family = val;
+  } else if (const char *val = optionValue(arg, "--style")) {
+    style = val;
+  } else if (const char *val = optionValue(arg, "--postscript")) {
+    postscriptName = val;
+  } else if (strcmp(arg, "--monospace") == 0) {
+    monospace = true;
+  } else if (strcmp(arg, "--italic") == 0) {
+    italic = true;
+  } else if (const char *val = optionValue(arg, "--weight")) {
+    // A single value allows some variance, a range is exact
+    ValueRange range;
+    if (!parseValueRange(val, range)) {
+      error = std::string("Invalid weight range: ") + val;
+      return false;
+    }
+    if (!strstr(val, ".."))
+      weight = (FontWeight) range.min;
+    else
+      filter.weight = range;
+  } else if (const char *val = optionValue(arg, "--width")) {
+    ValueRange range;
+    if (!parseValueRange(val, range)) {
+      error = std::string("Invalid width range: ") + val;
+      return false;
+    }
+    if (!strstr(val, "..")) {
+      width = (FontWidth) widthValue(range.min);
+    } else {
+      filter.width = range;
+      if (filter.width.min != INT_MIN)
+        filter.width.min = widthValue(filter.width.min);
+      if (filter.width.max != INT_MAX)
+        filter.width.max = widthValue(filter.width.max);
+    }
+  } else if (const char *val = optionValue(arg, "--lang")) {
+    filter.languages.push_back(val);
+  } else if (const char *val = optionValue(arg, "--script")) {
+    if (!validTags(val)) {
+      error = std::string("Invalid script tag: ") + val;
+      return false;
+    }
+    filter.scripts.push_back(val);
+  } else if (const char *val = optionValue(arg, "--feature")) {
+    if (!validTags(val)) {
+      error = std::string("Invalid feature tag: ") + val;
+      return false;
+    }
+    filter.features.push_back(val);
+  } else if (const char *val = optionValue(arg, "--where")) {
+    delete filter.where;
+    filter.where = QueryExpression::compile(val, error);
+    if (!filter.where) {
+      error = "Invalid --where expression: " + error;
+      return false;
+    }
+  } else {
+    matched = false;
+  }
+  return true;
+}
+
+void QueryOptions::finish() {
+  if (!filter.where)
+    return;
+
+  const ValueRange *bounds[2] = { &filter.where->weightBound(), &filter.where->widthBound() };
+  ValueRange *ranges[2] = { &filter.weight, &filter.width };
+  for (int i = 0; i < 2; i++) {
+    if (!bounds[i]->isSet())
+      continue;
+    if (!ranges[i]->isSet()) {
+      *ranges[i] = *bounds[i];
+    } else {
+      ranges[i]->min = std::max(ranges[i]->min, bounds[i]->min);
+      ranges[i]->max = std::min(ranges[i]->max, bounds[i]->max);
+      if (!ranges[i]->isSet())
+        *ranges[i] = ValueRange(INT_MAX, INT_MAX);
+    }
+  }
+}
+
+bool QueryOptions::hasFields() const {
+  return family || style || postscriptName || monospace || italic ||
+         weight != FontWeightUndefined || width != FontWidthUndefined;
+}
+
+FontDescriptor *QueryOptions::descriptor() const {
+  return new FontDescriptor(NULL, postscriptName, family, style, weight, width, italic, false, monospace);
+}
+
+// Whether a font with the given properties passes the filters of a query
+bool matchesQuery(FontDescriptor *query, const char *postscriptName, const char *family, const char *style,
+                  const ValueRange &weight, const ValueRange &width, bool italic, bool oblique, bool monospace) {
+  // Special case for exact postscript matching
+  if (query->postscriptName && postscriptName && strcmp(postscriptName, query->postscriptName) == 0)
+    return true; // Skip other checks for exact matches
+
+  // PostScript name
+  if (query->postscriptName && !caseInsensitiveMatch(postscriptName, query->postscriptName))
+    return false;
+
+  // Family name
+  if (query->family && !caseInsensitiveMatch(family, query->family))
+    return false;
+
+  // Style
+  if (query->style && !caseInsensitiveMatch(style, query->style))
+    return false;
+
+  // Weight - allow 1 weight grade difference
+  if (query->weight != FontWeightUndefined &&
+      !ValueRange(query->weight - 100, query->weight + 100).overlaps(weight.min, weight.max))
+    return false;
+
+  // Width - allow up to the neighbouring named widths
+  if (query->width != FontWidthUndefined && !widthTolerance(query->width).overlaps(width.min, width.max))
+    return false;
+
+  // Italic/oblique/monospace properties
+  return query->italic == italic && query->oblique == oblique && query->monospace == monospace;
+}
+
 // Filter a result set by a query - returns a new ResultSet
 ResultSet *filterResults(ResultSet *fonts, FontDescriptor *query) {
   ResultSet *results = new ResultSet();
   
-  // If no query, return all fonts
-  if (!query) {
-    for (auto font : *fonts) {
-      results->push_back(new FontDescriptor(font));
-    }
-    return results;
-  }
-  
-  // Filter the fonts by each field in the query
   for (auto font : *fonts) {
-    bool matches = true;
-    
-    // Special case for exact postscript matching
-    if (query->postscriptName && font->postscriptName) {
-      if (strcmp(font->postscriptName, query->postscriptName) == 0) {
-        results->push_back(new FontDescriptor(font));
-        continue; // Skip other checks for exact matches
-      }
-    }
-    
-    // PostScript name
-    if (query->postscriptName && !caseInsensitiveMatch(font->postscriptName, query->postscriptName))
-      matches = false;
-    
-    // Family name
-    if (matches && query->family && !caseInsensitiveMatch(font->family, query->family))
-      matches = false;
-    
-    // Style
-    if (matches && query->style && !caseInsensitiveMatch(font->style, query->style))
-      matches = false;
-    
-    // Weight - allow some variance
-    if (matches && query->weight != FontWeightUndefined) {
-      int weightDiff = abs((int)font->weight - (int)query->weight);
-      if (weightDiff > 100) // Allow 1 weight grade difference
-        matches = false;
-    }
-    
-    // Width - allow some variance
-    if (matches && query->width != FontWidthUndefined) {
-      int widthDiff = abs((int)font->width - (int)query->width);
-      if (widthDiff > 1) // Allow 1 width grade difference
-        matches = false;
-    }
-    
-    // Italic/oblique/monospace properties
-    if (matches && query->italic != font->italic)
-      matches = false;
-    
-    if (matches && query->oblique != font->oblique)
-      matches = false;
-    
-    if (matches && query->monospace != font->monospace)
-      matches = false;
-    
-    if (matches) {
+    // If no query, return all fonts
+    if (!query || matchesQuery(query, font->postscriptName, font->family, font->style,
+                               ValueRange(font->weightMin, font->weightMax), ValueRange(font->widthMin, font->widthMax),
+                               font->italic, font->oblique, font->monospace)) {
       results->push_back(new FontDescriptor(font));
     }
   }
@@ -151,48 +314,662 @@ FontDescriptor *findBestMatch(ResultSet *fonts, FontDescriptor *query) {
   return bestMatch ? new FontDescriptor(bestMatch) : NULL;
 }
 
-// Extract unique font family names
-std::vector<std::string> extractFontFamilies(ResultSet *fonts) {
-  std::set<std::string> familySet;
-  
-  for (auto font : *fonts) {
-    if (font->family && strlen(font->family) > 0) {
-      familySet.insert(font->family);
+// Implementation for common platform functions
+
+ResultSet *findFonts(FontDescriptor *query) {
+  ResultSet *results = NULL;
+  std::string nextCursor;
+  findFonts(query, NULL, PageOptions(), &results, nextCursor);
+  return results;
+}
+
+FontDescriptor *findFont(FontDescriptor *query) {
+  return findFont(query, NULL);
+}
+
+std::vector<std::string> getAvailableFontFamilies() {
+  std::vector<std::string> families;
+  std::string nextCursor;
+  getAvailableFontFamilies(PageOptions(), families, nextCursor);
+  return families;
+}
+
+// Cursors are the sort key of the last returned item, so a page can be found
+// by binary search and stays valid when fonts are added or removed. The key
+// fields are joined with NUL and base64url encoded to keep them opaque.
+static const char *CURSOR_ALPHABET = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+static std::string encodeCursor(char kind, const std::vector<const char *> &fields) {
+  std::string raw(1, kind);
+  for (size_t i = 0; i < fields.size(); i++) {
+    raw += '\0';
+    raw += fields[i];
+  }
+
+  std::string out;
+  unsigned int buffer = 0;
+  int bits = 0;
+  for (size_t i = 0; i < raw.size(); i++) {
+    buffer = (buffer << 8) | (unsigned char) raw[i];
+    bits += 8;
+    while (bits >= 6) {
+      bits -= 6;
+      out += CURSOR_ALPHABET[(buffer >> bits) & 0x3F];
     }
   }
-  
-  std::vector<std::string> families(familySet.begin(), familySet.end());
-  std::sort(families.begin(), families.end());
-  return families;
+  if (bits > 0)
+    out += CURSOR_ALPHABET[(buffer << (6 - bits)) & 0x3F];
+  return out;
 }
 
-// Implementation for common platform functions
+static bool decodeCursor(const std::string &cursor, char kind, size_t fieldCount, std::vector<std::string> &fields) {
+  std::string raw;
+  unsigned int buffer = 0;
+  int bits = 0;
+  for (size_t i = 0; i < cursor.size(); i++) {
+    const char *pos = strchr(CURSOR_ALPHABET, cursor[i]);
+    if (!pos || !cursor[i])
+      return false;
 
-ResultSet *findFonts(FontDescriptor *query) {
-  // Get all available fonts and filter them
-  ResultSet *allFonts = getAvailableFonts();
-  ResultSet *result = filterResults(allFonts, query);
-  delete allFonts;
-  return result;
+    buffer = (buffer << 6) | (unsigned int) (pos - CURSOR_ALPHABET);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      raw += (char) ((buffer >> bits) & 0xFF);
+    }
+  }
+
+  if (raw.empty() || raw[0] != kind)
+    return false;
+
+  // Each field is preceded by a NUL separator
+  fields.clear();
+  size_t start = 1;
+  while (start < raw.size() && raw[start] == '\0') {
+    size_t end = raw.find('\0', start + 1);
+    if (end == std::string::npos)
+      end = raw.size();
+    fields.push_back(raw.substr(start + 1, end - start - 1));
+    start = end;
+  }
+
+  return fields.size() == fieldCount;
 }
 
-FontDescriptor *findFont(FontDescriptor *query) {
+static std::string faceCursor(FontCatalog *catalog, size_t id) {
+  const CatalogFace &f = catalog->face(id);
+  std::vector<const char *> fields;
+  fields.push_back(catalog->string(f.family));
+  fields.push_back(catalog->string(f.style));
+  fields.push_back(catalog->string(f.path));
+  fields.push_back(catalog->string(f.postscriptName));
+  return encodeCursor('f', fields);
+}
+
+// Entries of a filter, each a bitset of the alternatives it accepts. A set
+// passes if it has a bit of every entry.
+class BitsetFilter {
+public:
+  BitsetFilter(size_t words) : words(words), entries(0) {}
+
+  void add(const std::vector<uint64_t> &mask) {
+    masks.insert(masks.end(), mask.begin(), mask.end());
+    entries++;
+  }
+
+  bool isSet() const { return entries > 0; }
+
+  bool matches(const uint64_t *set) const {
+    if (entries == 0)
+      return true;
+    if (words == 0)
+      return false;
+
+    for (size_t m = 0; m < masks.size(); m += words) {
+      uint64_t common = 0;
+      for (size_t w = 0; w < words; w++)
+        common |= set[w] & masks[m + w];
+      if (!common)
+        return false;
+    }
+    return true;
+  }
+
+private:
+  size_t words;
+  size_t entries;
+  std::vector<uint64_t> masks;  // `words` words per entry
+};
+
+// The --lang, --script and --feature entries of a filter as bitsets over the
+// catalog's languages and layout tags, resolved once per query
+class TagFilter {
+public:
+  TagFilter(const FontCatalog *catalog, const QueryFilter *filter)
+      : languages(catalog->languageWords()), scripts(catalog->scriptWords()), features(catalog->featureWords()) {
+    if (!filter)
+      return;
+    for (size_t i = 0; i < filter->languages.size(); i++)
+      languages.add(catalog->languageMask(filter->languages[i].c_str()));
+    for (size_t i = 0; i < filter->scripts.size(); i++)
+      scripts.add(catalog->scriptMask(filter->scripts[i].c_str()));
+    for (size_t i = 0; i < filter->features.size(); i++)
+      features.add(catalog->featureMask(filter->features[i].c_str()));
+  }
+
+  bool isSet() const { return languages.isSet() || scripts.isSet() || features.isSet(); }
+
+  bool matches(const FontCatalog *catalog, size_t id) const {
+    return languages.matches(catalog->languageSet(id)) && scripts.matches(catalog->scriptSet(id)) &&
+           features.matches(catalog->featureSet(id));
+  }
+
+private:
+  BitsetFilter languages;
+  BitsetFilter scripts;
+  BitsetFilter features;
+};
+
+// Bits of the query fields which are set. Each combination gets its own
+// match loop, see MatchDispatch.
+enum QueryFields {
+  QueryPostscriptName = 1 << 0,
+  QueryFamily         = 1 << 1,
+  QueryStyle          = 1 << 2,
+  QueryWeight         = 1 << 3,
+  QueryWidth          = 1 << 4,
+  QueryFilterTests    = 1 << 5,  // --lang, --script, --feature or --where
+  QueryFieldCombinations = 1 << 6
+};
+
+// A query and filter reduced to what the match loops test. Unset filter
+// ranges span all values and a missing query compares no flags, so both are
+// tested without branching on them.
+struct PreparedQuery {
+  unsigned fields;
+  const char *exactPostscriptName;
+  std::string postscriptName;  // Lowercase
+  std::string family;
+  std::string style;
+  ValueRange weight;           // Variance allowed by matchesQuery()
+  ValueRange width;
+  ValueRange weightFilter;
+  ValueRange widthFilter;
+  uint32_t flagMask;
+  uint32_t flags;
+  const TagFilter *tags;
+  const QueryExpression *where;
+
+  // `knownFamily` is set when all faces to test were found by the query's
+  // family name, which may be another name of the face than its primary
+  // family, so the family is not compared again
+  PreparedQuery(FontDescriptor *query, const QueryFilter *filter, const TagFilter *tags, bool knownFamily)
+      : fields(0), exactPostscriptName(NULL), weightFilter(INT_MIN, INT_MAX), widthFilter(INT_MIN, INT_MAX), flagMask(0), flags(0),
+        tags(tags), where(filter ? filter->where : NULL) {
+    if (filter) {
+      if (filter->weight.isSet())
+        weightFilter = filter->weight;
+      if (filter->width.isSet())
+        widthFilter = filter->width;
+    }
+    if (tags->isSet() || where)
+      fields |= QueryFilterTests;
+
+    if (!query)
+      return;
+
+    if (query->postscriptName) {
+      fields |= QueryPostscriptName;
+      exactPostscriptName = query->postscriptName;
+      postscriptName = lowercase(query->postscriptName);
+    }
+    if (query->family && !knownFamily) {
+      fields |= QueryFamily;
+      family = lowercase(query->family);
+    }
+    if (query->style) {
+      fields |= QueryStyle;
+      style = lowercase(query->style);
+    }
+    if (query->weight != FontWeightUndefined) {
+      fields |= QueryWeight;
+      weight = ValueRange(query->weight - 100, query->weight + 100);
+    }
+    if (query->width != FontWidthUndefined) {
+      fields |= QueryWidth;
+      width = widthTolerance(query->width);
+    }
+
+    flagMask = CatalogFaceItalic | CatalogFaceOblique | CatalogFaceMonospace;
+    flags = (query->italic ? CatalogFaceItalic : 0) | (query->oblique ? CatalogFaceOblique : 0) |
+            (query->monospace ? CatalogFaceMonospace : 0);
+  }
+
+  static std::string lowercase(const char *str) {
+    std::string result(str);
+    for (size_t i = 0; i < result.size(); i++)
+      result[i] = asciiLower(result[i]);
+    return result;
+  }
+
+  static char asciiLower(char c) {
+    return c >= 'A' && c <= 'Z' ? (char) (c + ('a' - 'A')) : c;
+  }
+};
+
+// caseInsensitiveMatch() against a string which is already lowercase
+static inline bool lowercaseMatch(const char *str, const std::string &lower) {
+  const char *l = lower.c_str();
+  while (*str && PreparedQuery::asciiLower(*str) == *l) {
+    str++;
+    l++;
+  }
+  return *str == *l;
+}
+
+// Compares a string field of faces with a query string. Faces are in family
+// and style order, so neighbouring faces mostly share the interned string,
+// and the result for the previous one is reused.
+class StringTest {
+public:
+  StringTest(const std::string &lower) : lower(lower), last(0xFFFFFFFF), lastResult(false) {}
+
+  bool operator()(const FontCatalog *catalog, uint32_t offset) {
+    if (offset != last) {
+      last = offset;
+      lastResult = lowercaseMatch(catalog->string(offset), lower);
+    }
+    return lastResult;
+  }
+
+private:
+  const std::string &lower;
+  uint32_t last;
+  bool lastResult;
+};
+
+// Tests faces against a query with the fields in `Fields` set. The tests of
+// other fields are removed at compile time, so no field is checked for being
+// set per face. Same result as the filter checks followed by matchesQuery().
+template <unsigned Fields>
+class FaceMatcher {
+public:
+  FaceMatcher(const FontCatalog *catalog, const PreparedQuery &query)
+      : catalog(catalog), query(query), family(query.family), style(query.style) {}
+
+  bool operator()(const CatalogFace &f, size_t id) {
+    if (!query.weightFilter.overlaps(f.weightMin, f.weightMax) || !query.widthFilter.overlaps(f.widthMin, f.widthMax))
+      return false;
+    if ((Fields & QueryFilterTests) &&
+        (!query.tags->matches(catalog, id) || (query.where && !query.where->matches(*catalog, f))))
+      return false;
+
+    if (Fields & QueryPostscriptName) {
+      // Exact matches skip the other checks
+      const char *name = catalog->string(f.postscriptName);
+      if (!lowercaseMatch(name, query.postscriptName))
+        return false;
+      if (strcmp(name, query.exactPostscriptName) == 0)
+        return true;
+    }
+    if ((Fields & QueryFamily) && !family(catalog, f.family))
+      return false;
+    if ((Fields & QueryStyle) && !style(catalog, f.style))
+      return false;
+    if ((Fields & QueryWeight) && !query.weight.overlaps(f.weightMin, f.weightMax))
+      return false;
+    if ((Fields & QueryWidth) && !query.width.overlaps(f.widthMin, f.widthMax))
+      return false;
+    return (f.flags & query.flagMask) == query.flags;
+  }
+
+private:
+  const FontCatalog *catalog;
+  const PreparedQuery &query;
+  StringTest family;
+  StringTest style;
+};
+
+// Candidate faces of a query: `ids[begin..end)` in catalog order, or all ids
+// in [begin, end) when `ids` is NULL
+struct FaceRange {
+  const uint32_t *ids;
+  size_t begin;
+  size_t end;
+};
+
+template <unsigned Fields, typename Visitor>
+static void matchFaces(const FontCatalog *catalog, const PreparedQuery &query, const FaceRange &range, Visitor &visit) {
+  FaceMatcher<Fields> matches(catalog, query);
+  const CatalogFace *faces = catalog->faceRecords();
+
+  if (range.ids) {
+    for (size_t i = range.begin; i < range.end; i++) {
+      uint32_t id = range.ids[i];
+      if (matches(faces[id], id) && !visit(id))
+        return;
+    }
+    return;
+  }
+
+  for (size_t id = range.begin; id < range.end; id++) {
+    if (matches(faces[id], id) && !visit((uint32_t) id))
+      return;
+  }
+}
+
+// Selects the instantiation of matchFaces() for the fields of a query, once
+// per query
+template <unsigned Fields>
+struct MatchDispatch {
+  template <typename Visitor>
+  static void run(const FontCatalog *catalog, const PreparedQuery &query, const FaceRange &range, Visitor &visit) {
+    if (query.fields == Fields)
+      matchFaces<Fields>(catalog, query, range, visit);
+    else
+      MatchDispatch<Fields - 1>::run(catalog, query, range, visit);
+  }
+};
+
+template <>
+struct MatchDispatch<0> {
+  template <typename Visitor>
+  static void run(const FontCatalog *catalog, const PreparedQuery &query, const FaceRange &range, Visitor &visit) {
+    matchFaces<0>(catalog, query, range, visit);
+  }
+};
+
+// Narrows the faces to consider using the sorted weight and width indexes.
+// A single --weight or --width value in the query allows the same variance
+// as matchesQuery(). Returns false when no index applies or the range holds
+// so much of the catalog that testing every face is cheaper than collecting
+// and sorting the slice. Otherwise `ids` holds a superset of the matches in
+// catalog order.
+static bool rangeCandidates(FontCatalog *catalog, FontDescriptor *query, const QueryFilter *filter,
+                            std::vector<uint32_t> &ids) {
+  ValueRange weight = filter ? filter->weight : ValueRange();
+  ValueRange width = filter ? filter->width : ValueRange();
+
+  if (query && query->weight != FontWeightUndefined && !query->postscriptName) {
+    ValueRange tolerance(query->weight - 100, query->weight + 100);
+    weight = weight.isSet() ? ValueRange(std::max(weight.min, tolerance.min), std::min(weight.max, tolerance.max)) : tolerance;
+  }
+  if (query && query->width != FontWidthUndefined && !query->postscriptName) {
+    ValueRange tolerance = widthTolerance(query->width);
+    width = width.isSet() ? ValueRange(std::max(width.min, tolerance.min), std::min(width.max, tolerance.max)) : tolerance;
+  }
+
+  if (!weight.isSet() && !width.isSet())
+    return false;
+
+  // Both ranges are checked by the match loop, so one index is enough. The sizes of
+  // both slices are cheap to compare but the weight usually narrows most.
+  if (weight.isSet())
+    catalog->facesByWeight(weight.min, weight.max, ids);
+  else
+    catalog->facesByWidth(width.min, width.max, ids);
+
+  if (ids.size() > catalog->size() / 4)
+    return false;
+
+  std::sort(ids.begin(), ids.end());
+  return true;
+}
+
+// Calls `visit` with each face from catalog position `start` on which passes
+// the query and filter, in catalog order, until it returns false
+template <typename Visitor>
+static void forEachMatch(FontCatalog *catalog, FontDescriptor *query, const QueryFilter *filter,
+                         size_t start, Visitor visit) {
+  std::vector<uint32_t> ids;
+
+  // A family name narrows the search the most. It is looked up among all
+  // family names of the faces, so localized names match too. An exact
+  // PostScript name match would pass regardless of the family.
+  bool named = query && query->family && !query->postscriptName;
+  if (named)
+    catalog->facesNamed(query->family, FontNameFamily, ids);
+
+  bool candidates = named || rangeCandidates(catalog, query, filter, ids);
+
+  // Layout tags are read from the font files on first use, only for the
+  // faces which can match
+  if (filter && (!filter->scripts.empty() || !filter->features.empty())) {
+    catalog->loadLayout(candidates ? ids : catalog->faceIds(start));
+  }
+
+  TagFilter tags(catalog, filter);
+  PreparedQuery prepared(query, filter, &tags, named);
+  FaceRange range = { NULL, start, catalog->size() };
+  if (candidates) {
+    range.ids = ids.data();
+    range.begin = std::lower_bound(ids.begin(), ids.end(), (uint32_t) start) - ids.begin();
+    range.end = ids.size();
+  }
+
+  MatchDispatch<QueryFieldCombinations - 1>::run(catalog, prepared, range, visit);
+}
+
+bool findFonts(FontDescriptor *query, const QueryFilter *filter, const PageOptions &page,
+               ResultSet **results, std::string &nextCursor) {
+  FontCatalog *catalog = FontCatalog::shared();
+  size_t start = 0;
+  nextCursor.clear();
+
+  if (!page.cursor.empty()) {
+    std::vector<std::string> key;
+    if (!decodeCursor(page.cursor, 'f', 4, key))
+      return false;
+    start = catalog->faceAfter(key[0].c_str(), key[1].c_str(), key[2].c_str(), key[3].c_str());
+  }
+
+  ResultSet *found = new ResultSet();
+  *results = found;
+
+  // Without any filter the offset is a plain index into the catalog order
+  size_t skip = page.offset;
+  if (!query && !filter) {
+    start = std::min(start + skip, catalog->size());
+    skip = 0;
+  }
+
+  size_t last = 0;
+  forEachMatch(catalog, query, filter, start, [&](uint32_t id) {
+    if (skip > 0) {
+      skip--;
+      return true;
+    }
+
+    if (page.limit && found->size() == page.limit) {
+      // There is at least one more match, so hand out a cursor
+      nextCursor = faceCursor(catalog, last);
+      return false;
+    }
+
+    found->push_back(catalog->descriptor(id));
+    last = id;
+    return true;
+  });
+
+  return true;
+}
+
+FontDescriptor *findFont(FontDescriptor *query, const QueryFilter *filter) {
   if (!query)
     return NULL;
-    
-  // Get all available fonts
-  ResultSet *allFonts = getAvailableFonts();
-  
-  // Find the best match
-  FontDescriptor *result = findBestMatch(allFonts, query);
-  
-  delete allFonts;
-  return result;
+
+  // Every face is scored against the query, only the filter excludes faces
+  FontCatalog *catalog = FontCatalog::shared();
+  int bestScore = INT_MAX;
+  int best = -1;
+
+  // Faces known by the queried family under any of their names
+  std::vector<uint32_t> named;
+  catalog->facesNamed(query->family, FontNameFamily, named);
+
+  forEachMatch(catalog, NULL, filter, 0, [&](uint32_t id) {
+    const CatalogFace &f = catalog->face(id);
+    const char *family = std::binary_search(named.begin(), named.end(), id) ? query->family : catalog->string(f.family);
+    int score = matchScore(query, catalog->string(f.postscriptName), family, catalog->string(f.style),
+                           ValueRange(f.weightMin, f.weightMax), ValueRange(f.widthMin, f.widthMax),
+                           (f.flags & CatalogFaceItalic) != 0, (f.flags & CatalogFaceOblique) != 0,
+                           (f.flags & CatalogFaceMonospace) != 0);
+    if (score < bestScore) {
+      bestScore = score;
+      best = (int) id;
+    }
+    return bestScore > 0;
+  });
+
+  return best >= 0 ? catalog->descriptor(best) : NULL;
 }
 
-std::vector<std::string> getAvailableFontFamilies() {
-  ResultSet *allFonts = getAvailableFonts();
-  std::vector<std::string> families = extractFontFamilies(allFonts);
-  delete allFonts;
-  return families;
-} 
\ No newline at end of file
+bool getAvailableFontFamilies(const PageOptions &page, std::vector<std::string> &families, std::string &nextCursor) {
+  FontCatalog *catalog = FontCatalog::shared();
+  size_t start = 0;
+  nextCursor.clear();
+
+  if (!page.cursor.empty()) {
+    std::vector<std::string> key;
+    if (!decodeCursor(page.cursor, 'F', 1, key))
+      return false;
+    start = catalog->familyAfter(key[0].c_str());
+  }
+
+  size_t first = start + page.offset;
+  size_t end = catalog->familyCount();
+  if (page.limit && first < end && end - first > page.limit) {
+    end = first + page.limit;
+    std::vector<const char *> fields(1, catalog->familyName(end - 1));
+    nextCursor = encodeCursor('F', fields);
+  }
+
+  for (size_t i = first; i < end; i++)
+    families.push_back(catalog->familyName(i));
+
+  return true;
+} 
+
+static const char *FONT_FIELD_NAMES[] = {
+  "family", "style", "postscriptName", "path", "weight", "width", "italic", "oblique", "monospace"
+};
+
+bool parseFontField(const char *name, FontField &field) {
+  for (int i = 0; i < (int) (sizeof(FONT_FIELD_NAMES) / sizeof(FONT_FIELD_NAMES[0])); i++) {
+    if (caseInsensitiveMatch(name, FONT_FIELD_NAMES[i])) {
+      field = (FontField) i;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *fontFieldName(FontField field) {
+  return FONT_FIELD_NAMES[field];
+}
+
+bool isStringField(FontField field) {
+  return field <= FontFieldPath;
+}
+
+// Value of a field of a face. String fields give their offset in the string
+// pool, which identifies the string because all strings are interned.
+int64_t fontFieldValue(const CatalogFace &face, FontField field) {
+  switch (field) {
+    case FontFieldFamily:
+      return face.family;
+    case FontFieldStyle:
+      return face.style;
+    case FontFieldPostscriptName:
+      return face.postscriptName;
+    case FontFieldPath:
+      return face.path;
+    case FontFieldWeight:
+      return face.weight;
+    case FontFieldWidth:
+      return face.width;
+    case FontFieldItalic:
+      return (face.flags & CatalogFaceItalic) != 0;
+    case FontFieldOblique:
+      return (face.flags & CatalogFaceOblique) != 0;
+    case FontFieldMonospace:
+      return (face.flags & CatalogFaceMonospace) != 0;
+  }
+  return 0;
+}
+
+// Orders face ids by a field, then by catalog order
+struct FaceFieldOrder {
+  const FontCatalog *catalog;
+  FontField field;
+  bool descending;
+
+  int compareValues(uint32_t a, uint32_t b) const {
+    int64_t va = fontFieldValue(catalog->face(a), field);
+    int64_t vb = fontFieldValue(catalog->face(b), field);
+    if (va == vb)
+      return 0;
+    if (isStringField(field))
+      return strcmp(catalog->string((uint32_t) va), catalog->string((uint32_t) vb));
+    return va < vb ? -1 : 1;
+  }
+
+  bool operator()(uint32_t a, uint32_t b) const {
+    int cmp = compareValues(a, b);
+    if (cmp != 0)
+      return descending ? cmp > 0 : cmp < 0;
+    return a < b;
+  }
+};
+
+std::vector<uint32_t> findFaceIds(FontDescriptor *query, const QueryFilter *filter) {
+  FontCatalog *catalog = FontCatalog::shared();
+  std::vector<uint32_t> ids;
+  forEachMatch(catalog, query, filter, 0, [&](uint32_t id) {
+    ids.push_back(id);
+    return true;
+  });
+  return ids;
+}
+
+void sortFaces(std::vector<uint32_t> &faces, FontField field, bool descending) {
+  FaceFieldOrder order = { FontCatalog::shared(), field, descending };
+  parallelSort(faces.begin(), faces.end(), order);
+}
+
+std::vector<FontGroup> groupFaces(const std::vector<uint32_t> &faces, FontField field, bool descending) {
+  FontCatalog *catalog = FontCatalog::shared();
+  std::vector<FontGroup> groups;
+
+  // One pass over the faces, hashing the interned value of each
+  std::unordered_map<int64_t, size_t> groupIds;
+  for (size_t i = 0; i < faces.size(); i++) {
+    int64_t value = fontFieldValue(catalog->face(faces[i]), field);
+    std::unordered_map<int64_t, size_t>::iterator it = groupIds.find(value);
+    if (it == groupIds.end()) {
+      it = groupIds.insert(std::make_pair(value, groups.size())).first;
+      groups.push_back(FontGroup());
+      groups.back().face = faces[i];
+    }
+    groups[it->second].faces.push_back(faces[i]);
+  }
+
+  // Only the groups need sorting, faces keep their order within each group
+  std::vector<uint32_t> order(groups.size());
+  for (size_t i = 0; i < groups.size(); i++)
+    order[i] = (uint32_t) i;
+
+  struct GroupOrder {
+    const std::vector<FontGroup> *groups;
+    FaceFieldOrder faceOrder;
+    bool operator()(uint32_t a, uint32_t b) const {
+      return faceOrder((*groups)[a].face, (*groups)[b].face);
+    }
+  } groupOrder = { &groups, { catalog, field, descending } };
+  parallelSort(order.begin(), order.end(), groupOrder);
+
+  std::vector<FontGroup> sorted(groups.size());
+  for (size_t i = 0; i < order.size(); i++)
+    sorted[i].swap(groups[order[i]]);
+  return sorted;
+}
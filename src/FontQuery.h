@@ -6,19 +6,169 @@
 #include <string>
 #include <vector>
 #include <algorithm>
+#include <stdint.h>
+
+// Paging options for list, find and families. Results are in catalog order
+// (family, style, path). A cursor continues after the last item of the page
+// which returned it, without visiting earlier pages.
+struct PageOptions {
+  size_t offset;
+  size_t limit;        // 0 for no limit
+  std::string cursor;  // empty to start at the beginning
+
+  PageOptions() : offset(0), limit(0) {}
+};
+
+// Inclusive range of a numeric field, empty when unset
+struct ValueRange {
+  int min;
+  int max;
+
+  ValueRange() : min(1), max(0) {}
+  ValueRange(int min, int max) : min(min), max(max) {}
+
+  bool isSet() const { return min <= max; }
+  bool contains(int value) const { return value >= min && value <= max; }
+  bool overlaps(int low, int high) const { return low <= max && high >= min; }
+
+  // The value in the range closest to `value`
+  int clamp(int value) const { return value < min ? min : value > max ? max : value; }
+};
+
+// Parse "300..600", "300..", "..600" or a single value "400". Returns false
+// if `str` is not a valid range, including one whose minimum exceeds its
+// maximum.
+bool parseValueRange(const char *str, ValueRange &range);
+
+// A --width value or bound: a percentage of the normal width, or a width
+// class from 1 to 9 as before widths were kept as percentages
+int widthValue(int value);
+
+// Widths a single --width value matches, up to the neighbouring named widths
+// on either side, like a single --weight matches 100 either way
+ValueRange widthTolerance(int width);
+
+// Filters of find and find-best beyond the fields of a FontDescriptor. Fonts
+// must pass both the query and the filter.
+class QueryExpression;
+
+struct QueryFilter {
+  ValueRange weight;
+  ValueRange width;
+  const QueryExpression *where;  // --where expression, or NULL
+
+  // --lang values. A font must support a language of every entry, where
+  // each entry is a comma separated list of alternatives.
+  std::vector<std::string> languages;
+
+  // --script and --feature values, OpenType tags combined like --lang
+  std::vector<std::string> scripts;
+  std::vector<std::string> features;
+
+  QueryFilter() : where(NULL) {}
+
+  // Whether a filter which only some faces pass is set other than the
+  // weight and width ranges
+  bool hasTagFilters() const { return !languages.empty() || !scripts.empty() || !features.empty(); }
+};
+
+// The query options of find and find-best: --family, --style, --postscript,
+// --monospace, --italic, --weight, --width, --lang, --script, --feature and
+// --where
+struct QueryOptions {
+  const char *family;          // Point into the parsed arguments
+  const char *style;
+  const char *postscriptName;
+  bool monospace;
+  bool italic;
+  FontWeight weight;           // Single values, ranges go to the filter
+  FontWidth width;
+  QueryFilter filter;
+
+  QueryOptions();
+  ~QueryOptions();
+
+  // Parse `arg` if it is a query option, setting `matched`. Returns false
+  // and sets `error` if it is one but its value is invalid.
+  bool parse(const char *arg, bool &matched, std::string &error);
+
+  // Narrow the filter's ranges by the bounds of --where, which lets the
+  // weight and width indexes narrow the search. Call after parsing.
+  void finish();
+
+  // Whether any option other than --lang, --script, --feature and --where
+  // was given
+  bool hasFields() const;
+
+  // New descriptor of the query, owned by the caller
+  FontDescriptor *descriptor() const;
+
+private:
+  QueryOptions(const QueryOptions &);
+  QueryOptions &operator=(const QueryOptions &);
+};
+
+// Fields which results can be grouped and sorted by
+enum FontField {
+  FontFieldFamily,
+  FontFieldStyle,
+  FontFieldPostscriptName,
+  FontFieldPath,
+  FontFieldWeight,
+  FontFieldWidth,
+  FontFieldItalic,
+  FontFieldOblique,
+  FontFieldMonospace
+};
+
+// Faces of the catalog which share the value of a field
+struct FontGroup {
+  uint32_t face;               // Any face of the group, to read the value from
+  std::vector<uint32_t> faces; // Ids of all faces in the group
+
+  void swap(FontGroup &other) {
+    std::swap(face, other.face);
+    faces.swap(other.faces);
+  }
+};
 
 // Forward declarations
 ResultSet *findFonts(FontDescriptor *query);
 FontDescriptor *findFont(FontDescriptor *query);
 FontDescriptor *substituteFont(const char *postscriptName, const char* text);
+bool fontHasCodepoint(FontDescriptor *font, unsigned int codepoint);
 std::vector<std::string> getAvailableFontFamilies();
 
+// Paged variants. A NULL query matches every font. `nextCursor` is set to the
+// cursor of the following page, or left empty on the last page. Return false
+// if the cursor in `page` is not valid.
+bool findFonts(FontDescriptor *query, const QueryFilter *filter, const PageOptions &page,
+               ResultSet **results, std::string &nextCursor);
+FontDescriptor *findFont(FontDescriptor *query, const QueryFilter *filter);
+bool getAvailableFontFamilies(const PageOptions &page, std::vector<std::string> &families, std::string &nextCursor);
+
+// Grouping and sorting of catalog faces. Ties are broken by catalog order.
+bool parseFontField(const char *name, FontField &field);
+const char *fontFieldName(FontField field);
+std::vector<uint32_t> findFaceIds(FontDescriptor *query, const QueryFilter *filter);
+void sortFaces(std::vector<uint32_t> &faces, FontField field, bool descending);
+std::vector<FontGroup> groupFaces(const std::vector<uint32_t> &faces, FontField field, bool descending);
+
 // Helper functions
 int squareInt(int val);
+bool caseInsensitiveMatch(const char *a, const char *b);
 
 // Returns a score indicating how well a font matches a query
 // Lower score = better match
 int matchScore(FontDescriptor *font, FontDescriptor *query);
+int matchScore(FontDescriptor *query, const char *postscriptName, const char *family, const char *style,
+               const ValueRange &weight, const ValueRange &width, bool italic, bool oblique, bool monospace);
+
+// Whether a font with the given properties passes the filters of a query.
+// `weight` and `width` are the ranges of the axes, a single value for fonts
+// which are not variable.
+bool matchesQuery(FontDescriptor *query, const char *postscriptName, const char *family, const char *style,
+                  const ValueRange &weight, const ValueRange &width, bool italic, bool oblique, bool monospace);
 
 // Filter a result set by a query
 ResultSet *filterResults(ResultSet *fonts, FontDescriptor *query);
@@ -0,0 +1,92 @@
+#include "FontSimilarity.h"
+#include <algorithm>
+#include <math.h>
+
+// Relative importance of the features
+static const float WEIGHT_SCALE = 2.0f;
+static const float WIDTH_SCALE = 1.5f;
+static const float SLOPE_SCALE = 1.5f;
+static const float MONOSPACE_SCALE = 2.0f;
+static const float PANOSE_SCALE = 0.5f;
+static const float PROPORTION_SCALE = 2.0f;
+
+// Typical italic angle, used when a font has no 'post' table
+static const float DEFAULT_SLANT = 12.0f;
+
+void faceFeatures(const FontCatalog &catalog, size_t id, float *features) {
+  const CatalogFace &face = catalog.face(id);
+  const FontMetrics &metrics = catalog.metrics(id);
+  std::fill(features, features + FEATURE_DIMENSIONS, 0.0f);
+
+  features[0] = WEIGHT_SCALE * face.weight / 1000.0f;
+  features[1] = WIDTH_SCALE * face.width / (float) FontWidthUltraExpanded;
+
+  float slant = 0;
+  if (metrics.flags & FontMetricsItalicAngle)
+    slant = fabsf(metrics.italicAngle / 65536.0f);
+  else if (face.flags & (CatalogFaceItalic | CatalogFaceOblique))
+    slant = DEFAULT_SLANT;
+  features[2] = SLOPE_SCALE * std::min(slant, 20.0f) / 20.0f;
+
+  features[3] = (face.flags & CatalogFaceMonospace) ? MONOSPACE_SCALE : 0.0f;
+
+  // PANOSE digits 0 and 1 mean "any" and "no fit", which say nothing
+  if (metrics.flags & FontMetricsOS2) {
+    for (int i = 0; i < 10; i++) {
+      if (metrics.panose[i] >= 2)
+        features[4 + i] = PANOSE_SCALE * metrics.panose[i] / 15.0f;
+    }
+  }
+
+  if (metrics.unitsPerEm > 0) {
+    float em = (float) metrics.unitsPerEm;
+    if (metrics.flags & FontMetricsXHeight)
+      features[14] = PROPORTION_SCALE * metrics.xHeight / em;
+    if (metrics.flags & FontMetricsCapHeight)
+      features[15] = PROPORTION_SCALE * metrics.capHeight / em;
+    if (metrics.flags & FontMetricsOS2)
+      features[16] = PROPORTION_SCALE * metrics.averageWidth / em;
+  }
+}
+
+// Squared distances from `point` to each row of `matrix`. The fixed row
+// length lets the compiler vectorize the loop over the dimensions of a row,
+// the rows themselves are visited one at a time.
+static void squaredDistances(const float *matrix, size_t rows, const float *point, float *distances) {
+  for (size_t row = 0; row < rows; row++) {
+    const float *v = matrix + row * FEATURE_DIMENSIONS;
+    float sum = 0;
+    for (size_t d = 0; d < FEATURE_DIMENSIONS; d++) {
+      float diff = v[d] - point[d];
+      sum += diff * diff;
+    }
+    distances[row] = sum;
+  }
+}
+
+std::vector<SimilarFace> findSimilarFaces(FontCatalog &catalog, size_t id, size_t k) {
+  size_t count = catalog.size();
+  std::vector<uint32_t> all = catalog.faceIds();
+  catalog.loadMetrics(all);
+
+  std::vector<float> matrix(count * FEATURE_DIMENSIONS);
+  for (size_t i = 0; i < count; i++)
+    faceFeatures(catalog, i, &matrix[i * FEATURE_DIMENSIONS]);
+
+  std::vector<float> distances(count);
+  squaredDistances(matrix.data(), count, &matrix[id * FEATURE_DIMENSIONS], distances.data());
+
+  // Partial sort of the candidates, ties in catalog order
+  all.erase(all.begin() + id);
+  k = std::min(k, all.size());
+  std::partial_sort(all.begin(), all.begin() + k, all.end(), [&](uint32_t a, uint32_t b) {
+    return distances[a] != distances[b] ? distances[a] < distances[b] : a < b;
+  });
+
+  std::vector<SimilarFace> result(k);
+  for (size_t i = 0; i < k; i++) {
+    result[i].face = all[i];
+    result[i].distance = sqrtf(distances[all[i]]);
+  }
+  return result;
+}
@@ -0,0 +1,28 @@
+#ifndef FONT_SIMILARITY_H
+#define FONT_SIMILARITY_H
+
+#include "FontCatalog.h"
+#include <stdint.h>
+#include <vector>
+
+// Faces are compared as points in a feature space built from their weight,
+// width, slope, spacing, PANOSE classification and proportions, with every
+// feature scaled to about [0, 1] times its importance. Similar faces are
+// those at the smallest Euclidean distance.
+static const size_t FEATURE_DIMENSIONS = 20;  // 17 used, padded for SIMD
+
+// Feature vector of a face. The metrics of the face must be loaded.
+void faceFeatures(const FontCatalog &catalog, size_t id, float *features);
+
+struct SimilarFace {
+  uint32_t face;
+  float distance;
+};
+
+// The `k` faces nearest to face `id`, nearest first, excluding `id` itself.
+// Reads the metrics of all faces first. The search is a brute-force scan of
+// a contiguous feature matrix, with the distance of each row computed in
+// vector registers, followed by a partial sort.
+std::vector<SimilarFace> findSimilarFaces(FontCatalog &catalog, size_t id, size_t k);
+
+#endif // FONT_SIMILARITY_H
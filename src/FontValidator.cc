@@ -0,0 +1,125 @@
+#include "FontValidator.h"
+#include "MappedFile.h"
+#include "Sfnt.h"
+#include <string.h>
+
+static const uint32_t TAG_HEAD = SFNT_TAG('h', 'e', 'a', 'd');
+
+// Tables every font needs to be usable at all
+static const uint32_t REQUIRED_TABLES[] = {
+  SFNT_TAG('h', 'e', 'a', 'd'),
+  SFNT_TAG('m', 'a', 'x', 'p'),
+  SFNT_TAG('c', 'm', 'a', 'p')
+};
+
+// Name of a non-sfnt font format which `data` starts with, or NULL
+static const char *otherFormat(const uint8_t *data, size_t size) {
+  static const struct {
+    const char *magic;
+    size_t length;
+    const char *format;
+  } formats[] = {
+    { "wOFF", 4, "WOFF" },
+    { "wOF2", 4, "WOFF2" },
+    { "\x01" "fcp", 4, "PCF" },
+    { "\x1f\x8b", 2, "gzip" },  // Compressed PCF and BDF
+    { "STARTFONT", 9, "BDF" },
+    { "%!PS-AdobeFont", 14, "Type 1" },
+    { "%!FontType1", 11, "Type 1" },
+    { "\x80\x01", 2, "Type 1" }  // Segment header of .pfb files
+  };
+
+  for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    if (size >= formats[i].length && memcmp(data, formats[i].magic, formats[i].length) == 0)
+      return formats[i].format;
+  }
+  return NULL;
+}
+
+static void validateFont(const uint8_t *data, size_t size, uint32_t offset, bool collection, FontValidation &result) {
+  SfntFont font;
+  std::string error;
+  if (!font.parse(data, size, offset, error)) {
+    result.errors.push_back(error);
+    return;
+  }
+
+  for (size_t i = 0; i < font.tables.size(); i++) {
+    const SfntTable &table = font.tables[i];
+    std::string name = "table '" + sfntTagName(table.tag) + "'";
+
+    if ((uint64_t) table.offset + table.length > size) {
+      result.errors.push_back(name + " extends past the end of the file");
+      continue;
+    }
+
+    if (table.offset % 4 != 0)
+      result.warnings.push_back(name + " is not 4-byte aligned");
+
+    // The checksum of 'head' is computed with checkSumAdjustment as zero
+    uint32_t checksum = sfntChecksum(data, size, table.offset, table.length);
+    if (table.tag == TAG_HEAD && table.length >= 12)
+      checksum -= readU32(data + table.offset + 8);
+
+    if (checksum != table.checksum)
+      result.warnings.push_back(name + " has an invalid checksum");
+  }
+
+  for (size_t i = 0; i < sizeof(REQUIRED_TABLES) / sizeof(REQUIRED_TABLES[0]); i++) {
+    if (!font.findTable(REQUIRED_TABLES[i]))
+      result.errors.push_back("required table '" + sfntTagName(REQUIRED_TABLES[i]) + "' is missing");
+  }
+
+  uint32_t headLength = 0;
+  const uint8_t *head = font.tableData(data, size, TAG_HEAD, &headLength);
+  if (head) {
+    if (headLength < 54) {
+      result.errors.push_back("table 'head' is truncated");
+    } else if (readU32(head + 12) != 0x5F0F3CF5) {
+      result.errors.push_back("table 'head' has an invalid magic number");
+    } else if (!collection) {
+      // The whole file sums to 0xB1B0AFBA when checkSumAdjustment is included
+      uint32_t adjustment = readU32(head + 8);
+      uint32_t sum = sfntChecksum(data, size, 0, (uint32_t) size) - adjustment;
+      if ((uint32_t) (0xB1B0AFBA - sum) != adjustment)
+        result.warnings.push_back("file checksum adjustment is invalid");
+    }
+  }
+}
+
+std::vector<FontValidation> validateFontFile(const char *path) {
+  std::vector<FontValidation> results;
+  FontValidation first;
+
+  // Checksums read every byte once, front to back
+  MappedFile file;
+  if (!file.open(path, MappedFile::AccessSequential)) {
+    first.errors.push_back("file can not be opened");
+    results.push_back(first);
+    return results;
+  }
+
+  first.format = otherFormat(file.data(), file.size());
+  if (first.format) {
+    results.push_back(first);
+    return results;
+  }
+
+  std::vector<uint32_t> offsets;
+  std::string error;
+  if (!sfntFontOffsets(file.data(), file.size(), offsets, error)) {
+    first.errors.push_back(error);
+    results.push_back(first);
+    return results;
+  }
+
+  bool collection = offsets.size() > 1 || (file.size() >= 4 && readU32(file.data()) == SFNT_TAG('t', 't', 'c', 'f'));
+  for (size_t i = 0; i < offsets.size(); i++) {
+    FontValidation result;
+    result.index = (uint32_t) i;
+    validateFont(file.data(), file.size(), offsets[i], collection, result);
+    results.push_back(result);
+  }
+
+  return results;
+}
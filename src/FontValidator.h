@@ -0,0 +1,28 @@
+#ifndef FONT_VALIDATOR_H
+#define FONT_VALIDATOR_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Problems found in one font of a file. Errors are structural problems which
+// can make renderers read out of bounds, warnings are checksum mismatches
+// which renderers generally ignore.
+struct FontValidation {
+  uint32_t index;      // Index of the font in a collection, 0 otherwise
+  const char *format;  // Name of the format of a file which is not an sfnt,
+                       // such as "PCF", which was not checked. NULL otherwise.
+  std::vector<std::string> errors;
+  std::vector<std::string> warnings;
+
+  FontValidation() : index(0), format(NULL) {}
+};
+
+// Checks the header, table directory, table bounds and checksums of every
+// font in the file at `path`. Problems with the file as a whole are reported
+// on font 0. Files in other formats fontconfig can list, such as bitmap,
+// Type 1 and WOFF fonts, are recognized by their first bytes and returned
+// as a single font with `format` set.
+std::vector<FontValidation> validateFontFile(const char *path);
+
+#endif // FONT_VALIDATOR_H
@@ -0,0 +1,422 @@
+#include "Itemizer.h"
+#include "FontQuery.h"
+#include "FontCatalog.h"
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define ITEMIZER_SSE2 1
+#endif
+
+// Size of the blocks read from the input stream
+static const size_t CHUNK_SIZE = 64 * 1024;
+
+static const int FONT_UNRESOLVED = -2;
+
+static const uint32_t REPLACEMENT_CHARACTER = 0xFFFD;
+
+// Returns the length of the leading run of ASCII bytes in `data`. Whole
+// blocks are checked at once, then the exact end is found bytewise.
+static size_t asciiPrefixLength(const unsigned char *data, size_t length) {
+  size_t i = 0;
+#ifdef ITEMIZER_SSE2
+  while (i + 16 <= length) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    if (_mm_movemask_epi8(block) != 0)
+      break;
+    i += 16;
+  }
+#else
+  while (i + 8 <= length) {
+    uint64_t block;
+    memcpy(&block, data + i, sizeof(block));
+    if (block & 0x8080808080808080ULL)
+      break;
+    i += 8;
+  }
+#endif
+  while (i < length && data[i] < 0x80)
+    i++;
+  return i;
+}
+
+#ifdef ITEMIZER_SSE2
+// Bit i is set if byte i of `block`, read as a signed byte, is below `bound`
+static inline uint32_t bytesBelow(__m128i block, int bound) {
+  return (uint32_t) _mm_movemask_epi8(_mm_cmplt_epi8(block, _mm_set1_epi8((char) bound)));
+}
+
+// Bit i is set if byte i of `block` is `value`
+static inline uint32_t bytesEqual(__m128i block, unsigned char value) {
+  return (uint32_t) _mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_set1_epi8((char) value)));
+}
+#endif
+
+// Returns the length of the leading part of `data` which consists of whole,
+// valid UTF-8 sequences, checked 16 bytes at a time. Each block is reduced
+// to bit masks of its byte classes, and the block is valid if its
+// continuation bytes are exactly those its lead bytes and those of the
+// previous block call for, and no lead byte is followed by a second byte
+// outside its range. The part ends before the first block with an error, or
+// before a sequence cut by the end of the last valid block. The rest, and
+// all of it without SSE2, is left to decodeUtf8().
+static size_t validUtf8Length(const unsigned char *data, size_t length) {
+  size_t valid = 0;
+#ifdef ITEMIZER_SSE2
+  // Bits carried over from the previous block: the continuations its lead
+  // bytes still call for, and whether its last byte restricts the next one
+  uint32_t pending = 0;
+  uint32_t afterE0 = 0, afterED = 0, afterF0 = 0, afterF4 = 0;
+
+  for (size_t i = 0; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(data + i));
+    uint32_t high = (uint32_t) _mm_movemask_epi8(block);
+    if (high == 0 && pending == 0) {
+      valid = i + 16;
+      afterE0 = afterED = afterF0 = afterF4 = 0;
+      continue;
+    }
+
+    // As signed bytes, 0x80-0xBF are -128 to -65, 0xC0-0xDF are -64 to -33,
+    // 0xE0-0xEF are -32 to -17 and 0xF0-0xFF are -16 to -1
+    uint32_t continuation = bytesBelow(block, -64);
+    uint32_t leads = high & ~continuation;
+    uint32_t leads3 = high & ~bytesBelow(block, -32);
+    uint32_t leads4 = high & ~bytesBelow(block, -16);
+    uint32_t invalid = (leads & bytesBelow(block, -62)) | (high & ~bytesBelow(block, -11));
+
+    uint32_t required = (leads << 1) | (leads3 << 2) | (leads4 << 3) | pending;
+    uint32_t belowA0 = bytesBelow(block, -96);
+    uint32_t below90 = bytesBelow(block, -112);
+    uint32_t e0 = (bytesEqual(block, 0xE0) << 1) | afterE0;
+    uint32_t ed = (bytesEqual(block, 0xED) << 1) | afterED;
+    uint32_t f0 = (bytesEqual(block, 0xF0) << 1) | afterF0;
+    uint32_t f4 = (bytesEqual(block, 0xF4) << 1) | afterF4;
+
+    // Overlong forms, surrogates and codepoints above U+10FFFF
+    invalid |= (e0 & belowA0) | (ed & continuation & ~belowA0) | (f0 & below90) | (f4 & continuation & ~below90);
+    if (invalid || (required & 0xFFFF) != continuation)
+      break;
+
+    pending = required >> 16;
+    afterE0 = e0 >> 16;
+    afterED = ed >> 16;
+    afterF0 = f0 >> 16;
+    afterF4 = f4 >> 16;
+
+    // A sequence cut by the end of the block starts at its last lead byte
+    valid = i + 16;
+    if (pending) {
+      while ((data[valid - 1] & 0xC0) == 0x80)
+        valid--;
+      valid--;
+    }
+  }
+#else
+  (void) data;
+  (void) length;
+#endif
+  return valid;
+}
+
+// Decodes the multi-byte sequence at `data`, known to be valid UTF-8, and
+// returns its length
+static inline int decodeValidUtf8(const unsigned char *data, uint32_t *codepoint) {
+  unsigned char b0 = data[0];
+  if (b0 < 0xE0) {
+    *codepoint = ((uint32_t) (b0 & 0x1F) << 6) | (data[1] & 0x3F);
+    return 2;
+  }
+  if (b0 < 0xF0) {
+    *codepoint = ((uint32_t) (b0 & 0x0F) << 12) | ((uint32_t) (data[1] & 0x3F) << 6) | (data[2] & 0x3F);
+    return 3;
+  }
+  *codepoint = ((uint32_t) (b0 & 0x07) << 18) | ((uint32_t) (data[1] & 0x3F) << 12) |
+               ((uint32_t) (data[2] & 0x3F) << 6) | (data[3] & 0x3F);
+  return 4;
+}
+
+int decodeUtf8(const unsigned char *data, size_t length, uint32_t *codepoint) {
+  unsigned char b0 = data[0];
+  int needed;
+  unsigned char lower = 0x80;
+  unsigned char upper = 0xBF;
+  uint32_t value;
+
+  if (b0 >= 0xC2 && b0 <= 0xDF) {
+    needed = 1;
+    value = b0 & 0x1F;
+  } else if (b0 >= 0xE0 && b0 <= 0xEF) {
+    needed = 2;
+    value = b0 & 0x0F;
+    if (b0 == 0xE0)
+      lower = 0xA0; // overlong
+    else if (b0 == 0xED)
+      upper = 0x9F; // surrogates
+  } else if (b0 >= 0xF0 && b0 <= 0xF4) {
+    needed = 3;
+    value = b0 & 0x07;
+    if (b0 == 0xF0)
+      lower = 0x90; // overlong
+    else if (b0 == 0xF4)
+      upper = 0x8F; // above U+10FFFF
+  } else {
+    return -1;
+  }
+
+  for (int i = 1; i <= needed; i++) {
+    if ((size_t) i >= length)
+      return 0;
+
+    unsigned char b = data[i];
+    if (i == 1 ? (b < lower || b > upper) : (b < 0x80 || b > 0xBF))
+      return -1;
+
+    value = (value << 6) | (b & 0x3F);
+  }
+
+  *codepoint = value;
+  return needed + 1;
+}
+
+// Characters which are shared between scripts. These stay in the current run
+// when its font can display them instead of splitting the run.
+static bool isCommonCodepoint(uint32_t c) {
+  if (c < 0x80)
+    return !((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'));
+
+  return (c >= 0x00A0 && c <= 0x00BF) ||
+         (c >= 0x0300 && c <= 0x036F) || // combining diacritical marks
+         (c >= 0x2000 && c <= 0x206F) || // general punctuation
+         (c >= 0x3000 && c <= 0x303F) || // CJK symbols and punctuation
+         (c >= 0xFE00 && c <= 0xFE0F) || // variation selectors
+         (c >= 0xFF01 && c <= 0xFF0F);   // fullwidth punctuation
+}
+
+static std::string encodeUtf8(uint32_t c) {
+  std::string out;
+  if (c < 0x80) {
+    out += (char) c;
+  } else if (c < 0x800) {
+    out += (char) (0xC0 | (c >> 6));
+    out += (char) (0x80 | (c & 0x3F));
+  } else if (c < 0x10000) {
+    out += (char) (0xE0 | (c >> 12));
+    out += (char) (0x80 | ((c >> 6) & 0x3F));
+    out += (char) (0x80 | (c & 0x3F));
+  } else {
+    out += (char) (0xF0 | (c >> 18));
+    out += (char) (0x80 | ((c >> 12) & 0x3F));
+    out += (char) (0x80 | ((c >> 6) & 0x3F));
+    out += (char) (0x80 | (c & 0x3F));
+  }
+  return out;
+}
+
+Itemizer::Itemizer(const char *postscriptName)
+  : basePostscriptName(postscriptName ? postscriptName : ""),
+    baseFont(-1),
+    table(NULL),
+    offset(0),
+    invalidCount(0),
+    pendingLength(0),
+    callback(NULL),
+    callbackContext(NULL) {
+  for (int i = 0; i < 128; i++)
+    asciiFonts[i] = FONT_UNRESOLVED;
+
+  current.start = 0;
+  current.length = 0;
+  current.count = 0;
+  current.font = -1;
+}
+
+Itemizer::~Itemizer() {
+  for (size_t i = 0; i < fontList.size(); i++)
+    delete fontList[i];
+}
+
+bool Itemizer::itemize(FILE *input, TextRunCallback runCallback, void *context) {
+  callback = runCallback;
+  callbackContext = context;
+
+  // Resolve the base font up front so it gets index 0 and is preferred for
+  // every codepoint it covers. An ASCII probe is enough to find it.
+  if (baseFont < 0) {
+    table = FontCatalog::shared()->fallbackTable(basePostscriptName.c_str());
+    baseFont = addFont(substituteFont(basePostscriptName.c_str(), "a"));
+  }
+
+  std::vector<unsigned char> buffer(CHUNK_SIZE + sizeof(pending));
+  bool ok = true;
+
+  for (;;) {
+    // Carry over an incomplete sequence from the end of the previous chunk
+    memcpy(&buffer[0], pending, pendingLength);
+    size_t carried = pendingLength;
+    pendingLength = 0;
+
+    size_t read = fread(&buffer[carried], 1, CHUNK_SIZE, input);
+    if (read < CHUNK_SIZE && ferror(input))
+      ok = false;
+
+    bool last = read == 0 || feof(input) || !ok;
+    processChunk(&buffer[0], carried + read, last);
+    if (last)
+      break;
+  }
+
+  flushRun();
+  return ok;
+}
+
+void Itemizer::processChunk(const unsigned char *data, size_t length, bool last) {
+  size_t i = 0;
+
+  while (i < length) {
+    // Fast path for runs of ASCII. Most characters resolve through the flat
+    // table without touching the platform font APIs.
+    size_t ascii = asciiPrefixLength(data + i, length - i);
+    for (size_t end = i + ascii; i < end; i++)
+      addCodepoint(data[i], offset + i, 1);
+
+    if (i >= length)
+      break;
+
+    // Text in other scripts is validated a block at a time, and its
+    // sequences are then decoded without checking each byte
+    size_t valid = validUtf8Length(data + i, length - i);
+    for (size_t end = i + valid; i < end;) {
+      if (data[i] < 0x80) {
+        addCodepoint(data[i], offset + i, 1);
+        i++;
+        continue;
+      }
+
+      uint32_t codepoint;
+      int len = decodeValidUtf8(data + i, &codepoint);
+      addCodepoint(codepoint, offset + i, len);
+      i += len;
+    }
+    if (valid > 0)
+      continue;
+
+    uint32_t codepoint;
+    int len = decodeUtf8(data + i, length - i, &codepoint);
+    if (len == 0 && !last) {
+      // Truncated by the chunk boundary, finish it with the next chunk
+      pendingLength = length - i;
+      memcpy(pending, data + i, pendingLength);
+      break;
+    }
+
+    if (len <= 0) {
+      invalidCount++;
+      addCodepoint(REPLACEMENT_CHARACTER, offset + i, 1);
+      i++;
+      continue;
+    }
+
+    addCodepoint(codepoint, offset + i, len);
+    i += len;
+  }
+
+  offset += i;
+}
+
+void Itemizer::addCodepoint(uint32_t codepoint, size_t byteOffset, size_t length) {
+  int font;
+  if (current.count > 0 && current.font >= 0 && isCommonCodepoint(codepoint) && covers(current.font, codepoint)) {
+    font = current.font;
+  } else if (codepoint < 128) {
+    font = asciiFonts[codepoint];
+    if (font == FONT_UNRESOLVED)
+      font = asciiFonts[codepoint] = fontForCodepoint(codepoint);
+  } else {
+    std::unordered_map<uint32_t, int>::iterator it = codepointFonts.find(codepoint);
+    if (it != codepointFonts.end()) {
+      font = it->second;
+    } else {
+      font = fontForCodepoint(codepoint);
+      codepointFonts[codepoint] = font;
+    }
+  }
+
+  if (current.count > 0 && font != current.font)
+    flushRun();
+
+  if (current.count == 0) {
+    current.start = byteOffset;
+    current.font = font;
+  }
+
+  current.length = byteOffset + length - current.start;
+  current.count++;
+}
+
+int Itemizer::fontForCodepoint(uint32_t codepoint) {
+  // The catalog's fallback table gives the preferred face directly
+  if (table) {
+    uint32_t face = table->lookup(codepoint);
+    return face == FallbackTable::NO_FACE ? baseFont : addFont(FontCatalog::shared()->descriptor(face));
+  }
+
+  if (baseFont >= 0 && covers(baseFont, codepoint))
+    return baseFont;
+
+  // Fonts already used by earlier runs are likely to cover nearby text too
+  for (size_t i = 0; i < fontList.size(); i++) {
+    if ((int) i != baseFont && covers((int) i, codepoint))
+      return (int) i;
+  }
+
+  std::string text = encodeUtf8(codepoint);
+  return addFont(substituteFont(basePostscriptName.c_str(), text.c_str()));
+}
+
+int Itemizer::addFont(FontDescriptor *font) {
+  if (!font)
+    return -1;
+
+  std::string key = std::string(font->path ? font->path : "") + '\0' +
+                    (font->postscriptName ? font->postscriptName : "");
+
+  std::unordered_map<std::string, int>::iterator it = fontIds.find(key);
+  if (it != fontIds.end()) {
+    delete font;
+    return it->second;
+  }
+
+  uint64_t coverage[2] = { 0, 0 };
+  for (uint32_t c = 0; c < 128; c++) {
+    if (fontHasCodepoint(font, c))
+      coverage[c >> 6] |= 1ULL << (c & 63);
+  }
+
+  int id = (int) fontList.size();
+  fontList.push_back(font);
+  fontIds[key] = id;
+  asciiCoverage.push_back(coverage[0]);
+  asciiCoverage.push_back(coverage[1]);
+  return id;
+}
+
+bool Itemizer::covers(int font, uint32_t codepoint) {
+  if (font < 0)
+    return false;
+  if (codepoint < 128)
+    return (asciiCoverage[font * 2 + (codepoint >> 6)] >> (codepoint & 63)) & 1;
+  return fontHasCodepoint(fontList[font], codepoint);
+}
+
+void Itemizer::flushRun() {
+  if (current.count == 0)
+    return;
+
+  if (callback)
+    callback(current, callbackContext);
+
+  current.length = 0;
+  current.count = 0;
+  current.font = -1;
+}
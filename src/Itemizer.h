@@ -0,0 +1,79 @@
+#ifndef ITEMIZER_H
+#define ITEMIZER_H
+
+#include "FontDescriptor.h"
+#include "FontCatalog.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A run of text which is rendered with a single font.
+struct TextRun {
+  size_t start;   // Byte offset of the first byte of the run in the input
+  size_t length;  // Length of the run in bytes
+  size_t count;   // Number of codepoints in the run
+  int font;       // Index into Itemizer::fonts(), or -1 if nothing covers the run
+};
+
+// Decodes one multi-byte UTF-8 sequence starting at `data`.
+// Returns the sequence length, 0 if the sequence is valid so far but truncated
+// by the end of the buffer, or -1 if the first byte does not start a valid
+// sequence. ASCII bytes are not handled here.
+int decodeUtf8(const unsigned char *data, size_t length, uint32_t *codepoint);
+
+typedef void (*TextRunCallback)(const TextRun &run, void *context);
+
+// Splits UTF-8 text into runs where each run is assigned the font which
+// should be used to render it. The input is read in fixed size chunks so
+// arbitrarily large documents can be processed with constant memory.
+//
+// Invalid UTF-8 sequences are treated as U+FFFD and counted, but do not stop
+// the itemization.
+class Itemizer {
+public:
+  Itemizer(const char *postscriptName);
+  ~Itemizer();
+
+  // Read all of `input` and report each run to `callback` as soon as it is
+  // complete. Returns false if reading from `input` failed.
+  bool itemize(FILE *input, TextRunCallback callback, void *context);
+
+  // The fonts referenced by the runs, in order of first use.
+  const std::vector<FontDescriptor *> &fonts() const { return fontList; }
+
+  size_t invalidSequences() const { return invalidCount; }
+
+private:
+  void processChunk(const unsigned char *data, size_t length, bool last);
+  void addCodepoint(uint32_t codepoint, size_t offset, size_t length);
+  int fontForCodepoint(uint32_t codepoint);
+  int addFont(FontDescriptor *font);
+  bool covers(int font, uint32_t codepoint);
+  void flushRun();
+
+  std::string basePostscriptName;
+  int baseFont;
+  const FallbackTable *table;
+  std::vector<FontDescriptor *> fontList;
+  std::unordered_map<std::string, int> fontIds;
+
+  // ASCII coverage of each font, two words per font
+  std::vector<uint64_t> asciiCoverage;
+
+  // Codepoint to font lookups which have already been resolved. ASCII is
+  // kept in a flat table as it dominates most documents.
+  int asciiFonts[128];
+  std::unordered_map<uint32_t, int> codepointFonts;
+
+  TextRun current;
+  size_t offset;
+  size_t invalidCount;
+  unsigned char pending[4];
+  size_t pendingLength;
+  TextRunCallback callback;
+  void *callbackContext;
+};
+
+#endif // ITEMIZER_H
@@ -0,0 +1,120 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile() : bytes(NULL), length(0) {
+#ifdef _WIN32
+  file = INVALID_HANDLE_VALUE;
+  mapping = NULL;
+#endif
+}
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const char *path, Access access) {
+  close();
+
+  int wideLength = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+  if (wideLength <= 0)
+    return false;
+
+  WCHAR *widePath = new WCHAR[wideLength];
+  MultiByteToWideChar(CP_UTF8, 0, path, -1, widePath, wideLength);
+
+  DWORD flags = access == AccessSequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS;
+  file = CreateFileW(widePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, flags, NULL);
+  delete[] widePath;
+  if (file == INVALID_HANDLE_VALUE)
+    return false;
+
+  LARGE_INTEGER fileSize;
+  if (!GetFileSizeEx(file, &fileSize)) {
+    close();
+    return false;
+  }
+
+  length = (size_t) fileSize.QuadPart;
+  if (length == 0)
+    return true;
+
+  mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (!mapping) {
+    close();
+    return false;
+  }
+
+  bytes = (const uint8_t *) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  if (!bytes) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+void MappedFile::close() {
+  if (bytes)
+    UnmapViewOfFile(bytes);
+  if (mapping)
+    CloseHandle(mapping);
+  if (file != INVALID_HANDLE_VALUE)
+    CloseHandle(file);
+
+  bytes = NULL;
+  length = 0;
+  mapping = NULL;
+  file = INVALID_HANDLE_VALUE;
+}
+
+#else
+
+bool MappedFile::open(const char *path, Access access) {
+  close();
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    ::close(fd);
+    return false;
+  }
+
+  length = (size_t) st.st_size;
+  if (length == 0) {
+    ::close(fd);
+    return true;
+  }
+
+  void *mapped = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) {
+    length = 0;
+    return false;
+  }
+
+  madvise(mapped, length, access == AccessSequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+  bytes = (const uint8_t *) mapped;
+  return true;
+}
+
+void MappedFile::close() {
+  if (bytes)
+    munmap((void *) bytes, length);
+
+  bytes = NULL;
+  length = 0;
+}
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A read-only memory mapping of a whole file
+class MappedFile {
+public:
+  // How the mapping will be read, passed on to the OS as a hint
+  enum Access {
+    AccessRandom,
+    AccessSequential
+  };
+
+  MappedFile();
+  ~MappedFile();
+
+  // Map the file at `path`. Returns false if it can not be opened or mapped.
+  // Empty files open successfully with a NULL data pointer.
+  bool open(const char *path, Access access = AccessRandom);
+  void close();
+
+  const uint8_t *data() const { return bytes; }
+  size_t size() const { return length; }
+
+private:
+  MappedFile(const MappedFile &);
+  MappedFile &operator=(const MappedFile &);
+
+  const uint8_t *bytes;
+  size_t length;
+#ifdef _WIN32
+  void *file;
+  void *mapping;
+#endif
+};
+
+#endif // MAPPED_FILE_H
@@ -0,0 +1,37 @@
+#ifndef PARALLEL_FOR_H
+#define PARALLEL_FOR_H
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+// Calls fn(i) for every i in [0, count) on up to `threads` threads (the
+// number of hardware threads if 0). Indices are handed out one at a time, so
+// slow items do not hold up the others.
+template <typename Function>
+void parallelFor(size_t count, size_t threads, Function fn) {
+  if (threads == 0)
+    threads = std::thread::hardware_concurrency();
+  if (threads > count)
+    threads = count;
+
+  if (threads <= 1) {
+    for (size_t i = 0; i < count; i++)
+      fn(i);
+    return;
+  }
+
+  std::atomic<size_t> next(0);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < threads; t++) {
+    workers.push_back(std::thread([&]() {
+      for (size_t i = next++; i < count; i = next++)
+        fn(i);
+    }));
+  }
+
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+}
+
+#endif // PARALLEL_FOR_H
@@ -0,0 +1,59 @@
+#ifndef PARALLEL_SORT_H
+#define PARALLEL_SORT_H
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Below this many elements sorting on one thread is faster than starting
+// threads.
+static const size_t PARALLEL_SORT_THRESHOLD = 1 << 15;
+
+// Sorts [first, last) by sorting one chunk per hardware thread and merging
+// the chunks pairwise. The comparator must be a strict total order for the
+// result to be deterministic, just as with std::sort.
+template <typename Iterator, typename Compare>
+void parallelSort(Iterator first, Iterator last, Compare comp) {
+  size_t count = last - first;
+  size_t threads = std::thread::hardware_concurrency();
+  if (count < PARALLEL_SORT_THRESHOLD || threads < 2) {
+    std::sort(first, last, comp);
+    return;
+  }
+
+  size_t chunk = (count + threads - 1) / threads;
+  std::vector<size_t> bounds;
+  for (size_t start = 0; start < count; start += chunk)
+    bounds.push_back(start);
+  bounds.push_back(count);
+
+  std::vector<std::thread> workers;
+  for (size_t i = 0; i + 1 < bounds.size(); i++) {
+    workers.push_back(std::thread([=]() {
+      std::sort(first + bounds[i], first + bounds[i + 1], comp);
+    }));
+  }
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+
+  // Merge neighbouring chunks until one is left, a level at a time
+  while (bounds.size() > 2) {
+    std::vector<size_t> merged;
+    std::vector<std::thread> mergers;
+    for (size_t i = 0; i + 1 < bounds.size(); i += 2) {
+      merged.push_back(bounds[i]);
+      if (i + 2 < bounds.size()) {
+        size_t low = bounds[i], mid = bounds[i + 1], high = bounds[i + 2];
+        mergers.push_back(std::thread([=]() {
+          std::inplace_merge(first + low, first + mid, first + high, comp);
+        }));
+      }
+    }
+    merged.push_back(count);
+    for (size_t i = 0; i < mergers.size(); i++)
+      mergers[i].join();
+    bounds = merged;
+  }
+}
+
+#endif // PARALLEL_SORT_H
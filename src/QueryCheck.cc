@@ -0,0 +1,194 @@
+#include "QueryCheck.h"
+#include "FontCatalog.h"
+#include "FontQuery.h"
+#include "QueryExpression.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <ctype.h>
+#include <random>
+#include <stdio.h>
+
+static const char *STYLES[] = { "Regular", "Italic", "Bold", "Bold Italic", "Light", "Medium", "Black", "Condensed" };
+static const int STYLE_COUNT = sizeof(STYLES) / sizeof(STYLES[0]);
+
+static const int WIDTHS[] = {
+  FontWidthUltraCondensed, FontWidthExtraCondensed, FontWidthCondensed,
+  FontWidthSemiCondensed, FontWidthNormal, FontWidthSemiExpanded,
+  FontWidthExpanded, FontWidthExtraExpanded, FontWidthUltraExpanded
+};
+
+// Share `faces` faces among families of eight styles, with random weights,
+// widths and flags, and a few variable faces, and make it the shared catalog
+static void useSyntheticCatalog(size_t faces, std::mt19937 &random) {
+  ResultSet fonts;
+  char family[32];
+  char postscriptName[64];
+  char path[64];
+  for (size_t i = 0; i < faces; i++) {
+    const char *style = STYLES[i % STYLE_COUNT];
+    snprintf(family, sizeof(family), "Family %lu", (unsigned long) (i / STYLE_COUNT));
+    snprintf(postscriptName, sizeof(postscriptName), "Family%lu-%d", (unsigned long) (i / STYLE_COUNT), (int) (i % STYLE_COUNT));
+    snprintf(path, sizeof(path), "/fonts/family%lu.ttf", (unsigned long) (i / STYLE_COUNT));
+
+    FontDescriptor *font = new FontDescriptor(path, postscriptName, family, style,
+      (FontWeight) (100 + 50 * (random() % 17)), (FontWidth) WIDTHS[random() % 9],
+      random() % 4 == 0, random() % 16 == 0, random() % 8 == 0, (int) (i % STYLE_COUNT));
+    if (random() % 20 == 0) {
+      font->weightMin = 100 + 100 * (random() % 4);
+      font->weightMax = std::max(font->weightMin, 500 + 100 * (int) (random() % 5));
+      font->weight = (FontWeight) ValueRange(font->weightMin, font->weightMax).clamp(400);
+    }
+    fonts.push_back(font);
+  }
+
+  FontCatalog::setShared(new FontCatalog(&fonts));
+}
+
+// A range of values from `low` to `high` in steps of `step`, sometimes open
+// on one side
+static ValueRange randomRange(std::mt19937 &random, int low, int high, int step) {
+  int count = (high - low) / step + 1;
+  int a = low + step * (int) (random() % count);
+  int b = low + step * (int) (random() % count);
+  ValueRange range(std::min(a, b), std::max(a, b));
+  switch (random() % 4) {
+    case 0: range.min = INT_MIN; break;
+    case 1: range.max = INT_MAX; break;
+  }
+  return range;
+}
+
+static QueryExpression *randomExpression(std::mt19937 &random) {
+  char source[128];
+  int weight = 100 + 50 * (int) (random() % 17);
+  switch (random() % 5) {
+    case 0: snprintf(source, sizeof(source), "weight >= %d", weight); break;
+    case 1: snprintf(source, sizeof(source), "width < %d and not italic", WIDTHS[random() % 9]); break;
+    case 2: snprintf(source, sizeof(source), "family ~ \"ly %d\" or monospace", (int) (random() % 10)); break;
+    case 3: snprintf(source, sizeof(source), "style = \"%s\" and weight != %d", STYLES[random() % STYLE_COUNT], weight); break;
+    default: snprintf(source, sizeof(source), "(weight <= %d or oblique) and width >= 100", weight); break;
+  }
+
+  std::string error;
+  return QueryExpression::compile(source, error);
+}
+
+// A query of a random shape, or NULL for none. Names come from face `id`,
+// in a random case.
+static FontDescriptor *randomQuery(std::mt19937 &random, const FontCatalog &catalog, size_t id) {
+  const CatalogFace &face = catalog.face(id);
+  unsigned fields = random() % 64;
+  if (fields == 0)
+    return NULL;
+
+  std::string names[3] = { catalog.string(face.postscriptName), catalog.string(face.family), catalog.string(face.style) };
+  for (int n = 0; n < 3; n++) {
+    for (size_t i = 0; i < names[n].size(); i++) {
+      if (random() % 2)
+        names[n][i] = (char) toupper((unsigned char) names[n][i]);
+    }
+  }
+
+  return new FontDescriptor(NULL,
+    (fields & 1) ? names[0].c_str() : NULL,
+    (fields & 2) ? names[1].c_str() : NULL,
+    (fields & 4) ? names[2].c_str() : NULL,
+    (fields & 8) ? (FontWeight) (100 * (1 + random() % 9)) : FontWeightUndefined,
+    (fields & 16) ? (FontWidth) WIDTHS[random() % 9] : FontWidthUndefined,
+    (fields & 32) && random() % 2, random() % 8 == 0, random() % 4 == 0);
+}
+
+// Ids of the faces passing `query` and `filter`, testing each face as
+// matchesQuery() and the filter describe
+static std::vector<uint32_t> scanFaces(const FontCatalog &catalog, FontDescriptor *query, const QueryFilter &filter) {
+  std::vector<uint32_t> ids;
+  for (size_t id = 0; id < catalog.size(); id++) {
+    const CatalogFace &f = catalog.face(id);
+    ValueRange weight(f.weightMin, f.weightMax);
+    ValueRange width(f.widthMin, f.widthMax);
+    if (filter.weight.isSet() && !filter.weight.overlaps(weight.min, weight.max))
+      continue;
+    if (filter.width.isSet() && !filter.width.overlaps(width.min, width.max))
+      continue;
+    if (filter.where && !filter.where->matches(catalog, f))
+      continue;
+    if (query && !matchesQuery(query, catalog.string(f.postscriptName), catalog.string(f.family), catalog.string(f.style),
+                               weight, width, (f.flags & CatalogFaceItalic) != 0, (f.flags & CatalogFaceOblique) != 0,
+                               (f.flags & CatalogFaceMonospace) != 0))
+      continue;
+    ids.push_back((uint32_t) id);
+  }
+  return ids;
+}
+
+bool checkQueries(size_t faces, size_t iterations, unsigned seed) {
+  std::mt19937 random(seed);
+  useSyntheticCatalog(faces, random);
+  FontCatalog *catalog = FontCatalog::shared();
+
+  for (size_t i = 0; i < iterations; i++) {
+    FontDescriptor *query = randomQuery(random, *catalog, random() % catalog->size());
+    QueryFilter filter;
+    if (random() % 3 == 0)
+      filter.weight = randomRange(random, 100, 900, 50);
+    if (random() % 4 == 0)
+      filter.width = randomRange(random, 50, 200, 25);
+    if (random() % 4 == 0)
+      filter.where = randomExpression(random);
+
+    std::vector<uint32_t> found = findFaceIds(query, &filter);
+    std::vector<uint32_t> expected = scanFaces(*catalog, query, filter);
+    bool same = found == expected;
+    if (!same) {
+      printf("Query %lu differs: %lu faces found, %lu expected\n", (unsigned long) i,
+             (unsigned long) found.size(), (unsigned long) expected.size());
+      if (query)
+        query->printJson();
+      printf("weight filter %d..%d, width filter %d..%d, where %s\n", filter.weight.min, filter.weight.max,
+             filter.width.min, filter.width.max, filter.where ? "set" : "unset");
+    }
+
+    delete filter.where;
+    delete query;
+    if (!same)
+      return false;
+  }
+
+  printf("%lu queries over %lu faces match\n", (unsigned long) iterations, (unsigned long) faces);
+  return true;
+}
+
+void benchQueries(size_t faces, size_t runs, unsigned seed) {
+  std::mt19937 random(seed);
+  useSyntheticCatalog(faces, random);
+  FontCatalog *catalog = FontCatalog::shared();
+  const char *postscriptName = catalog->string(catalog->face(catalog->size() / 2).postscriptName);
+
+  FontDescriptor style(NULL, NULL, NULL, "Bold", FontWeightUndefined, FontWidthUndefined, false, false, false);
+  FontDescriptor named(NULL, postscriptName, NULL, NULL, FontWeightUndefined, FontWidthUndefined, false, false, false);
+  FontDescriptor flags(NULL, NULL, NULL, NULL, FontWeightUndefined, FontWidthUndefined, true, false, true);
+  QueryFilter none;
+  QueryFilter weights;
+  weights.weight = ValueRange(100, 900);
+
+  struct {
+    const char *name;
+    FontDescriptor *query;
+    const QueryFilter *filter;
+  } shapes[] = {
+    { "style only", &style, &none },
+    { "PostScript name", &named, &none },
+    { "flags only", &flags, &none },
+    { "style with --weight=100..900", &style, &weights }
+  };
+
+  for (size_t s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++) {
+    size_t matches = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < runs; r++)
+      matches = findFaceIds(shapes[s].query, shapes[s].filter).size();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    printf("%-30s %8.2f ms  (%lu matches)\n", shapes[s].name, elapsed.count() / runs, (unsigned long) matches);
+  }
+}
@@ -0,0 +1,19 @@
+#ifndef QUERY_CHECK_H
+#define QUERY_CHECK_H
+
+#include <stddef.h>
+
+// Developer checks of the catalog query loop, built with the QUERY_CHECK
+// CMake option. Both replace the shared catalog with a synthetic one of
+// `faces` faces, generated from `seed`.
+
+// Runs `iterations` random queries through findFonts() and compares each
+// result with a plain scan testing every face with matchesQuery() and the
+// filter checks. Prints the first query whose results differ and returns
+// false, or returns true if none do.
+bool checkQueries(size_t faces, size_t iterations, unsigned seed);
+
+// Prints the average time of findFonts() for a few query shapes
+void benchQueries(size_t faces, size_t runs, unsigned seed);
+
+#endif // QUERY_CHECK_H
@@ -0,0 +1,438 @@
+#include "QueryExpression.h"
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+
+static bool caseInsensitiveContains(const char *haystack, const char *needle) {
+  size_t length = strlen(needle);
+  for (const char *p = haystack; *p; p++) {
+    size_t i = 0;
+    while (i < length && p[i] && tolower((unsigned char) p[i]) == tolower((unsigned char) needle[i]))
+      i++;
+    if (i == length)
+      return true;
+  }
+  return length == 0;
+}
+
+enum TokenType {
+  TokenEnd,
+  TokenIdentifier,
+  TokenString,
+  TokenNumber,
+  TokenOperator,
+  TokenOpen,
+  TokenClose
+};
+
+struct Token {
+  TokenType type;
+  std::string text;
+  size_t position;
+};
+
+// Recursive descent parser which emits the program while parsing. Jumps of an
+// `and` / `or` chain are patched to point after the last operand.
+class QueryParser {
+public:
+  QueryParser(const char *source, QueryExpression *expression)
+    : source(source), pos(0), expression(expression) {}
+
+  bool parse(std::string &error);
+
+private:
+  // A bound on a numeric field implied by a comparison
+  struct Bound {
+    FontField field;
+    ValueRange range;
+  };
+
+  bool next();
+  bool fail(const std::string &message);
+  bool isKeyword(const char *word, const char *symbol) const;
+
+  bool parseOr(std::vector<Bound> &bounds);
+  bool parseAnd(std::vector<Bound> &bounds);
+  bool parseNot(std::vector<Bound> &bounds);
+  bool parsePrimary(std::vector<Bound> &bounds);
+  bool parseComparison(std::vector<Bound> &bounds);
+
+  void emit(QueryExpression::OpCode op, uint32_t arg) {
+    QueryExpression::Instruction instruction = { op, arg };
+    expression->program.push_back(instruction);
+  }
+
+  const char *source;
+  size_t pos;
+  Token token;
+  std::string errorMessage;
+  QueryExpression *expression;
+};
+
+bool QueryParser::fail(const std::string &message) {
+  char position[32];
+  snprintf(position, sizeof(position), " at position %lu", (unsigned long) (token.position + 1));
+  errorMessage = message + position;
+  return false;
+}
+
+bool QueryParser::next() {
+  while (isspace((unsigned char) source[pos]))
+    pos++;
+
+  token.position = pos;
+  token.text.clear();
+  char c = source[pos];
+
+  if (!c) {
+    token.type = TokenEnd;
+    return true;
+  }
+
+  if (c == '(' || c == ')') {
+    token.type = c == '(' ? TokenOpen : TokenClose;
+    token.text = c;
+    pos++;
+    return true;
+  }
+
+  if (c == '"' || c == '\'') {
+    token.type = TokenString;
+    pos++;
+    while (source[pos] && source[pos] != c) {
+      if (source[pos] == '\\' && source[pos + 1])
+        pos++;
+      token.text += source[pos++];
+    }
+    if (!source[pos])
+      return fail("Unterminated string");
+    pos++;
+    return true;
+  }
+
+  if (isdigit((unsigned char) c) || (c == '-' && isdigit((unsigned char) source[pos + 1]))) {
+    token.type = TokenNumber;
+    token.text += source[pos++];
+    while (isdigit((unsigned char) source[pos]))
+      token.text += source[pos++];
+    return true;
+  }
+
+  if (isalpha((unsigned char) c) || c == '_') {
+    token.type = TokenIdentifier;
+    while (isalnum((unsigned char) source[pos]) || source[pos] == '_' || source[pos] == '-')
+      token.text += source[pos++];
+    return true;
+  }
+
+  static const char *operators[] = { "==", "!=", "<=", ">=", "&&", "||", "=", "<", ">", "~", "!" };
+  for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+    size_t length = strlen(operators[i]);
+    if (strncmp(source + pos, operators[i], length) == 0) {
+      token.type = TokenOperator;
+      token.text = operators[i];
+      pos += length;
+      return true;
+    }
+  }
+
+  return fail(std::string("Unexpected character '") + c + "'");
+}
+
+bool QueryParser::isKeyword(const char *word, const char *symbol) const {
+  if (token.type == TokenOperator)
+    return token.text == symbol;
+  return token.type == TokenIdentifier && caseInsensitiveMatch(token.text.c_str(), word);
+}
+
+bool QueryParser::parse(std::string &error) {
+  std::vector<Bound> bounds;
+  bool ok = next() && parseOr(bounds);
+  if (ok && token.type != TokenEnd)
+    ok = fail("Unexpected '" + token.text + "'");
+
+  if (!ok) {
+    error = errorMessage;
+    return false;
+  }
+
+  // Intersect the bounds which hold for the whole expression
+  for (size_t i = 0; i < bounds.size(); i++) {
+    ValueRange &range = bounds[i].field == FontFieldWeight ? expression->weightRange : expression->widthRange;
+    if (!range.isSet()) {
+      range = bounds[i].range;
+    } else {
+      range.min = std::max(range.min, bounds[i].range.min);
+      range.max = std::min(range.max, bounds[i].range.max);
+      if (!range.isSet())
+        range = ValueRange(INT_MAX, INT_MAX); // contradictory, keep it set but (practically) empty
+    }
+  }
+  return true;
+}
+
+bool QueryParser::parseOr(std::vector<Bound> &bounds) {
+  // `bounds` may already hold those of an enclosing conjunction, so the
+  // first operand's are kept apart until it is known there is no `or`
+  std::vector<Bound> first;
+  if (!parseAnd(first))
+    return false;
+  if (!isKeyword("or", "||")) {
+    bounds.insert(bounds.end(), first.begin(), first.end());
+    return true;
+  }
+
+  std::vector<size_t> jumps;
+  while (isKeyword("or", "||")) {
+    // Bounds of one operand do not hold for the whole disjunction
+    jumps.push_back(expression->program.size());
+    emit(QueryExpression::OpJumpIfTrue, 0);
+
+    std::vector<Bound> ignored;
+    if (!next() || !parseAnd(ignored))
+      return false;
+  }
+
+  for (size_t i = 0; i < jumps.size(); i++)
+    expression->program[jumps[i]].arg = (uint32_t) expression->program.size();
+  return true;
+}
+
+bool QueryParser::parseAnd(std::vector<Bound> &bounds) {
+  if (!parseNot(bounds))
+    return false;
+
+  std::vector<size_t> jumps;
+  while (isKeyword("and", "&&")) {
+    jumps.push_back(expression->program.size());
+    emit(QueryExpression::OpJumpIfFalse, 0);
+
+    if (!next() || !parseNot(bounds))
+      return false;
+  }
+
+  for (size_t i = 0; i < jumps.size(); i++)
+    expression->program[jumps[i]].arg = (uint32_t) expression->program.size();
+  return true;
+}
+
+bool QueryParser::parseNot(std::vector<Bound> &bounds) {
+  if (isKeyword("not", "!")) {
+    std::vector<Bound> ignored;
+    if (!next() || !parseNot(ignored))
+      return false;
+    emit(QueryExpression::OpNot, 0);
+    return true;
+  }
+  return parsePrimary(bounds);
+}
+
+bool QueryParser::parsePrimary(std::vector<Bound> &bounds) {
+  if (token.type == TokenOpen) {
+    if (!next() || !parseOr(bounds))
+      return false;
+    if (token.type != TokenClose)
+      return fail("Expected ')'");
+    return next();
+  }
+
+  if (token.type != TokenIdentifier)
+    return fail(token.type == TokenEnd ? "Unexpected end of expression" : "Expected a field name");
+
+  return parseComparison(bounds);
+}
+
+bool QueryParser::parseComparison(std::vector<Bound> &bounds) {
+  QueryExpression::Term term;
+  std::string name = token.text;
+
+  if (caseInsensitiveMatch(name.c_str(), "postscript"))
+    term.field = FontFieldPostscriptName;
+  else if (!parseFontField(name.c_str(), term.field))
+    return fail("Unknown field '" + name + "'");
+
+  term.number = 0;
+  if (!next())
+    return false;
+
+  bool isFlag = term.field == FontFieldItalic || term.field == FontFieldOblique || term.field == FontFieldMonospace;
+  bool isNumber = term.field == FontFieldWeight || term.field == FontFieldWidth;
+
+  // A boolean field on its own tests that it is set
+  bool compared = token.type == TokenOperator && (token.text == "=" || token.text == "==" || token.text == "!=");
+  if (isFlag && !compared) {
+    term.number = term.field == FontFieldItalic ? CatalogFaceItalic :
+                  term.field == FontFieldOblique ? CatalogFaceOblique : CatalogFaceMonospace;
+    emit(QueryExpression::OpFlag, (uint32_t) expression->terms.size());
+    expression->terms.push_back(term);
+    return true;
+  }
+
+  if (token.type != TokenOperator)
+    return fail("Expected a comparison after '" + name + "'");
+
+  const std::string &op = token.text;
+  if (op == "=" || op == "==")
+    term.comparison = QueryExpression::CompareEqual;
+  else if (op == "!=")
+    term.comparison = QueryExpression::CompareNotEqual;
+  else if (op == "<" && isNumber)
+    term.comparison = QueryExpression::CompareLess;
+  else if (op == "<=" && isNumber)
+    term.comparison = QueryExpression::CompareLessEqual;
+  else if (op == ">" && isNumber)
+    term.comparison = QueryExpression::CompareGreater;
+  else if (op == ">=" && isNumber)
+    term.comparison = QueryExpression::CompareGreaterEqual;
+  else if (op == "~" && !isNumber && !isFlag)
+    term.comparison = QueryExpression::CompareContains;
+  else
+    return fail("Operator '" + op + "' can not be used with '" + name + "'");
+
+  if (!next())
+    return false;
+
+  if (isFlag) {
+    bool value;
+    if (token.type == TokenIdentifier && caseInsensitiveMatch(token.text.c_str(), "true"))
+      value = true;
+    else if (token.type == TokenIdentifier && caseInsensitiveMatch(token.text.c_str(), "false"))
+      value = false;
+    else
+      return fail("Expected true or false");
+
+    term.number = term.field == FontFieldItalic ? CatalogFaceItalic :
+                  term.field == FontFieldOblique ? CatalogFaceOblique : CatalogFaceMonospace;
+    emit(QueryExpression::OpFlag, (uint32_t) expression->terms.size());
+    expression->terms.push_back(term);
+    if (value != (term.comparison == QueryExpression::CompareEqual))
+      emit(QueryExpression::OpNot, 0);
+    return next();
+  }
+
+  if (isNumber) {
+    if (token.type != TokenNumber)
+      return fail("Expected a number");
+    term.number = atoi(token.text.c_str());
+    if (term.field == FontFieldWidth)
+      term.number = widthValue(term.number);
+
+    Bound bound = { term.field, ValueRange(INT_MIN, INT_MAX) };
+    switch (term.comparison) {
+      case QueryExpression::CompareEqual:
+        bound.range = ValueRange(term.number, term.number);
+        break;
+      case QueryExpression::CompareLess:
+        bound.range.max = term.number - 1;
+        break;
+      case QueryExpression::CompareLessEqual:
+        bound.range.max = term.number;
+        break;
+      case QueryExpression::CompareGreater:
+        bound.range.min = term.number + 1;
+        break;
+      case QueryExpression::CompareGreaterEqual:
+        bound.range.min = term.number;
+        break;
+      default:
+        break;
+    }
+    if (term.comparison != QueryExpression::CompareNotEqual)
+      bounds.push_back(bound);
+
+    emit(QueryExpression::OpNumber, (uint32_t) expression->terms.size());
+    expression->terms.push_back(term);
+    return next();
+  }
+
+  if (token.type != TokenString && token.type != TokenIdentifier && token.type != TokenNumber)
+    return fail("Expected a string");
+
+  term.text = token.text;
+  emit(QueryExpression::OpString, (uint32_t) expression->terms.size());
+  expression->terms.push_back(term);
+  return next();
+}
+
+QueryExpression *QueryExpression::compile(const char *source, std::string &error) {
+  QueryExpression *expression = new QueryExpression();
+  QueryParser parser(source, expression);
+  if (!parser.parse(error)) {
+    delete expression;
+    return NULL;
+  }
+  return expression;
+}
+
+bool QueryExpression::testString(const FontCatalog &catalog, const Term &term, uint32_t offset) const {
+  std::unordered_map<uint32_t, bool>::iterator it = term.memo.find(offset);
+  if (it != term.memo.end())
+    return it->second;
+
+  const char *value = catalog.string(offset);
+  bool result;
+  if (term.comparison == CompareContains)
+    result = caseInsensitiveContains(value, term.text.c_str());
+  else
+    result = caseInsensitiveMatch(value, term.text.c_str()) == (term.comparison == CompareEqual);
+
+  term.memo[offset] = result;
+  return result;
+}
+
+bool QueryExpression::matches(const FontCatalog &catalog, const CatalogFace &face) const {
+  bool acc = true;
+  size_t pc = 0;
+
+  while (pc < program.size()) {
+    const Instruction &instruction = program[pc++];
+
+    switch (instruction.op) {
+      case OpString: {
+        const Term &term = terms[instruction.arg];
+        uint32_t offset = term.field == FontFieldFamily ? face.family :
+                          term.field == FontFieldStyle ? face.style :
+                          term.field == FontFieldPostscriptName ? face.postscriptName : face.path;
+        acc = testString(catalog, term, offset);
+        break;
+      }
+
+      case OpNumber: {
+        const Term &term = terms[instruction.arg];
+        // Variable fonts compare true if any value on their axis does
+        int low = term.field == FontFieldWeight ? face.weightMin : face.widthMin;
+        int high = term.field == FontFieldWeight ? face.weightMax : face.widthMax;
+        switch (term.comparison) {
+          case CompareEqual:        acc = low <= term.number && high >= term.number; break;
+          case CompareNotEqual:     acc = low != term.number || high != term.number; break;
+          case CompareLess:         acc = low < term.number; break;
+          case CompareLessEqual:    acc = low <= term.number; break;
+          case CompareGreater:      acc = high > term.number; break;
+          case CompareGreaterEqual: acc = high >= term.number; break;
+          default:                  acc = false; break;
+        }
+        break;
+      }
+
+      case OpFlag:
+        acc = (face.flags & (uint32_t) terms[instruction.arg].number) != 0;
+        break;
+
+      case OpNot:
+        acc = !acc;
+        break;
+
+      case OpJumpIfFalse:
+        if (!acc)
+          pc = instruction.arg;
+        break;
+
+      case OpJumpIfTrue:
+        if (acc)
+          pc = instruction.arg;
+        break;
+    }
+  }
+
+  return acc;
+}
@@ -0,0 +1,86 @@
+#ifndef QUERY_EXPRESSION_H
+#define QUERY_EXPRESSION_H
+
+#include "FontCatalog.h"
+#include "FontQuery.h"
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A boolean filter expression such as
+//
+//   (family = "Inter" or family = "Roboto") and weight >= 500 and not italic
+//
+// The expression is parsed once and compiled to a flat program of tests and
+// conditional jumps, which is then run for every face with short-circuit
+// evaluation. Supported are:
+//
+// * string fields `family`, `style`, `postscriptName` and `path` with `=`,
+//   `!=` (case-insensitive) and `~` (case-insensitive substring)
+// * numeric fields `weight` and `width` with `=`, `!=`, `<`, `<=`, `>`, `>=`,
+//   widths given as a percentage or a width class like --width. A variable
+//   font passes a comparison if any value on the axis does.
+// * boolean fields `italic`, `oblique` and `monospace`, alone or compared to
+//   `true` / `false`
+// * `and` / `&&`, `or` / `||`, `not` / `!` and parentheses
+class QueryExpression {
+public:
+  // Parse and compile `source`. Returns NULL and sets `error` on failure.
+  static QueryExpression *compile(const char *source, std::string &error);
+
+  bool matches(const FontCatalog &catalog, const CatalogFace &face) const;
+
+  // Bounds on weight and width which every match satisfies, taken from
+  // comparisons joined by `and` at the top level. Used to narrow the search
+  // with the catalog's sorted indexes.
+  const ValueRange &weightBound() const { return weightRange; }
+  const ValueRange &widthBound() const { return widthRange; }
+
+private:
+  enum OpCode {
+    OpString,        // acc = string test `term`
+    OpNumber,        // acc = numeric comparison `term`
+    OpFlag,          // acc = face flag `term` is set
+    OpNot,           // acc = !acc
+    OpJumpIfFalse,   // if !acc, continue at `target`
+    OpJumpIfTrue     // if acc, continue at `target`
+  };
+
+  enum Comparison {
+    CompareEqual,
+    CompareNotEqual,
+    CompareLess,
+    CompareLessEqual,
+    CompareGreater,
+    CompareGreaterEqual,
+    CompareContains
+  };
+
+  struct Instruction {
+    OpCode op;
+    uint32_t arg;    // Index into terms, or jump target
+  };
+
+  struct Term {
+    FontField field;
+    Comparison comparison;
+    std::string text;
+    int number;
+
+    // Results of string tests by string pool offset. Every distinct string
+    // is only compared once per query.
+    mutable std::unordered_map<uint32_t, bool> memo;
+  };
+
+  friend class QueryParser;
+
+  bool testString(const FontCatalog &catalog, const Term &term, uint32_t offset) const;
+
+  std::vector<Instruction> program;
+  std::vector<Term> terms;
+  ValueRange weightRange;
+  ValueRange widthRange;
+};
+
+#endif // QUERY_EXPRESSION_H
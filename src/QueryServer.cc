@@ -0,0 +1,585 @@
+#include "QueryServer.h"
+
+#ifdef _WIN32
+
+bool serveQueries(const QueryServerOptions &options, std::string &error) {
+  error = "the query server is not available on Windows";
+  return false;
+}
+
+#else
+
+#include "FontCatalog.h"
+#include "FontQuery.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Platform implementation
+FontDescriptor *substituteFont(const char *postscriptName, const char *string);
+
+typedef std::chrono::steady_clock Clock;
+
+// Lines longer than this are not requests, the client is dropped
+static const size_t MAX_REQUEST_LENGTH = 1 << 20;
+
+// A client which does not take a response within this time is dropped
+static const int SEND_TIMEOUT_SECONDS = 5;
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+  stopRequested = 1;
+}
+
+// Computes the result for a key once among concurrent callers. A caller
+// arriving while the result for its key is computed waits for that result.
+// If the computation throws, every caller of the key gets the exception.
+class SingleFlight {
+public:
+  template <typename Compute>
+  std::string run(const std::string &key, Compute compute, bool &shared) {
+    std::unique_lock<std::mutex> guard(lock);
+    std::map<std::string, std::shared_ptr<Flight> >::iterator it = flights.find(key);
+    if (it != flights.end()) {
+      std::shared_ptr<Flight> flight = it->second;
+      finished.wait(guard, [&]() { return flight->done; });
+      shared = true;
+      if (flight->error)
+        std::rethrow_exception(flight->error);
+      return flight->result;
+    }
+
+    std::shared_ptr<Flight> flight(new Flight());
+    flights[key] = flight;
+    guard.unlock();
+
+    std::string result;
+    std::exception_ptr error;
+    try {
+      result = compute();
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    guard.lock();
+    flight->result = result;
+    flight->error = error;
+    flight->done = true;
+    flights.erase(key);
+    finished.notify_all();
+    shared = false;
+    if (error)
+      std::rethrow_exception(error);
+    return result;
+  }
+
+private:
+  struct Flight {
+    std::string result;
+    std::exception_ptr error;
+    bool done;
+
+    Flight() : done(false) {}
+  };
+
+  std::mutex lock;
+  std::condition_variable finished;
+  std::map<std::string, std::shared_ptr<Flight> > flights;
+};
+
+// Number of recent requests the latency percentiles are taken over
+static const size_t LATENCY_WINDOW = 4096;
+
+// Latencies of the most recent requests in microseconds
+class LatencyWindow {
+public:
+  LatencyWindow() : count(0) {}
+
+  void add(uint64_t micros) {
+    samples[count % LATENCY_WINDOW] = micros;
+    count++;
+  }
+
+  // Percentile `p` (0 to 100) of the window, 0 if it is empty
+  uint64_t percentile(double p) const {
+    size_t size = std::min(count, LATENCY_WINDOW);
+    if (size == 0)
+      return 0;
+
+    std::vector<uint64_t> sorted(samples, samples + size);
+    size_t rank = std::min(size - 1, (size_t) (p / 100 * size));
+    std::nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+  }
+
+  uint64_t maximum() const {
+    size_t size = std::min(count, LATENCY_WINDOW);
+    return size ? *std::max_element(samples, samples + size) : 0;
+  }
+
+private:
+  uint64_t samples[LATENCY_WINDOW];
+  size_t count;
+};
+
+struct Request {
+  std::string line;
+  Clock::time_point received;
+};
+
+struct Client {
+  int fd;
+  std::deque<Request> queue;
+  bool busy;                      // A worker is answering one of its requests
+  bool dropped;                   // Its responses could not be sent
+  bool finished;                  // Its reader has returned
+  std::condition_variable space;  // Signalled when a request is taken
+
+  Client(int fd) : fd(fd), busy(false), dropped(false), finished(false) {}
+  ~Client() { close(fd); }
+};
+
+class QueryServer {
+public:
+  QueryServer(const QueryServerOptions &options)
+      : options(options), stopping(false), clients(0), queued(0), peakQueued(0), requests(0), coalesced(0),
+        pushbacks(0) {}
+
+  // Start `count` worker threads
+  void start(size_t count);
+
+  // Start reading the requests of a new client on its own thread
+  void accept(int fd);
+
+  // Drop all clients and wait for every thread to return
+  void stop();
+
+private:
+  void readRequests(std::shared_ptr<Client> client);
+  void work();
+  void enqueue(const std::shared_ptr<Client> &client, const std::string &line, Clock::time_point received);
+  std::string answer(const std::string &line);
+  std::string compute(const std::vector<std::string> &args);
+  std::string stats();
+
+  const QueryServerOptions &options;
+
+  // Only used by the thread calling start(), accept() and stop()
+  std::vector<std::thread> workers;
+  std::vector<std::pair<std::thread, std::shared_ptr<Client> > > readers;
+
+  // Guards everything below. Clients are in `ready` while they have
+  // requests waiting and none being answered.
+  std::mutex lock;
+  std::condition_variable available;
+  std::deque<std::shared_ptr<Client> > ready;
+  bool stopping;
+  size_t clients;
+  size_t queued;
+  size_t peakQueued;
+  uint64_t requests;
+  uint64_t coalesced;
+  uint64_t pushbacks;
+  LatencyWindow latencies;
+
+  SingleFlight flights;
+
+  // The platform's substitution keeps caches which are not thread safe
+  std::mutex platformLock;
+};
+
+static std::string errorResponse(const char *message) {
+  std::string out = "{\"error\": ";
+  appendJsonString(out, message);
+  out += "}";
+  return out;
+}
+
+static std::string fontResponse(FontDescriptor *font) {
+  std::string out = "{\"font\": ";
+  if (font)
+    font->appendJson(out);
+  else
+    out += "null";
+  out += "}";
+  delete font;
+  return out;
+}
+
+static std::string fontsResponse(const FontCatalog *catalog, const std::vector<uint32_t> &faces) {
+  std::string out = "{\"fonts\": [";
+  for (size_t i = 0; i < faces.size(); i++) {
+    if (i > 0)
+      out += ", ";
+    FontDescriptor *font = catalog->descriptor(faces[i]);
+    font->appendJson(out);
+    delete font;
+  }
+  out += "]}";
+  return out;
+}
+
+static std::vector<std::string> splitArguments(const std::string &line) {
+  char separator = line.find('\t') != std::string::npos ? '\t' : ' ';
+  std::vector<std::string> args;
+  size_t start = 0;
+  while (start <= line.size()) {
+    size_t end = line.find(separator, start);
+    if (end == std::string::npos)
+      end = line.size();
+    if (end > start)
+      args.push_back(line.substr(start, end - start));
+    start = end + 1;
+  }
+  return args;
+}
+
+static bool writeAll(int fd, const std::string &data) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t n = write(fd, data.data() + written, data.size() - written);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    written += (size_t) n;
+  }
+  return true;
+}
+
+void QueryServer::readRequests(std::shared_ptr<Client> client) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    clients++;
+  }
+
+  std::string buffer;
+  char chunk[4096];
+  for (;;) {
+    ssize_t n = read(client->fd, chunk, sizeof(chunk));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+
+    // Latency counts from here, including any wait for queue space
+    Clock::time_point received = Clock::now();
+    buffer.append(chunk, (size_t) n);
+    size_t start = 0;
+    for (size_t end = buffer.find('\n'); end != std::string::npos; end = buffer.find('\n', start)) {
+      size_t length = end > start && buffer[end - 1] == '\r' ? end - start - 1 : end - start;
+      if (length > 0)
+        enqueue(client, buffer.substr(start, length), received);
+      start = end + 1;
+    }
+    buffer.erase(0, start);
+    if (buffer.size() > MAX_REQUEST_LENGTH)
+      break;
+  }
+
+  // Requests still queued are answered, the client goes away with the last
+  std::lock_guard<std::mutex> guard(lock);
+  clients--;
+  client->finished = true;
+}
+
+void QueryServer::enqueue(const std::shared_ptr<Client> &client, const std::string &line, Clock::time_point received) {
+  std::unique_lock<std::mutex> guard(lock);
+  if (client->queue.size() >= options.queueLimit) {
+    // Stop reading until a worker takes a request. Further requests stay in
+    // the socket buffer, and once that is full the client blocks on sending.
+    pushbacks++;
+    client->space.wait(guard, [&]() { return client->queue.size() < options.queueLimit || client->dropped; });
+  }
+  if (client->dropped)
+    return;
+
+  Request request = { line, received };
+  client->queue.push_back(request);
+  queued++;
+  peakQueued = std::max(peakQueued, queued);
+
+  if (!client->busy && client->queue.size() == 1) {
+    ready.push_back(client);
+    available.notify_one();
+  }
+}
+
+void QueryServer::work() {
+  for (;;) {
+    std::shared_ptr<Client> client;
+    Request request;
+    {
+      std::unique_lock<std::mutex> guard(lock);
+      available.wait(guard, [&]() { return !ready.empty() || stopping; });
+      if (stopping)
+        return;
+
+      client = ready.front();
+      ready.pop_front();
+
+      request = client->queue.front();
+      client->queue.pop_front();
+      client->busy = true;
+      queued--;
+      client->space.notify_one();
+    }
+
+    // Writes time out after SEND_TIMEOUT, so a client which does not read its
+    // responses holds a worker that long at most
+    bool sent = writeAll(client->fd, answer(request.line) + "\n");
+    uint64_t micros = (uint64_t) std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - request.received).count();
+
+    std::lock_guard<std::mutex> guard(lock);
+    latencies.add(micros);
+    requests++;
+    client->busy = false;
+    if (!sent && !client->dropped) {
+      // The client went away or stopped reading. Its other requests are
+      // discarded, and shutting the socket down ends its reader.
+      client->dropped = true;
+      queued -= client->queue.size();
+      client->queue.clear();
+      client->space.notify_all();
+      shutdown(client->fd, SHUT_RDWR);
+    }
+    if (!client->queue.empty()) {
+      // To the back, after the other clients waiting
+      ready.push_back(client);
+      available.notify_one();
+    }
+  }
+}
+
+void QueryServer::start(size_t count) {
+  for (size_t i = 0; i < count; i++)
+    workers.push_back(std::thread(&QueryServer::work, this));
+}
+
+void QueryServer::accept(int fd) {
+  // Threads of clients which went away are joined as new ones arrive
+  std::vector<std::pair<std::thread, std::shared_ptr<Client> > > finished;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    for (size_t i = 0; i < readers.size();) {
+      if (readers[i].second->finished) {
+        finished.push_back(std::move(readers[i]));
+        readers[i] = std::move(readers.back());
+        readers.pop_back();
+      } else {
+        i++;
+      }
+    }
+  }
+  for (size_t i = 0; i < finished.size(); i++)
+    finished[i].first.join();
+
+  std::shared_ptr<Client> client(new Client(fd));
+  readers.push_back(std::make_pair(std::thread(&QueryServer::readRequests, this, client), client));
+}
+
+void QueryServer::stop() {
+  {
+    // Shutting the sockets down ends the readers, also those waiting for
+    // queue space, and the workers finish the requests they are answering
+    std::lock_guard<std::mutex> guard(lock);
+    stopping = true;
+    ready.clear();
+    for (size_t i = 0; i < readers.size(); i++) {
+      Client &client = *readers[i].second;
+      client.dropped = true;
+      queued -= client.queue.size();
+      client.queue.clear();
+      client.space.notify_all();
+      shutdown(client.fd, SHUT_RDWR);
+    }
+    available.notify_all();
+  }
+
+  for (size_t i = 0; i < workers.size(); i++)
+    workers[i].join();
+  for (size_t i = 0; i < readers.size(); i++)
+    readers[i].first.join();
+  workers.clear();
+  readers.clear();
+}
+
+std::string QueryServer::answer(const std::string &line) {
+  std::vector<std::string> args = splitArguments(line);
+  if (args.empty())
+    return errorResponse("empty request");
+  if (args[0] == "stats")
+    return stats();
+  if (args[0] != "find-best" && args[0] != "substitute" && args[0] != "fallback-chain")
+    return errorResponse("unknown command");
+
+  // The same arguments give the same answer, however they were separated
+  std::string key;
+  for (size_t i = 0; i < args.size(); i++) {
+    key += args[i];
+    key += '\0';
+  }
+
+  bool shared = false;
+  std::string response;
+  try {
+    response = flights.run(key, [&]() { return compute(args); }, shared);
+  } catch (const std::exception &e) {
+    response = errorResponse((std::string("internal error: ") + e.what()).c_str());
+  }
+  if (shared) {
+    std::lock_guard<std::mutex> guard(lock);
+    coalesced++;
+  }
+  return response;
+}
+
+std::string QueryServer::compute(const std::vector<std::string> &args) {
+  if (args[0] == "substitute") {
+    if (args.size() != 3)
+      return errorResponse("substitute needs a PostScript name and a text");
+    if (!options.platformFallback)
+      return errorResponse("substitute is not available with --catalog");
+
+    // The same single best match as the substitute command
+    std::lock_guard<std::mutex> guard(platformLock);
+    return fontResponse(substituteFont(args[1].c_str(), args[2].c_str()));
+  }
+
+  if (args[0] == "fallback-chain") {
+    if (args.size() < 2)
+      return errorResponse("fallback-chain needs a family");
+    if (!options.platformFallback)
+      return errorResponse("fallback-chain is not available with --catalog");
+
+    const char *language = NULL;
+    const char *style = NULL;
+    for (size_t i = 2; i < args.size(); i++) {
+      if (args[i].compare(0, 7, "--lang=") == 0)
+        language = args[i].c_str() + 7;
+      else if (args[i].compare(0, 8, "--style=") == 0)
+        style = args[i].c_str() + 8;
+      else
+        return errorResponse("unknown fallback-chain option");
+    }
+
+    // Chains are kept by the catalog, so each family, language and style
+    // is resolved once for the life of the server
+    std::lock_guard<std::mutex> guard(platformLock);
+    FontCatalog *catalog = FontCatalog::shared();
+    const std::vector<uint32_t> *chain = catalog->fallbackChain(args[1].c_str(), language, style);
+    if (!chain)
+      return errorResponse("fallback chains are not supported on this platform");
+    return fontsResponse(catalog, *chain);
+  }
+
+  QueryOptions query;
+  for (size_t i = 1; i < args.size(); i++) {
+    bool matched = false;
+    std::string error;
+    if (!query.parse(args[i].c_str(), matched, error))
+      return errorResponse(error.c_str());
+    if (!matched)
+      return errorResponse("unknown query option");
+  }
+  query.finish();
+
+  FontDescriptor *descriptor = query.descriptor();
+  FontDescriptor *font = findFont(descriptor, &query.filter);
+  delete descriptor;
+  return fontResponse(font);
+}
+
+std::string QueryServer::stats() {
+  std::lock_guard<std::mutex> guard(lock);
+  char out[512];
+  snprintf(out, sizeof(out),
+           "{\"clients\": %lu, \"queued\": %lu, \"peakQueued\": %lu, \"requests\": %llu, \"coalesced\": %llu, "
+           "\"pushbacks\": %llu, \"latency\": {\"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"max\": %llu}}",
+           (unsigned long) clients, (unsigned long) queued, (unsigned long) peakQueued,
+           (unsigned long long) requests, (unsigned long long) coalesced, (unsigned long long) pushbacks,
+           (unsigned long long) latencies.percentile(50), (unsigned long long) latencies.percentile(90),
+           (unsigned long long) latencies.percentile(99), (unsigned long long) latencies.maximum());
+  return out;
+}
+
+bool serveQueries(const QueryServerOptions &options, std::string &error) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (options.socketPath.empty() || options.socketPath.size() >= sizeof(address.sun_path)) {
+    error = "invalid socket path";
+    return false;
+  }
+  strcpy(address.sun_path, options.socketPath.c_str());
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0) {
+    error = "can not create a socket";
+    return false;
+  }
+
+  // A socket left behind by a previous server is replaced
+  struct stat st;
+  if (lstat(address.sun_path, &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(address.sun_path);
+
+  if (bind(listener, (sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 128) != 0) {
+    close(listener);
+    error = "can not listen on " + options.socketPath;
+    return false;
+  }
+
+  // Build the catalog before the first request. The layout tags of all
+  // faces are read now, as reading them on demand would change the catalog
+  // while other workers query it.
+  FontCatalog *catalog = FontCatalog::shared();
+  catalog->loadLayout(catalog->faceIds());
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, requestStop);
+  signal(SIGTERM, requestStop);
+
+  QueryServer server(options);
+  server.start(options.workers ? options.workers : std::max(2u, std::thread::hardware_concurrency()));
+
+  pollfd listening = { listener, POLLIN, 0 };
+  while (!stopRequested) {
+    if (poll(&listening, 1, 250) <= 0)
+      continue;
+
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0)
+      continue;
+
+    timeval timeout = { SEND_TIMEOUT_SECONDS, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    server.accept(fd);
+  }
+
+  // No thread uses the server or the catalog once this returns
+  close(listener);
+  unlink(address.sun_path);
+  server.stop();
+  return true;
+}
+
+#endif
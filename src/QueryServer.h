@@ -0,0 +1,41 @@
+#ifndef QUERY_SERVER_H
+#define QUERY_SERVER_H
+
+#include <stddef.h>
+#include <string>
+
+// A long-lived server answering queries on a Unix domain socket, so clients
+// do not enumerate the fonts for every query. A request is one line of
+// arguments, separated by tabs, or by spaces if the line has no tab. The
+// response is one line of JSON:
+//
+//   find-best <query options>   {"font": {...}} or {"font": null}
+//   substitute <ps> <text>      {"font": {...}} or {"font": null}
+//   fallback-chain <family> [--lang=<tag>] [--style=<style>]
+//                               {"fonts": [...]}
+//   stats                       {"clients": ..., "queued": ..., "latency": {...}, ...}
+//
+// or {"error": "..."}. A client gets its responses in the order of its
+// requests, and may send further requests without waiting.
+//
+// Identical requests which arrive while one of them is being answered are
+// answered together from a single computation. Every client has a bounded
+// queue; when it is full the server stops reading from that client until
+// a request was taken, so a burst pushes back on its sender instead of
+// growing the queue. Workers take requests from the clients in turn, so
+// one busy client does not hold up the others.
+struct QueryServerOptions {
+  std::string socketPath;
+  size_t workers;          // Threads answering requests, 0 for one per core
+  size_t queueLimit;       // Requests waiting per client before push back
+  bool platformFallback;   // Whether substitute and fallback-chain may use the platform
+
+  QueryServerOptions() : workers(0), queueLimit(64), platformFallback(true) {}
+};
+
+// Serve until SIGINT or SIGTERM, then drop the clients and wait for all
+// threads to finish. Returns false and sets `error` if the
+// socket can not be set up or this platform has no Unix domain sockets.
+bool serveQueries(const QueryServerOptions &options, std::string &error);
+
+#endif // QUERY_SERVER_H
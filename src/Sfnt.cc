@@ -0,0 +1,117 @@
+#include "Sfnt.h"
+
+static const uint32_t TAG_TTCF = SFNT_TAG('t', 't', 'c', 'f');
+
+std::string sfntTagName(uint32_t tag) {
+  std::string name;
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    char c = (char) ((tag >> shift) & 0xFF);
+    name += (c >= 0x20 && c < 0x7F) ? c : '?';
+  }
+  return name;
+}
+
+bool SfntFont::parse(const uint8_t *data, size_t size, uint32_t offset, std::string &error) {
+  tables.clear();
+
+  if ((size_t) offset + 12 > size) {
+    error = "table directory is outside of the file";
+    return false;
+  }
+
+  version = readU32(data + offset);
+  if (version != 0x00010000 && version != SFNT_TAG('O', 'T', 'T', 'O') &&
+      version != SFNT_TAG('t', 'r', 'u', 'e') && version != SFNT_TAG('t', 'y', 'p', '1')) {
+    error = "unknown sfnt version";
+    return false;
+  }
+
+  uint16_t numTables = readU16(data + offset + 4);
+  if (numTables == 0) {
+    error = "font has no tables";
+    return false;
+  }
+
+  if ((size_t) offset + 12 + (size_t) numTables * 16 > size) {
+    error = "table directory is truncated";
+    return false;
+  }
+
+  tables.resize(numTables);
+  const uint8_t *record = data + offset + 12;
+  for (uint16_t i = 0; i < numTables; i++, record += 16) {
+    tables[i].tag = readU32(record);
+    tables[i].checksum = readU32(record + 4);
+    tables[i].offset = readU32(record + 8);
+    tables[i].length = readU32(record + 12);
+  }
+
+  return true;
+}
+
+const SfntTable *SfntFont::findTable(uint32_t tag) const {
+  for (size_t i = 0; i < tables.size(); i++) {
+    if (tables[i].tag == tag)
+      return &tables[i];
+  }
+  return NULL;
+}
+
+const uint8_t *SfntFont::tableData(const uint8_t *data, size_t size, uint32_t tag, uint32_t *length) const {
+  const SfntTable *table = findTable(tag);
+  if (!table || (uint64_t) table->offset + table->length > size)
+    return NULL;
+
+  *length = table->length;
+  return data + table->offset;
+}
+
+bool sfntFontOffsets(const uint8_t *data, size_t size, std::vector<uint32_t> &offsets, std::string &error) {
+  offsets.clear();
+
+  if (size < 12) {
+    error = "file is too small to be a font";
+    return false;
+  }
+
+  if (readU32(data) != TAG_TTCF) {
+    offsets.push_back(0);
+    return true;
+  }
+
+  uint32_t numFonts = readU32(data + 8);
+  if (numFonts == 0) {
+    error = "collection has no fonts";
+    return false;
+  }
+
+  if (12 + (uint64_t) numFonts * 4 > size) {
+    error = "collection header is truncated";
+    return false;
+  }
+
+  for (uint32_t i = 0; i < numFonts; i++)
+    offsets.push_back(readU32(data + 12 + i * 4));
+  return true;
+}
+
+uint32_t sfntChecksum(const uint8_t *data, size_t size, uint32_t offset, uint32_t length) {
+  uint32_t sum = 0;
+  uint64_t end = (uint64_t) offset + length;
+  uint64_t available = end <= size ? end : (offset < size ? size : offset);
+  uint64_t pos = offset;
+
+  // Whole words inside the file
+  for (; pos + 4 <= available; pos += 4)
+    sum += readU32(data + pos);
+
+  // The last partial word, padded with zeros
+  if (pos < end) {
+    uint8_t word[4] = { 0, 0, 0, 0 };
+    for (int i = 0; pos + i < available && i < 4; i++)
+      word[i] = data[pos + i];
+    sum += readU32(word);
+  }
+
+  return sum;
+}
@@ -0,0 +1,65 @@
+#ifndef SFNT_H
+#define SFNT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Minimal reader for the sfnt container used by TrueType and OpenType fonts
+// and TrueType/OpenType collections. Only the table directory is parsed
+// here; readers for individual tables work on the table bytes.
+
+#define SFNT_TAG(a, b, c, d) \
+  (((uint32_t) (a) << 24) | ((uint32_t) (b) << 16) | ((uint32_t) (c) << 8) | (uint32_t) (d))
+
+static inline uint16_t readU16(const uint8_t *p) {
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
+
+static inline int16_t readS16(const uint8_t *p) {
+  return (int16_t) readU16(p);
+}
+
+static inline uint32_t readU32(const uint8_t *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+// Tag as a printable four character string
+std::string sfntTagName(uint32_t tag);
+
+struct SfntTable {
+  uint32_t tag;
+  uint32_t checksum;
+  uint32_t offset;
+  uint32_t length;
+};
+
+// One font of a file, i.e. one table directory
+class SfntFont {
+public:
+  // Parse the table directory at `offset`. On failure `error` says why. The
+  // tables themselves are not checked against the bounds of the file.
+  bool parse(const uint8_t *data, size_t size, uint32_t offset, std::string &error);
+
+  // The table with `tag`, or NULL
+  const SfntTable *findTable(uint32_t tag) const;
+
+  // Bytes of the table with `tag` if it lies within the file, else NULL
+  const uint8_t *tableData(const uint8_t *data, size_t size, uint32_t tag, uint32_t *length) const;
+
+  uint32_t version;
+  std::vector<SfntTable> tables;
+};
+
+// Offsets of the table directories of all fonts in a file: one for a plain
+// font file, one per font for a collection ('ttcf'). Returns false if the
+// file is neither.
+bool sfntFontOffsets(const uint8_t *data, size_t size, std::vector<uint32_t> &offsets, std::string &error);
+
+// The sfnt checksum of `length` bytes at `offset`: the sum of big-endian
+// 32-bit words, the last one padded with zeros. Bytes outside the file count
+// as zero.
+uint32_t sfntChecksum(const uint8_t *data, size_t size, uint32_t offset, uint32_t length);
+
+#endif // SFNT_H
@@ -1,9 +1,26 @@
+#include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <mutex>
+#include <thread>
 #include "FontDescriptor.h"
 #include "FontQuery.h"
+#include "FontCatalog.h"
+#include "FontValidator.h"
+#include "FontFingerprint.h"
+#include "FontSimilarity.h"
+#include "Itemizer.h"
+#include "ParallelFor.h"
+#include "QueryServer.h"
+#include "Sfnt.h"
+#ifdef QUERY_CHECK
+#include "QueryCheck.h"
+#endif
 
 // Platform implementations
 ResultSet *getAvailableFonts();
@@ -17,14 +34,71 @@ void printUsage() {
   std::cout << "  find-best <query>      - Find the best font matching the query" << std::endl;
   std::cout << "  substitute <ps> <text> - Find a font that can display the given text" << std::endl;
   std::cout << "  families               - List all available font families" << std::endl;
+  std::cout << "    --with-faces         - Nest the faces of each family" << std::endl;
+  std::cout << "  itemize <ps> [file]    - Split UTF-8 text from a file or stdin into font runs" << std::endl;
+  std::cout << "  fallback-chain <family> - List the fonts to try in order for a family or generic family" << std::endl;
+  std::cout << "    --lang=<tag>         - Language of the text, like ja or zh-tw" << std::endl;
+  std::cout << "    --style=<style>      - Style of the text, like Bold" << std::endl;
+  std::cout << "  metrics [ps...]        - Print the vertical metrics of the given fonts, or of all fonts" << std::endl;
+  std::cout << "  similar <ps>           - Find the fonts which look most like the given font" << std::endl;
+  std::cout << "    --top=<k>            - Number of fonts to return (default 10)" << std::endl;
+  std::cout << "  fingerprint            - Find groups of fonts which render the same, e.g. renamed copies" << std::endl;
+  std::cout << "    --threshold=<bits>   - Number of differing fingerprint bits still counted as the same (0-15, default 8)" << std::endl;
+  std::cout << "    --jobs=<n>           - Number of fonts to render at once" << std::endl;
+  std::cout << "    --output=<file>      - Save the catalog with the fingerprints, for use with --catalog" << std::endl;
+  std::cout << "  snapshot save <file>   - Save the catalog of all fonts to a file" << std::endl;
+  std::cout << "    --shard=<i>/<n>      - Only save the fonts of the i-th of n shards, split by path" << std::endl;
+  std::cout << "    --full               - Also read the metrics and render the fingerprints of the fonts" << std::endl;
+  std::cout << "    --jobs=<n>           - Number of fonts to render at once" << std::endl;
+  std::cout << "  merge <out> <file>...  - Combine saved catalogs, e.g. shards, into one catalog" << std::endl;
+  std::cout << "  diff <old> <new>       - List fonts added, removed or changed between two saved catalogs" << std::endl;
+  std::cout << "  warm                   - Build the font caches and save the catalog, e.g. at image build time" << std::endl;
+  std::cout << "    --jobs=<n>           - Number of font directories to cache at once" << std::endl;
+  std::cout << "    --output=<file>      - Where to save the catalog, instead of the user's cache directory" << std::endl;
+  std::cout << "  validate               - Check the files of all fonts for damage, one JSON line per font" << std::endl;
+  std::cout << "    --strict             - Treat checksum mismatches as errors" << std::endl;
+  std::cout << "    --shard=<i>/<n>      - Only check the fonts of the i-th of n shards, split by path" << std::endl;
+  std::cout << "    --jobs=<n>           - Number of files to check at once" << std::endl;
+  std::cout << "  serve                  - Answer find-best, substitute, fallback-chain and stats requests on a Unix socket" << std::endl;
+  std::cout << "    --socket=<path>      - Path of the socket" << std::endl;
+  std::cout << "    --workers=<n>        - Number of requests to answer at once" << std::endl;
+  std::cout << "    --queue=<n>          - Requests a client may have waiting before it is pushed back (default 64)" << std::endl;
+#ifdef QUERY_CHECK
+  std::cout << "  check-queries          - Compare random queries with a plain scan, then time a few, on synthetic fonts" << std::endl;
+  std::cout << "    --faces=<n>          - Number of synthetic faces (default 300000)" << std::endl;
+  std::cout << "    --iterations=<n>     - Number of random queries (default 1000)" << std::endl;
+  std::cout << "    --runs=<n>           - Number of runs of each timed query (default 20)" << std::endl;
+  std::cout << "    --seed=<n>           - Seed of the synthetic fonts and queries" << std::endl;
+#endif
+  std::cout << "Global options:" << std::endl;
+  std::cout << "  --catalog=<file>       - Use a catalog saved with snapshot save instead of this system's fonts" << std::endl;
+  std::cout << "                           Without it, Linux reuses the catalog saved in the cache directory" << std::endl;
+  std::cout << "                           while the fonts are unchanged, and builds it once for concurrent runs" << std::endl;
   std::cout << "Query options (for find and find-best):" << std::endl;
   std::cout << "  --family=<name>        - Filter by font family name" << std::endl;
   std::cout << "  --style=<style>        - Filter by font style" << std::endl;
   std::cout << "  --postscript=<name>    - Filter by PostScript name" << std::endl;
   std::cout << "  --monospace            - Filter for monospace fonts" << std::endl;
   std::cout << "  --italic               - Filter for italic fonts" << std::endl;
-  std::cout << "  --weight=<weight>      - Filter by weight (100-900)" << std::endl;
-  std::cout << "  --width=<width>        - Filter by width (1-9)" << std::endl;
+  std::cout << "  --weight=<weight>      - Filter by weight (1-1000), or a range like 300..600" << std::endl;
+  std::cout << "  --width=<width>        - Filter by width in percent (50-200) or class (1-9)," << std::endl;
+  std::cout << "                           or a range like 75..100" << std::endl;
+  std::cout << "  --lang=<tags>          - Filter by supported language, like ja or zh-tw. Repeat to require" << std::endl;
+  std::cout << "                           several languages, separate with commas to accept any of them" << std::endl;
+  std::cout << "  --script=<tags>        - Filter by OpenType script tag in GSUB or GPOS, like arab or deva" << std::endl;
+  std::cout << "  --feature=<tags>       - Filter by OpenType feature tag in GSUB or GPOS, like init or akhn" << std::endl;
+  std::cout << "  --where=<expression>   - Filter by an expression, for example" << std::endl;
+  std::cout << "                           (family=Inter or family=Roboto) and weight>=500 and not italic" << std::endl;
+  std::cout << "Ordering options (for list, find and families --with-faces):" << std::endl;
+  std::cout << "  --sort-by=[-]<field>   - Sort fonts by a field, descending with '-'" << std::endl;
+  std::cout << "  --group-by=[-]<field>  - Group fonts by a field (list and find only)" << std::endl;
+  std::cout << "Output options (for list, find, find-best, families --with-faces, similar, fallback-chain and fingerprint):" << std::endl;
+  std::cout << "  --fields=<fields>      - Add optional fields to each font: metrics, aliases, layout," << std::endl;
+  std::cout << "                           and size, mtime and inode of the font file" << std::endl;
+  std::cout << "Paging options (for list, find and families):" << std::endl;
+  std::cout << "  --limit=<n>            - Return at most n results" << std::endl;
+  std::cout << "  --offset=<n>           - Skip the first n results" << std::endl;
+  std::cout << "  --cursor=<cursor>      - Continue after the page which returned the cursor" << std::endl;
 }
 
 // Parse an option like --family=Arial
@@ -36,6 +110,416 @@ const char* parseOption(const char* arg, const char* option) {
   return NULL;
 }
 
+// Parse the value of a count option like --limit=10. Prints the error and
+// returns false if `val` is not a non-negative decimal number.
+bool parseCount(const char* option, const char* val, size_t& count) {
+  char* end = NULL;
+  errno = 0;
+  unsigned long long value = isdigit((unsigned char) val[0]) ? strtoull(val, &end, 10) : 0;
+  if (!end || *end != '\0' || errno == ERANGE || value > SIZE_MAX) {
+    std::cerr << "Invalid value for " << option << ", expected a number: " << val << std::endl;
+    return false;
+  }
+  count = (size_t) value;
+  return true;
+}
+
+// Parse a paging option, setting `paged` if `arg` is one. Prints the error
+// and returns false if its value is invalid.
+bool parsePageOption(const char* arg, PageOptions& page, bool& paged) {
+  if (const char* val = parseOption(arg, "--limit")) {
+    if (!parseCount("--limit", val, page.limit)) {
+      return false;
+    }
+  }
+  else if (const char* val = parseOption(arg, "--offset")) {
+    if (!parseCount("--offset", val, page.offset)) {
+      return false;
+    }
+  }
+  else if (const char* val = parseOption(arg, "--cursor")) {
+    page.cursor = val;
+  }
+  else {
+    return true;
+  }
+  paged = true;
+  return true;
+}
+
+// Parse a field option like --sort-by=-weight, setting `matched` if `arg` is
+// one. Prints the error and returns false if the field is unknown.
+bool parseFieldOption(const char* arg, const char* option, FontField& field, bool& descending, bool& present,
+                      bool& matched) {
+  const char* val = parseOption(arg, option);
+  if (!val) {
+    return true;
+  }
+
+  matched = true;
+  descending = val[0] == '-';
+  if (!parseFontField(descending ? val + 1 : val, field)) {
+    std::cerr << "Unknown field for " << option << ": " << val << std::endl;
+    return false;
+  }
+  present = true;
+  return true;
+}
+
+// Sorting and grouping options shared by list, find and families
+struct OrderOptions {
+  bool sorted;
+  FontField sortBy;
+  bool sortDescending;
+  bool grouped;
+  FontField groupBy;
+  bool groupDescending;
+
+  OrderOptions() : sorted(false), sortBy(FontFieldFamily), sortDescending(false),
+                   grouped(false), groupBy(FontFieldFamily), groupDescending(false) {}
+
+  // Parse `arg` if it is --sort-by or --group-by, setting `matched`. Returns
+  // false if its value is invalid.
+  bool parse(const char* arg, bool& matched) {
+    return parseFieldOption(arg, "--sort-by", sortBy, sortDescending, sorted, matched) &&
+           parseFieldOption(arg, "--group-by", groupBy, groupDescending, grouped, matched);
+  }
+};
+
+// Append a JSON array of strings to `out`
+void appendJsonStringArray(std::string& out, const std::vector<std::string>& strings) {
+  out += '[';
+  for (size_t i = 0; i < strings.size(); i++) {
+    if (i > 0) {
+      out += ", ";
+    }
+    appendJsonString(out, strings[i].c_str());
+  }
+  out += ']';
+}
+
+// Check every distinct font file of the catalog on `jobs` threads and print
+// one JSON line per font as soon as its file is done. Returns the number of
+// invalid fonts, which does not include skipped files in other formats.
+size_t validateFonts(FontCatalog* catalog, size_t jobs, bool strict) {
+  std::vector<uint32_t> paths;
+  std::vector<bool> seen;
+  for (uint32_t id = 0; id < catalog->size(); id++) {
+    uint32_t path = catalog->face(id).path;
+    if (path >= seen.size()) {
+      seen.resize(path + 1);
+    }
+    if (!seen[path]) {
+      seen[path] = true;
+      paths.push_back(path);
+    }
+  }
+
+  std::mutex outputLock;
+  size_t invalid = 0;
+  parallelFor(paths.size(), jobs, [&](size_t i) {
+    const char* path = catalog->string(paths[i]);
+    std::vector<FontValidation> results = validateFontFile(path);
+
+    std::string lines;
+    size_t failed = 0;
+    for (size_t j = 0; j < results.size(); j++) {
+      FontValidation& result = results[j];
+      if (strict) {
+        result.errors.insert(result.errors.end(), result.warnings.begin(), result.warnings.end());
+        result.warnings.clear();
+      }
+
+      // Files in formats which are not checked are neither valid nor invalid
+      bool valid = result.errors.empty();
+      if (!valid) {
+        failed++;
+      }
+
+      lines += "{\"path\": ";
+      appendJsonString(lines, path);
+      lines += ", \"index\": " + std::to_string(result.index);
+      if (result.format) {
+        lines += ", \"valid\": null, \"skipped\": \"unsupported format\", \"format\": ";
+        appendJsonString(lines, result.format);
+      } else {
+        lines += valid ? ", \"valid\": true" : ", \"valid\": false";
+      }
+      lines += ", \"errors\": ";
+      appendJsonStringArray(lines, result.errors);
+      lines += ", \"warnings\": ";
+      appendJsonStringArray(lines, result.warnings);
+      lines += "}\n";
+    }
+
+    std::lock_guard<std::mutex> lock(outputLock);
+    fwrite(lines.data(), 1, lines.size(), stdout);
+    invalid += failed;
+  });
+
+  fflush(stdout);
+  return invalid;
+}
+
+// Optional fields of the font objects, which cost extra work to compute
+enum OutputField {
+  OutputFieldMetrics = 1 << 0,
+  OutputFieldAliases = 1 << 1,
+  OutputFieldLayout  = 1 << 2,
+  OutputFieldSize    = 1 << 3,
+  OutputFieldMtime   = 1 << 4,
+  OutputFieldInode   = 1 << 5
+};
+
+// Parse an option like --fields=metrics, setting `matched` if `arg` is one.
+// Prints the error and returns false if a field is unknown.
+bool parseFieldsOption(const char* arg, unsigned& fields, bool& matched) {
+  const char* val = parseOption(arg, "--fields");
+  if (!val) {
+    return true;
+  }
+
+  matched = true;
+
+  std::string list(val);
+  size_t start = 0;
+  while (start <= list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+
+    std::string name = list.substr(start, end - start);
+    if (name == "metrics") {
+      fields |= OutputFieldMetrics;
+    }
+    else if (name == "aliases") {
+      fields |= OutputFieldAliases;
+    }
+    else if (name == "layout") {
+      fields |= OutputFieldLayout;
+    }
+    else if (name == "size") {
+      fields |= OutputFieldSize;
+    }
+    else if (name == "mtime") {
+      fields |= OutputFieldMtime;
+    }
+    else if (name == "inode") {
+      fields |= OutputFieldInode;
+    }
+    else {
+      std::cerr << "Unknown field for --fields: " << name << std::endl;
+      return false;
+    }
+    start = end + 1;
+  }
+  return true;
+}
+
+// Parse the value of --shard, "i/n" for the i-th of n shards counting from
+// 1, into a shard index counting from 0 and the count. Prints the error if it
+// is invalid.
+bool parseShard(const char* val, uint32_t& index, uint32_t& count) {
+  char* end = NULL;
+  unsigned long i = strtoul(val, &end, 10);
+  unsigned long n = *end == '/' ? strtoul(end + 1, &end, 10) : 0;
+  if (*end != '\0' || i < 1 || n < 1 || i > n || n > 0xFFFFFFFFul) {
+    std::cerr << "Invalid shard, expected i/n with 1 <= i <= n: " << val << std::endl;
+    return false;
+  }
+  index = (uint32_t) (i - 1);
+  count = (uint32_t) n;
+  return true;
+}
+
+// Attach the optional `fields` to fonts of the catalog
+void addOutputFields(std::vector<FontDescriptor*>& fonts, unsigned fields) {
+  if (fields == 0) {
+    return;
+  }
+
+  FontCatalog* catalog = FontCatalog::shared();
+  std::vector<int> ids(fonts.size());
+  std::vector<uint32_t> known;
+  for (size_t i = 0; i < fonts.size(); i++) {
+    ids[i] = catalog->findFace(fonts[i]->path, fonts[i]->postscriptName);
+    if (ids[i] >= 0) {
+      known.push_back(ids[i]);
+    }
+  }
+
+  if (fields & OutputFieldMetrics) {
+    catalog->loadMetrics(known);
+    for (size_t i = 0; i < fonts.size(); i++) {
+      delete fonts[i]->metrics;
+      fonts[i]->metrics = ids[i] >= 0 ? new FontMetrics(catalog->metrics(ids[i])) : new FontMetrics();
+    }
+  }
+
+  if (fields & OutputFieldAliases) {
+    for (size_t i = 0; i < fonts.size(); i++) {
+      fonts[i]->aliases.clear();
+      fonts[i]->printAliases = true;
+      if (ids[i] < 0) {
+        continue;
+      }
+
+      for (const CatalogAlias* alias = catalog->aliasesBegin(ids[i]); alias != catalog->aliasesEnd(ids[i]); alias++) {
+        fonts[i]->aliases.push_back(FontAlias((FontNameKind) alias->kind, catalog->string(alias->name),
+                                              catalog->string(alias->language)));
+      }
+    }
+  }
+
+  if (fields & OutputFieldLayout) {
+    catalog->loadLayout(known);
+    for (size_t i = 0; i < fonts.size(); i++) {
+      fonts[i]->scripts.clear();
+      fonts[i]->features.clear();
+      fonts[i]->printLayout = true;
+      if (ids[i] < 0) {
+        continue;
+      }
+
+      FontLayoutTags tags;
+      catalog->layoutTags(ids[i], tags);
+      for (size_t j = 0; j < tags.scripts.size(); j++) {
+        fonts[i]->scripts.push_back(sfntTagName(tags.scripts[j]));
+      }
+      for (size_t j = 0; j < tags.features.size(); j++) {
+        fonts[i]->features.push_back(sfntTagName(tags.features[j]));
+      }
+    }
+  }
+
+  unsigned fileFields = (fields & OutputFieldSize ? FileFieldSize : 0) |
+                        (fields & OutputFieldMtime ? FileFieldMtime : 0) |
+                        (fields & OutputFieldInode ? FileFieldInode : 0);
+  if (fileFields) {
+    // Not kept in the catalog, as files change without the fonts changing
+    std::vector<const char*> paths(fonts.size());
+    for (size_t i = 0; i < fonts.size(); i++) {
+      paths[i] = fonts[i]->path;
+    }
+
+    std::vector<FileStat> stats;
+    statFiles(paths, stats);
+    for (size_t i = 0; i < fonts.size(); i++) {
+      fonts[i]->fileStat = stats[i];
+      fonts[i]->fileFields = fileFields;
+    }
+  }
+}
+
+// Print faces of the catalog as a JSON array, in the same format as ResultSet
+void printFaces(FontCatalog* catalog, const std::vector<uint32_t>& faces, unsigned fields) {
+  ResultSet fonts;
+  for (size_t i = 0; i < faces.size(); i++) {
+    fonts.push_back(catalog->descriptor(faces[i]));
+  }
+  addOutputFields(fonts, fields);
+  fonts.printJson();
+}
+
+// Print groups as an array of objects holding the group's value and its faces
+void printFontGroups(FontCatalog* catalog, const std::vector<FontGroup>& groups, FontField field, unsigned fields) {
+  printf("[");
+  char comma = '\n';
+  for (size_t i = 0; i < groups.size(); i++) {
+    const CatalogFace& face = catalog->face(groups[i].face);
+    printf("%c\n{\n  \"%s\": ", comma, fontFieldName(field));
+    comma = ',';
+
+    switch (field) {
+      case FontFieldFamily:
+        printJsonString(catalog->string(face.family));
+        break;
+      case FontFieldStyle:
+        printJsonString(catalog->string(face.style));
+        break;
+      case FontFieldPostscriptName:
+        printJsonString(catalog->string(face.postscriptName));
+        break;
+      case FontFieldPath:
+        printJsonString(catalog->string(face.path));
+        break;
+      case FontFieldWeight:
+        printf("%i", face.weight);
+        break;
+      case FontFieldWidth:
+        printf("%i", face.width);
+        break;
+      case FontFieldItalic:
+        printf((face.flags & CatalogFaceItalic) ? "true" : "false");
+        break;
+      case FontFieldOblique:
+        printf((face.flags & CatalogFaceOblique) ? "true" : "false");
+        break;
+      case FontFieldMonospace:
+        printf((face.flags & CatalogFaceMonospace) ? "true" : "false");
+        break;
+    }
+
+    printf(",\n  \"faces\": ");
+    printFaces(catalog, groups[i].faces, fields);
+    printf("}\n");
+  }
+  printf("]\n");
+}
+
+// Print the fonts matching a query sorted and grouped as requested
+int printOrderedFonts(FontDescriptor* query, const QueryFilter* filter, const OrderOptions& order, unsigned fields) {
+  FontCatalog* catalog = FontCatalog::shared();
+  std::vector<uint32_t> faces = findFaceIds(query, filter);
+  if (order.sorted) {
+    sortFaces(faces, order.sortBy, order.sortDescending);
+  }
+
+  if (order.grouped) {
+    printFontGroups(catalog, groupFaces(faces, order.groupBy, order.groupDescending), order.groupBy, fields);
+  }
+  else {
+    printFaces(catalog, faces, fields);
+  }
+  return 0;
+}
+
+// Print the cursor member which closes a paged result object
+void printNextCursor(const std::string& nextCursor) {
+  if (nextCursor.empty()) {
+    std::cout << ",\n  \"nextCursor\": null\n}" << std::endl;
+  }
+  else {
+    std::cout << ",\n  \"nextCursor\": \"" << nextCursor << "\"\n}" << std::endl;
+  }
+}
+
+// Print a page of fonts. Paged output wraps the array in an object which
+// also carries the cursor of the next page.
+int printFontPage(FontDescriptor* query, const QueryFilter* filter, const PageOptions& page, bool paged, unsigned fields) {
+  ResultSet* results = NULL;
+  std::string nextCursor;
+  if (!findFonts(query, filter, page, &results, nextCursor)) {
+    std::cerr << "Invalid cursor" << std::endl;
+    return 1;
+  }
+  addOutputFields(*results, fields);
+
+  if (paged) {
+    std::cout << "{\n  \"items\": ";
+    std::cout.flush();
+  }
+  results->printJson();
+  fflush(stdout);
+  if (paged) {
+    printNextCursor(nextCursor);
+  }
+
+  delete results;
+  return 0;
+}
+
 // Print a JSON array of strings
 void printJsonStringArray(const std::vector<std::string>& strings) {
   std::cout << "[" << std::endl;
@@ -51,82 +535,210 @@ void printJsonStringArray(const std::vector<std::string>& strings) {
   std::cout << "]" << std::endl;
 }
 
+// Print a face of a diff, or null if it is not in that catalog
+void printDeltaFace(const FontCatalog& catalog, int id) {
+  if (id < 0) {
+    printf("null");
+    return;
+  }
+
+  FontDescriptor* font = catalog.descriptor(id);
+  font->printJson();
+  delete font;
+}
+
+// Print the differences between two catalogs, one object per face with the
+// face as it was `before` and as it is `after`
+void printCatalogDeltas(const FontCatalog& before, const FontCatalog& after, const std::vector<CatalogDelta>& deltas) {
+  static const char* changes[] = { "added", "removed", "changed" };
+
+  printf("[");
+  for (size_t i = 0; i < deltas.size(); i++) {
+    const CatalogDelta& delta = deltas[i];
+    const FontCatalog& catalog = delta.after >= 0 ? after : before;
+    const CatalogFace& face = catalog.face(delta.after >= 0 ? delta.after : delta.before);
+
+    printf("%s\n{\n  \"change\": \"%s\",\n  \"path\": ", i > 0 ? "," : "", changes[delta.change]);
+    printJsonString(catalog.string(face.path));
+    printf(",\n  \"index\": %u,\n  \"before\": ", face.index);
+    printDeltaFace(before, delta.before);
+    printf(",\n  \"after\": ");
+    printDeltaFace(after, delta.after);
+    printf("\n}");
+  }
+  printf("%s]\n", deltas.empty() ? "" : "\n");
+}
+
+// Print one run of the itemize command
+void printTextRun(const TextRun &run, void *context) {
+  bool *first = (bool *) context;
+  printf("%s\n    {\"start\": %lu, \"length\": %lu, \"codepoints\": %lu, \"font\": %i}",
+         *first ? "" : ",", (unsigned long) run.start, (unsigned long) run.length,
+         (unsigned long) run.count, run.font);
+  *first = false;
+}
+
 int main(int argc, char *argv[]) {
+  // A saved catalog replaces the fonts of this system for all commands.
+  // The option is taken out of the arguments so the commands never see it.
+  const char* catalogPath = NULL;
+  int kept = 1;
+  for (int i = 1; i < argc; i++) {
+    if (const char* val = parseOption(argv[i], "--catalog")) {
+      catalogPath = val;
+    }
+    else {
+      argv[kept++] = argv[i];
+    }
+  }
+  argc = kept;
+
+  if (catalogPath) {
+    // Font fallback is computed by the platform from the fonts it has
+    if (argc > 1 && (strcmp(argv[1], "substitute") == 0 || strcmp(argv[1], "itemize") == 0 ||
+                     strcmp(argv[1], "fallback-chain") == 0)) {
+      std::cerr << "--catalog can not be used with " << argv[1] << std::endl;
+      return 1;
+    }
+
+    std::string error;
+    FontCatalog* catalog = FontCatalog::open(catalogPath, error);
+    if (!catalog) {
+      std::cerr << "Unable to open the catalog: " << error << std::endl;
+      return 1;
+    }
+    FontCatalog::setShared(catalog);
+  }
+
   // Default command is to list all fonts
   if (argc <= 1) {
-    getAvailableFonts()->printJson();
-    return 0;
+    return printFontPage(NULL, NULL, PageOptions(), false, 0);
   }
   
   // Parse command
   const char* command = argv[1];
+  PageOptions page;
+  bool paged = false;
+  
+  OrderOptions order;
+  unsigned fields = 0;
   
   if (strcmp(command, "list") == 0) {
-    getAvailableFonts()->printJson();
+    for (int i = 2; i < argc; i++) {
+      bool matched = false;
+      if (!order.parse(argv[i], matched) || !parseFieldsOption(argv[i], fields, matched) ||
+          (!matched && !parsePageOption(argv[i], page, paged))) {
+        return 1;
+      }
+    }
+
+    if (order.sorted || order.grouped) {
+      if (paged) {
+        std::cerr << "--sort-by and --group-by can not be combined with paging options" << std::endl;
+        return 1;
+      }
+      return printOrderedFonts(NULL, NULL, order, fields);
+    }
+    return printFontPage(NULL, NULL, page, paged, fields);
   }
   else if (strcmp(command, "families") == 0) {
-    std::vector<std::string> families = getAvailableFontFamilies();
+    bool withFaces = false;
+    for (int i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "--with-faces") == 0) {
+        withFaces = true;
+      }
+      else {
+        bool matched = false;
+        if (!order.parse(argv[i], matched) || !parseFieldsOption(argv[i], fields, matched) ||
+            (!matched && !parsePageOption(argv[i], page, paged))) {
+          return 1;
+        }
+      }
+    }
+
+    if (withFaces) {
+      if (paged || order.grouped) {
+        std::cerr << "--with-faces can not be combined with paging options or --group-by" << std::endl;
+        return 1;
+      }
+
+      // Faces without a family name are not part of any family
+      FontCatalog* catalog = FontCatalog::shared();
+      std::vector<uint32_t> faces = catalog->faceIds();
+      faces.erase(std::remove_if(faces.begin(), faces.end(), [catalog](uint32_t id) {
+        return catalog->face(id).family == 0;
+      }), faces.end());
+
+      if (order.sorted) {
+        sortFaces(faces, order.sortBy, order.sortDescending);
+      }
+      printFontGroups(catalog, groupFaces(faces, FontFieldFamily, false), FontFieldFamily, fields);
+      return 0;
+    }
+
+    std::vector<std::string> families;
+    std::string nextCursor;
+    if (!getAvailableFontFamilies(page, families, nextCursor)) {
+      std::cerr << "Invalid cursor" << std::endl;
+      return 1;
+    }
+
+    if (paged) {
+      std::cout << "{\n  \"items\": ";
+    }
     printJsonStringArray(families);
+    if (paged) {
+      printNextCursor(nextCursor);
+    }
   }
   else if (strcmp(command, "find") == 0 || strcmp(command, "find-best") == 0) {
     // Parse query options
-    const char* family = NULL;
-    const char* style = NULL;
-    const char* postscriptName = NULL;
-    bool monospace = false;
-    bool italic = false;
-    FontWeight weight = FontWeightUndefined;
-    FontWidth width = FontWidthUndefined;
-    
+    QueryOptions options;
     for (int i = 2; i < argc; i++) {
       const char* arg = argv[i];
-      
-      if (const char* val = parseOption(arg, "--family")) {
-        family = val;
-      }
-      else if (const char* val = parseOption(arg, "--style")) {
-        style = val;
-      }
-      else if (const char* val = parseOption(arg, "--postscript")) {
-        postscriptName = val;
-      }
-      else if (strcmp(arg, "--monospace") == 0) {
-        monospace = true;
-      }
-      else if (strcmp(arg, "--italic") == 0) {
-        italic = true;
-      }
-      else if (const char* val = parseOption(arg, "--weight")) {
-        weight = (FontWeight)atoi(val);
+      bool matched = false;
+      std::string error;
+
+      if (!options.parse(arg, matched, error)) {
+        std::cerr << error << std::endl;
+        return 1;
       }
-      else if (const char* val = parseOption(arg, "--width")) {
-        width = (FontWidth)atoi(val);
+      if (!matched && (!order.parse(arg, matched) || !parseFieldsOption(arg, fields, matched) ||
+                       (!matched && !parsePageOption(arg, page, paged)))) {
+        return 1;
       }
     }
-    
+    options.finish();
+
     // Create a FontDescriptor from the options
-    FontDescriptor* query = new FontDescriptor(
-      NULL, // path
-      postscriptName,
-      family,
-      style,
-      weight,
-      width,
-      italic,
-      false, // oblique
-      monospace
-    );
-    
+    FontDescriptor* query = options.descriptor();
+    QueryFilter* filter = &options.filter;
+
     if (strcmp(command, "find") == 0) {
       // Find multiple fonts matching the query
-      ResultSet* results = findFonts(query);
-      results->printJson();
-      delete results;
+      if ((order.sorted || order.grouped) && paged) {
+        std::cerr << "--sort-by and --group-by can not be combined with paging options" << std::endl;
+        delete query;
+        return 1;
+      }
+
+      // With only --where, --lang, --script or --feature, those alone decide
+      // which fonts match. Otherwise the fields of the query (including not
+      // italic and not monospace) apply as well.
+      bool filterOptions = filter->where || filter->hasTagFilters();
+      FontDescriptor* matchQuery = (options.hasFields() || !filterOptions) ? query : NULL;
+
+      int status = (order.sorted || order.grouped) ? printOrderedFonts(matchQuery, filter, order, fields)
+                                                   : printFontPage(matchQuery, filter, page, paged, fields);
+      delete query;
+      return status;
     }
     else {
       // Find the best font matching the query
-      FontDescriptor* result = findFont(query);
+      FontDescriptor* result = findFont(query, filter);
       if (result) {
+        std::vector<FontDescriptor*> fonts(1, result);
+        addOutputFields(fonts, fields);
         std::cout << "[" << std::endl;
         result->printJson();
         std::cout << "]" << std::endl;
@@ -160,6 +772,529 @@ int main(int argc, char *argv[]) {
       std::cout << "[]" << std::endl;
     }
   }
+  else if (strcmp(command, "itemize") == 0) {
+    // Need postscript name, text is read from a file or stdin
+    if (argc < 3) {
+      printUsage();
+      return 1;
+    }
+
+    const char* postscriptName = argv[2];
+    FILE* input = stdin;
+    if (argc > 3 && strcmp(argv[3], "-") != 0) {
+      input = fopen(argv[3], "rb");
+      if (!input) {
+        std::cerr << "Unable to open " << argv[3] << std::endl;
+        return 1;
+      }
+    }
+
+    Itemizer itemizer(postscriptName);
+    bool first = true;
+
+    printf("{\n  \"runs\": [");
+    bool ok = itemizer.itemize(input, printTextRun, &first);
+    printf("\n  ],\n  \"fonts\": [");
+
+    const std::vector<FontDescriptor *>& fonts = itemizer.fonts();
+    char comma = '\n';
+    for (size_t i = 0; i < fonts.size(); i++) {
+      putc(comma, stdout);
+      printf("\n");
+      comma = ',';
+      fonts[i]->printJson();
+    }
+    printf("]\n}\n");
+
+    if (input != stdin) {
+      fclose(input);
+    }
+
+    if (itemizer.invalidSequences() > 0) {
+      std::cerr << itemizer.invalidSequences() << " invalid UTF-8 sequences replaced with U+FFFD" << std::endl;
+    }
+
+    if (!ok) {
+      std::cerr << "Error while reading the input" << std::endl;
+      return 1;
+    }
+  }
+  else if (strcmp(command, "fallback-chain") == 0) {
+    if (argc < 3) {
+      printUsage();
+      return 1;
+    }
+
+    const char* language = NULL;
+    const char* style = NULL;
+    for (int i = 3; i < argc; i++) {
+      if (const char* val = parseOption(argv[i], "--lang")) {
+        language = val;
+      }
+      else if (const char* val = parseOption(argv[i], "--style")) {
+        style = val;
+      }
+      else {
+        bool matched = false;
+        if (!parseFieldsOption(argv[i], fields, matched)) {
+          return 1;
+        }
+        if (!matched) {
+          printUsage();
+          return 1;
+        }
+      }
+    }
+
+    FontCatalog* catalog = FontCatalog::shared();
+    const std::vector<uint32_t>* chain = catalog->fallbackChain(argv[2], language, style);
+    if (!chain) {
+      std::cerr << "Fallback chains are not supported on this platform" << std::endl;
+      return 1;
+    }
+    printFaces(catalog, *chain, fields);
+  }
+  else if (strcmp(command, "metrics") == 0) {
+    // Metrics of the named fonts, or of all fonts
+    FontCatalog* catalog = FontCatalog::shared();
+    std::vector<uint32_t> faces;
+    int status = 0;
+    for (int i = 2; i < argc; i++) {
+      int id = catalog->findPostscriptName(argv[i]);
+      if (id < 0) {
+        std::cerr << "Unknown font: " << argv[i] << std::endl;
+        status = 1;
+        continue;
+      }
+      faces.push_back(id);
+    }
+    if (argc <= 2) {
+      faces = FontCatalog::shared()->faceIds();
+    }
+
+    catalog->loadMetrics(faces);
+
+    printf("[");
+    for (size_t i = 0; i < faces.size(); i++) {
+      const CatalogFace& face = catalog->face(faces[i]);
+      printf("%s\n  {\"postscriptName\": ", i > 0 ? "," : "");
+      printJsonString(catalog->string(face.postscriptName));
+      printf(", \"path\": ");
+      printJsonString(catalog->string(face.path));
+      printf(", \"index\": %u, \"metrics\": ", face.index);
+
+      FontDescriptor* font = catalog->descriptor(faces[i]);
+      font->metrics = new FontMetrics(catalog->metrics(faces[i]));
+      font->printMetrics();
+      delete font;
+      putc('}', stdout);
+    }
+    printf("\n]\n");
+    return status;
+  }
+  else if (strcmp(command, "similar") == 0) {
+    if (argc < 3) {
+      printUsage();
+      return 1;
+    }
+
+    size_t top = 10;
+    for (int i = 3; i < argc; i++) {
+      if (const char* val = parseOption(argv[i], "--top")) {
+        if (!parseCount("--top", val, top)) {
+          return 1;
+        }
+        if (top == 0) {
+          std::cerr << "Invalid value for --top, expected at least 1: " << val << std::endl;
+          return 1;
+        }
+      }
+      else {
+        bool matched = false;
+        if (!parseFieldsOption(argv[i], fields, matched)) {
+          return 1;
+        }
+        if (!matched) {
+          printUsage();
+          return 1;
+        }
+      }
+    }
+
+    FontCatalog* catalog = FontCatalog::shared();
+    int id = catalog->findPostscriptName(argv[2]);
+    if (id < 0) {
+      std::cerr << "Unknown font: " << argv[2] << std::endl;
+      return 1;
+    }
+
+    std::vector<SimilarFace> similar = findSimilarFaces(*catalog, id, top);
+    ResultSet fonts;
+    for (size_t i = 0; i < similar.size(); i++) {
+      fonts.push_back(catalog->descriptor(similar[i].face));
+    }
+    addOutputFields(fonts, fields);
+
+    printf("[");
+    for (size_t i = 0; i < fonts.size(); i++) {
+      printf("%s\n{\n  \"distance\": %.4f,\n  \"font\": ", i > 0 ? "," : "", similar[i].distance);
+      fonts[i]->printJson();
+      printf("}");
+    }
+    printf("%s]\n", fonts.empty() ? "" : "\n");
+  }
+  else if (strcmp(command, "fingerprint") == 0) {
+    size_t threshold = 8;
+    size_t jobs = 0;
+    const char* output = NULL;
+    for (int i = 2; i < argc; i++) {
+      if (const char* val = parseOption(argv[i], "--threshold")) {
+        if (!parseCount("--threshold", val, threshold)) {
+          return 1;
+        }
+        if (threshold > FINGERPRINT_MAX_THRESHOLD) {
+          std::cerr << "Invalid value for --threshold, expected at most " << FINGERPRINT_MAX_THRESHOLD << ": " << val << std::endl;
+          return 1;
+        }
+      }
+      else if (const char* val = parseOption(argv[i], "--jobs")) {
+        if (!parseCount("--jobs", val, jobs)) {
+          return 1;
+        }
+      }
+      else if (const char* val = parseOption(argv[i], "--output")) {
+        output = val;
+      }
+      else {
+        bool matched = false;
+        if (!parseFieldsOption(argv[i], fields, matched)) {
+          return 1;
+        }
+        if (!matched) {
+          printUsage();
+          return 1;
+        }
+      }
+    }
+
+    // Fingerprints saved in a catalog are used without rendering
+    FontCatalog* catalog = FontCatalog::shared();
+    std::vector<uint32_t> faces = catalog->faceIds();
+    if (canRenderFingerprints()) {
+      catalog->loadFingerprints(faces, jobs);
+    }
+
+    std::vector<uint32_t> ids;
+    std::vector<FontFingerprint> prints;
+    for (size_t i = 0; i < faces.size(); i++) {
+      if (const FontFingerprint* print = catalog->fingerprint(faces[i])) {
+        ids.push_back(faces[i]);
+        prints.push_back(*print);
+      }
+    }
+    if (prints.empty() && !faces.empty() && !canRenderFingerprints()) {
+      std::cerr << "Fingerprints can not be rendered without FreeType" << std::endl;
+      return 1;
+    }
+
+    std::vector<std::vector<uint32_t> > clusters;
+    clusterFingerprints(prints, (unsigned) threshold, clusters);
+
+    printf("[");
+    for (size_t i = 0; i < clusters.size(); i++) {
+      const FontFingerprint& print = prints[clusters[i][0]];
+      printf("%s\n{\n  \"fingerprint\": \"", i > 0 ? "," : "");
+      for (size_t j = 0; j < FINGERPRINT_GLYPHS; j++) {
+        printf("%016llx", (unsigned long long) print.bits[j]);
+      }
+      printf("\",\n  \"fonts\": ");
+
+      std::vector<uint32_t> members;
+      for (size_t j = 0; j < clusters[i].size(); j++) {
+        members.push_back(ids[clusters[i][j]]);
+      }
+      printFaces(catalog, members, fields);
+      printf("}");
+    }
+    printf("%s]\n", clusters.empty() ? "" : "\n");
+
+    if (prints.size() < faces.size()) {
+      std::cerr << faces.size() - prints.size() << " fonts could not be fingerprinted" << std::endl;
+    }
+
+    std::string error;
+    if (output && !catalog->save(output, error)) {
+      std::cerr << "Unable to save the catalog: " << error << std::endl;
+      return 1;
+    }
+  }
+  else if (strcmp(command, "snapshot") == 0) {
+    if (argc < 4 || strcmp(argv[2], "save") != 0) {
+      printUsage();
+      return 1;
+    }
+
+    uint32_t shardIndex = 0;
+    uint32_t shardCount = 0;
+    bool full = false;
+    size_t jobs = 0;
+    for (int i = 4; i < argc; i++) {
+      if (const char* val = parseOption(argv[i], "--shard")) {
+        if (!parseShard(val, shardIndex, shardCount)) {
+          return 1;
+        }
+      }
+      else if (strcmp(argv[i], "--full") == 0) {
+        full = true;
+      }
+      else if (const char* val = parseOption(argv[i], "--jobs")) {
+        if (!parseCount("--jobs", val, jobs)) {
+          return 1;
+        }
+      }
+      else {
+        printUsage();
+        return 1;
+      }
+    }
+
+    FontCatalog* shard = shardCount ? FontCatalog::shared()->shard(shardIndex, shardCount) : NULL;
+    FontCatalog* catalog = shard ? shard : FontCatalog::shared();
+
+    // Saved catalogs answer --script and --feature without the font files
+    std::vector<uint32_t> faces = catalog->faceIds();
+    catalog->loadLayout(faces);
+    if (full) {
+      catalog->loadMetrics(faces);
+      if (canRenderFingerprints()) {
+        catalog->loadFingerprints(faces, jobs);
+      }
+    }
+
+    std::string error;
+    bool saved = catalog->save(argv[3], error);
+    delete shard;
+    if (!saved) {
+      std::cerr << "Unable to save the catalog: " << error << std::endl;
+      return 1;
+    }
+  }
+  else if (strcmp(command, "merge") == 0) {
+    if (argc < 4) {
+      printUsage();
+      return 1;
+    }
+
+    std::vector<const FontCatalog*> parts;
+    std::string error;
+    for (int i = 3; i < argc && error.empty(); i++) {
+      if (FontCatalog* part = FontCatalog::open(argv[i], error)) {
+        parts.push_back(part);
+      }
+    }
+
+    FontCatalog* merged = error.empty() ? FontCatalog::merge(parts) : NULL;
+    bool saved = merged && merged->save(argv[2], error);
+    delete merged;
+    for (size_t i = 0; i < parts.size(); i++) {
+      delete parts[i];
+    }
+    if (!saved) {
+      std::cerr << "Unable to merge the catalogs: " << error << std::endl;
+      return 1;
+    }
+  }
+  else if (strcmp(command, "diff") == 0) {
+    if (argc != 4) {
+      printUsage();
+      return 1;
+    }
+
+    std::string error;
+    FontCatalog* before = FontCatalog::open(argv[2], error);
+    FontCatalog* after = before ? FontCatalog::open(argv[3], error) : NULL;
+    if (!after) {
+      std::cerr << "Unable to open the catalog: " << error << std::endl;
+      delete before;
+      return 1;
+    }
+
+    std::vector<CatalogDelta> deltas;
+    diffCatalogs(*before, *after, deltas);
+    printCatalogDeltas(*before, *after, deltas);
+
+    delete before;
+    delete after;
+  }
+  else if (strcmp(command, "warm") == 0) {
+    // Exit statuses, so build and boot scripts can tell failures apart
+    enum { WarmOk = 0, WarmUsage = 1, WarmCacheFailed = 2, WarmCatalogFailed = 3 };
+
+    size_t jobs = std::max(4u, 2 * std::thread::hardware_concurrency());
+    std::string output = FontCatalog::defaultPath();
+    for (int i = 2; i < argc; i++) {
+      if (const char* val = parseOption(argv[i], "--jobs")) {
+        if (!parseCount("--jobs", val, jobs)) {
+          return 1;
+        }
+      }
+      else if (const char* val = parseOption(argv[i], "--output")) {
+        output = val;
+      }
+      else {
+        printUsage();
+        return WarmUsage;
+      }
+    }
+
+    std::vector<std::string> failed;
+    size_t directories = warmFontCaches(jobs, failed);
+
+    // Enumerating fonts now only reads the warm caches. The catalog is built
+    // anew even if a current one was saved, as warm is also the way to
+    // refresh it. The layout tags are read ahead too, so --script and
+    // --feature need not open font files.
+    FontCatalog::setShared(FontCatalog::build());
+    FontCatalog* catalog = FontCatalog::shared();
+    catalog->loadLayout(catalog->faceIds());
+    std::string error = output.empty() ? "no cache directory, use --output" : "";
+    bool saved = !output.empty() && catalog->save(output.c_str(), error);
+
+    printf("{\n  \"directories\": %lu,\n  \"failed\": [", (unsigned long) directories);
+    for (size_t i = 0; i < failed.size(); i++) {
+      printf(i > 0 ? ", " : "");
+      printJsonString(failed[i].c_str());
+    }
+    printf("],\n  \"fonts\": %lu,\n  \"catalog\": ", (unsigned long) catalog->size());
+    if (saved) {
+      printJsonString(output.c_str());
+    }
+    else {
+      printf("null");
+    }
+    printf("\n}\n");
+
+    if (!saved) {
+      std::cerr << "Unable to save the catalog: " << error << std::endl;
+      return WarmCatalogFailed;
+    }
+    return failed.empty() ? WarmOk : WarmCacheFailed;
+  }
+  else if (strcmp(command, "validate") == 0) {
+    // Checking is bound by reading the files, so use more threads than cores
+    size_t jobs = std::max(4u, 2 * std::thread::hardware_concurrency());
+    bool strict = false;
+    uint32_t shardIndex = 0;
+    uint32_t shardCount = 0;
+    for (int i = 2; i < argc; i++) {
+      if (strcmp(argv[i], "--strict") == 0) {
+        strict = true;
+      }
+      else if (const char* val = parseOption(argv[i], "--shard")) {
+        if (!parseShard(val, shardIndex, shardCount)) {
+          return 1;
+        }
+      }
+      else if (const char* val = parseOption(argv[i], "--jobs")) {
+        if (!parseCount("--jobs", val, jobs)) {
+          return 1;
+        }
+      }
+      else {
+        printUsage();
+        return 1;
+      }
+    }
+
+    FontCatalog* shard = shardCount ? FontCatalog::shared()->shard(shardIndex, shardCount) : NULL;
+    size_t invalid = validateFonts(shard ? shard : FontCatalog::shared(), jobs, strict);
+    delete shard;
+    if (invalid > 0) {
+      return 1;
+    }
+  }
+  else if (strcmp(command, "serve") == 0) {
+    QueryServerOptions options;
+    options.platformFallback = catalogPath == NULL;
+    for (int i = 2; i < argc; i++) {
+      if (const char* val = parseOption(argv[i], "--socket")) {
+        options.socketPath = val;
+      }
+      else if (const char* val = parseOption(argv[i], "--workers")) {
+        if (!parseCount("--workers", val, options.workers)) {
+          return 1;
+        }
+        if (options.workers == 0) {
+          std::cerr << "Invalid value for --workers, expected at least 1: " << val << std::endl;
+          return 1;
+        }
+      }
+      else if (const char* val = parseOption(argv[i], "--queue")) {
+        if (!parseCount("--queue", val, options.queueLimit)) {
+          return 1;
+        }
+        if (options.queueLimit == 0) {
+          std::cerr << "Invalid value for --queue, expected at least 1: " << val << std::endl;
+          return 1;
+        }
+      }
+      else {
+        printUsage();
+        return 1;
+      }
+    }
+
+    if (options.socketPath.empty()) {
+      std::cerr << "serve needs --socket" << std::endl;
+      return 1;
+    }
+
+    std::string error;
+    if (!serveQueries(options, error)) {
+      std::cerr << "Unable to serve: " << error << std::endl;
+      return 1;
+    }
+  }
+#ifdef QUERY_CHECK
+  else if (strcmp(command, "check-queries") == 0) {
+    size_t faces = 300000;
+    size_t iterations = 1000;
+    size_t runs = 20;
+    size_t seed = 1;
+    for (int i = 2; i < argc; i++) {
+      const char* val = NULL;
+      bool valid;
+      if ((val = parseOption(argv[i], "--faces"))) {
+        valid = parseCount("--faces", val, faces);
+      }
+      else if ((val = parseOption(argv[i], "--iterations"))) {
+        valid = parseCount("--iterations", val, iterations);
+      }
+      else if ((val = parseOption(argv[i], "--runs"))) {
+        valid = parseCount("--runs", val, runs);
+      }
+      else if ((val = parseOption(argv[i], "--seed"))) {
+        valid = parseCount("--seed", val, seed);
+      }
+      else {
+        printUsage();
+        return 1;
+      }
+      if (!valid) {
+        return 1;
+      }
+    }
+
+    if (faces == 0 || runs == 0) {
+      std::cerr << "check-queries needs at least one face and one run" << std::endl;
+      return 1;
+    }
+    if (!checkQueries(faces, iterations, (unsigned) seed)) {
+      return 1;
+    }
+    benchQueries(faces, runs, (unsigned) seed);
+  }
+#endif
   else {
     printUsage();
     return 1;